@@ -265,17 +265,26 @@ static const CRPCCommand vRPCCommands[] =
     { "makekeypair",            &makekeypair,            true,     	false,		true },
     { "dumpprivkey",            &dumpprivkey,            true,      false,      true },
     { "importprivkey",          &importprivkey,          false,     false,      true },
+    { "importmulti",            &importmulti,            false,     false,      true },
     { "listunspent",            &listunspent,            false,     false,      true },
     { "getrawtransaction",      &getrawtransaction,      false,     false,      false },
+    { "gettxfeeinfo",           &gettxfeeinfo,           true,      true,       false },
     { "createrawtransaction",   &createrawtransaction,   false,     false,      false },
     { "decoderawtransaction",   &decoderawtransaction,   false,     false,      false },
     { "signrawtransaction",     &signrawtransaction,     false,     false,      false },
     { "sendrawtransaction",     &sendrawtransaction,     false,     false,      false },
     { "gettxoutsetinfo",        &gettxoutsetinfo,        true,      false,      false },
+    { "getblockfilecacheinfo",  &getblockfilecacheinfo,  true,      true,       false },
+    { "getindexinfo",           &getindexinfo,           true,      true,       false },
     { "gettxout",               &gettxout,               true,      false,      false },
     { "lockunspent",            &lockunspent,            false,     false,      true },
     { "listlockunspent",        &listlockunspent,        false,     false,      true },
+    { "consolidateoutputs",     &consolidateoutputs,     false,     false,      true },
     { "verifychain",            &verifychain,            true,      false,      false },
+    { "getaddresstxids",        &getaddresstxids,        true,      true,       false },
+    { "getaddressbalance",      &getaddressbalance,      true,      true,       false },
+    { "getaddressutxos",        &getaddressutxos,        true,      true,       false },
+    { "getspentinfo",           &getspentinfo,           true,      true,       false },
 };
 
 CRPCTable::CRPCTable()
@@ -1212,9 +1221,16 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "signrawtransaction"     && n > 2) ConvertTo<Array>(params[2], true);
     if (strMethod == "gettxout"               && n > 1) ConvertTo<boost::int64_t>(params[1]);
     if (strMethod == "gettxout"               && n > 2) ConvertTo<bool>(params[2]);
+    if (strMethod == "getaddresstxids"        && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "getaddresstxids"        && n > 2) ConvertTo<boost::int64_t>(params[2]);
+    if (strMethod == "getspentinfo"           && n > 1) ConvertTo<boost::int64_t>(params[1]);
     if (strMethod == "lockunspent"            && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "lockunspent"            && n > 1) ConvertTo<Array>(params[1]);
+    if (strMethod == "consolidateoutputs"     && n > 0) ConvertTo<double>(params[0]);
+    if (strMethod == "consolidateoutputs"     && n > 1) ConvertTo<boost::int64_t>(params[1]);
     if (strMethod == "importprivkey"          && n > 2) ConvertTo<bool>(params[2]);
+    if (strMethod == "importmulti"            && n > 0) ConvertTo<Array>(params[0]);
+    if (strMethod == "importmulti"            && n > 1) ConvertTo<bool>(params[1]);
     if (strMethod == "verifychain"            && n > 0) ConvertTo<boost::int64_t>(params[0]);
     if (strMethod == "verifychain"            && n > 1) ConvertTo<boost::int64_t>(params[1]);
     if (strMethod == "getpoolinfo"            && n > 0) ConvertTo<boost::int64_t>(params[0]);
@@ -0,0 +1,310 @@
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockstore.h"
+#include "main.h"
+
+#include <zlib.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef WIN32
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+CBlockFileCache blockFileCache;
+
+CBlockFile::CBlockFile(const std::string& strPath, bool fMap) : fd(-1), pbegin(NULL), nSize(0)
+{
+#ifdef WIN32
+    fd = _open(strPath.c_str(), _O_RDONLY | _O_BINARY);
+    if (fd == -1)
+        return;
+    struct _stati64 st;
+    if (_fstati64(fd, &st) == 0)
+        nSize = st.st_size;
+    // Memory mapping is not implemented on Windows; reads go through ReadFile.
+#else
+    fd = open(strPath.c_str(), O_RDONLY);
+    if (fd == -1)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) == 0)
+        nSize = st.st_size;
+    if (fMap && nSize > 0 && (uint64)st.st_size == (uint64)nSize) {
+        void* p = mmap(NULL, nSize, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            pbegin = (char*)p;
+            // the mapping keeps its own reference to the file
+            close(fd);
+            fd = -1;
+        }
+    }
+#endif
+}
+
+CBlockFile::~CBlockFile()
+{
+#ifdef WIN32
+    if (fd != -1)
+        _close(fd);
+#else
+    if (pbegin)
+        munmap(pbegin, nSize);
+    if (fd != -1)
+        close(fd);
+#endif
+}
+
+bool CBlockFile::Read(uint64 nPos, char* pch, size_t nRead) const
+{
+    if (pbegin) {
+        if (nPos > nSize || nRead > nSize - nPos)
+            return false;
+        memcpy(pch, pbegin + nPos, nRead);
+        return true;
+    }
+    if (fd == -1)
+        return false;
+#ifdef WIN32
+    // ReadFile with an explicit offset does not move a shared file pointer
+    HANDLE hFile = (HANDLE)_get_osfhandle(fd);
+    while (nRead > 0) {
+        OVERLAPPED ov;
+        memset(&ov, 0, sizeof(ov));
+        ov.Offset = nPos & 0xFFFFFFFF;
+        ov.OffsetHigh = nPos >> 32;
+        DWORD nReadNow = 0;
+        if (!ReadFile(hFile, pch, nRead, &nReadNow, &ov) || nReadNow == 0)
+            return false;
+        pch += nReadNow;
+        nPos += nReadNow;
+        nRead -= nReadNow;
+    }
+#else
+    while (nRead > 0) {
+        ssize_t nReadNow = pread(fd, pch, nRead, nPos);
+        if (nReadNow < 0 && errno == EINTR)
+            continue;
+        if (nReadNow <= 0)
+            return false;
+        pch += nReadNow;
+        nPos += nReadNow;
+        nRead -= nReadNow;
+    }
+#endif
+    return true;
+}
+
+void CBlockFile::AdviseSequential(bool fSequential)
+{
+#ifndef WIN32
+    if (pbegin)
+        posix_madvise(pbegin, nSize, fSequential ? POSIX_MADV_SEQUENTIAL : POSIX_MADV_NORMAL);
+#endif
+}
+
+void CBlockFileCache::EraseKey(const key_type& key)
+{
+    map<key_type, pair<boost::shared_ptr<CBlockFile>, list<key_type>::iterator> >::iterator it = mapFiles.find(key);
+    if (it != mapFiles.end()) {
+        lruFiles.erase(it->second.second);
+        mapFiles.erase(it);
+    }
+}
+
+void CBlockFileCache::SetOptions(unsigned int nMaxFilesIn, bool fMapIn)
+{
+    LOCK(cs);
+    if (fMap != fMapIn) {
+        mapFiles.clear();
+        lruFiles.clear();
+    }
+    nMaxFiles = nMaxFilesIn;
+    fMap = fMapIn;
+    while (lruFiles.size() > nMaxFiles)
+        EraseKey(lruFiles.back());
+}
+
+boost::shared_ptr<CBlockFile> CBlockFileCache::Get(int nFile, bool fUndo, uint64 nMinSize)
+{
+    key_type key(nFile, fUndo);
+    bool fMapNow;
+    {
+        LOCK(cs);
+        map<key_type, pair<boost::shared_ptr<CBlockFile>, list<key_type>::iterator> >::iterator it = mapFiles.find(key);
+        if (it != mapFiles.end()) {
+            const boost::shared_ptr<CBlockFile>& file = it->second.first;
+            // positioned reads see appended data, mappings have to be redone
+            if (!file->IsMapped() || file->size() >= nMinSize) {
+                lruFiles.splice(lruFiles.begin(), lruFiles, it->second.second);
+                nHits++;
+                return file;
+            }
+            EraseKey(key);
+        }
+        nMisses++;
+        fMapNow = fMap;
+    }
+
+    // open outside the lock; a concurrent caller may race us, which only costs a redundant open
+    CDiskBlockPos pos(nFile, 0);
+    boost::shared_ptr<CBlockFile> file(new CBlockFile(GetBlockPosFilename(pos, fUndo ? "rev" : "blk").string(), fMapNow));
+    if (!file->IsValid() || (file->IsMapped() && file->size() < nMinSize))
+        return boost::shared_ptr<CBlockFile>();
+
+    LOCK(cs);
+    if (nMaxFiles == 0 || fMapNow != fMap)
+        return file;
+    EraseKey(key);
+    lruFiles.push_front(key);
+    mapFiles[key] = make_pair(file, lruFiles.begin());
+    while (lruFiles.size() > nMaxFiles)
+        EraseKey(lruFiles.back());
+    return file;
+}
+
+void CBlockFileCache::Erase(int nFile)
+{
+    LOCK(cs);
+    EraseKey(key_type(nFile, false));
+    EraseKey(key_type(nFile, true));
+}
+
+void CBlockFileCache::Clear()
+{
+    LOCK(cs);
+    mapFiles.clear();
+    lruFiles.clear();
+}
+
+void CBlockFileCache::GetStats(CBlockFileCacheStats &stats) const
+{
+    LOCK(cs);
+    stats.nFiles = mapFiles.size();
+    stats.nMaxFiles = nMaxFiles;
+    stats.fMap = fMap;
+    stats.nHits = nHits;
+    stats.nMisses = nMisses;
+}
+
+// Read and check the header of the record at pos; nSize keeps the compression flag
+static bool ReadRecordHeader(const CBlockFile &file, const CDiskBlockPos &pos, bool fUndo, unsigned int &nSize)
+{
+    char header[8];
+    if (!file.Read(pos.nPos - 8, header, sizeof(header)))
+        return false;
+    unsigned char pchMessageStart[4];
+    GetMessageStart(pchMessageStart, fUndo);
+    if (memcmp(header, pchMessageStart, 4))
+        return false;
+    memcpy(&nSize, header + 4, sizeof(nSize));
+    if (fUndo && (nSize & BLOCKRECORD_COMPRESSED))
+        return false;
+    return (nSize & ~BLOCKRECORD_COMPRESSED) <= MAX_BLOCKFILE_SIZE;
+}
+
+bool ReadBlockRecord(const CDiskBlockPos &pos, bool fUndo, CBlockRecord &record)
+{
+    // records are preceded by the message start and their size
+    if (pos.IsNull() || pos.nPos < 8)
+        return false;
+
+    record.file = blockFileCache.Get(pos.nFile, fUndo, pos.nPos);
+    if (!record.file)
+        return false;
+
+    unsigned int nSize;
+    if (!ReadRecordHeader(*record.file, pos, fUndo, nSize))
+        return false;
+    bool fCompressed = (nSize & BLOCKRECORD_COMPRESSED) != 0;
+    nSize &= ~BLOCKRECORD_COMPRESSED;
+
+    uint64 nEnd = (uint64)pos.nPos + nSize + (fUndo ? sizeof(uint256) : 0);
+    const char* pbegin = NULL;
+    const char* pend = NULL;
+    std::vector<char> vchRaw;
+    if (record.file->IsMapped()) {
+        if (record.file->size() < nEnd) {
+            record.file = blockFileCache.Get(pos.nFile, fUndo, nEnd);
+            if (!record.file)
+                return false;
+        }
+        if (record.file->IsMapped()) {
+            pbegin = record.file->begin() + pos.nPos;
+            pend = record.file->begin() + nEnd;
+        }
+    }
+    if (!pbegin) {
+        vchRaw.resize(nEnd - pos.nPos);
+        if (!record.file->Read(pos.nPos, &vchRaw[0], vchRaw.size()))
+            return false;
+        pbegin = &vchRaw[0];
+        pend = pbegin + vchRaw.size();
+    }
+
+    if (fCompressed) {
+        if (!DecompressBlockRecord(pbegin, pend, record.vchData))
+            return false;
+    } else if (!vchRaw.empty()) {
+        record.vchData.swap(vchRaw);
+    } else {
+        record.pbegin = pbegin;
+        record.pend = pend;
+        return true;
+    }
+    record.pbegin = &record.vchData[0];
+    record.pend = record.pbegin + record.vchData.size();
+    return true;
+}
+
+bool GetBlockRecordDiskSize(const CDiskBlockPos &pos, unsigned int &nDiskSize)
+{
+    if (pos.IsNull() || pos.nPos < 8)
+        return false;
+    boost::shared_ptr<CBlockFile> file = blockFileCache.Get(pos.nFile, false, pos.nPos);
+    unsigned int nSize;
+    if (!file || !ReadRecordHeader(*file, pos, false, nSize))
+        return false;
+    nDiskSize = (nSize & ~BLOCKRECORD_COMPRESSED) + 8;
+    return true;
+}
+
+unsigned int EncodeBlockRecord(const char* pbegin, const char* pend, bool fCompress, std::vector<char> &vchRecord)
+{
+    unsigned int nRawSize = pend - pbegin;
+    if (fCompress) {
+        uLongf nCompressed = compressBound(nRawSize);
+        vchRecord.resize(4 + nCompressed);
+        memcpy(&vchRecord[0], &nRawSize, 4);
+        if (compress2((Bytef*)&vchRecord[4], &nCompressed, (const Bytef*)pbegin, nRawSize, Z_DEFAULT_COMPRESSION) == Z_OK &&
+            4 + nCompressed < nRawSize) {
+            vchRecord.resize(4 + nCompressed);
+            return vchRecord.size() | BLOCKRECORD_COMPRESSED;
+        }
+    }
+    vchRecord.assign(pbegin, pend);
+    return nRawSize;
+}
+
+bool DecompressBlockRecord(const char* pbegin, const char* pend, std::vector<char> &vchData)
+{
+    unsigned int nRawSize;
+    if (pend - pbegin < 4)
+        return false;
+    memcpy(&nRawSize, pbegin, 4);
+    if (nRawSize == 0 || nRawSize > MAX_BLOCK_SIZE)
+        return false;
+    vchData.resize(nRawSize);
+    uLongf nDecompressed = nRawSize;
+    if (uncompress((Bytef*)&vchData[0], &nDecompressed, (const Bytef*)(pbegin + 4), pend - pbegin - 4) != Z_OK ||
+        nDecompressed != nRawSize)
+        return false;
+    return true;
+}
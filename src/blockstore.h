@@ -0,0 +1,144 @@
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKSTORE_H
+#define BITCOIN_BLOCKSTORE_H
+
+#include "serialize.h"
+#include "sync.h"
+
+#include <list>
+#include <map>
+#include <boost/shared_ptr.hpp>
+
+struct CDiskBlockPos;
+
+/** Default number of block/undo files kept open by the block file cache */
+static const int DEFAULT_BLOCKFILE_CACHE = 8;
+
+/** Set in the size field of a block record header when the record is compressed. A
+ *  compressed record holds the size of the serialized block (4 bytes), followed by
+ *  the block as a zlib stream. Records are flagged individually, so a block file may
+ *  mix both kinds.
+ */
+static const unsigned int BLOCKRECORD_COMPRESSED = 0x80000000;
+
+/** A blk?????.dat or rev?????.dat file opened for reading. The file is
+ *  memory-mapped when possible; otherwise it is read with positioned reads,
+ *  which are safe to issue from several threads at once. The file stays
+ *  open for as long as a reference to it is held, even if the cache evicts
+ *  it in the meantime.
+ */
+class CBlockFile
+{
+private:
+    int fd;
+    char* pbegin;
+    size_t nSize;
+
+    CBlockFile(const CBlockFile&);
+    void operator=(const CBlockFile&);
+
+public:
+    CBlockFile(const std::string& strPath, bool fMap);
+    ~CBlockFile();
+
+    bool IsValid() const       { return pbegin != NULL || fd != -1; }
+    bool IsMapped() const      { return pbegin != NULL; }
+
+    // mapped range; only meaningful if IsMapped()
+    const char* begin() const  { return pbegin; }
+    const char* end() const    { return pbegin + nSize; }
+
+    // file size at the time it was opened
+    size_t size() const        { return nSize; }
+
+    // read nRead bytes at file position nPos
+    bool Read(uint64 nPos, char* pch, size_t nRead) const;
+
+    // hint the kernel that the file will be read front to back (reindex)
+    void AdviseSequential(bool fSequential = true);
+};
+
+/** A block or undo record read from a block file. Points into the file
+ *  mapping, or into its own buffer when the file is not mapped.
+ */
+class CBlockRecord
+{
+public:
+    boost::shared_ptr<CBlockFile> file;
+    std::vector<char> vchData;
+    const char* pbegin;
+    const char* pend;
+
+    CBlockRecord() : pbegin(NULL), pend(NULL) {}
+
+    const char* begin() const { return pbegin; }
+    const char* end() const   { return pend; }
+};
+
+struct CBlockFileCacheStats
+{
+    unsigned int nFiles;
+    unsigned int nMaxFiles;
+    bool fMap;
+    uint64 nHits;
+    uint64 nMisses;
+};
+
+/** Small LRU of open block/undo files, used to serve random reads without
+ *  reopening and seeking a FILE* for every block or transaction.
+ */
+class CBlockFileCache
+{
+private:
+    typedef std::pair<int, bool> key_type; // (nFile, fUndo)
+
+    mutable CCriticalSection cs;
+    std::list<key_type> lruFiles;
+    std::map<key_type, std::pair<boost::shared_ptr<CBlockFile>, std::list<key_type>::iterator> > mapFiles;
+    unsigned int nMaxFiles;
+    bool fMap;
+    uint64 nHits;
+    uint64 nMisses;
+
+    void EraseKey(const key_type& key);
+
+public:
+    CBlockFileCache(unsigned int nMaxFilesIn = DEFAULT_BLOCKFILE_CACHE, bool fMapIn = true) :
+        nMaxFiles(nMaxFilesIn), fMap(fMapIn), nHits(0), nMisses(0) {}
+
+    // nMaxFiles = 0 opens the file anew for every read; fMap = false uses positioned reads only
+    void SetOptions(unsigned int nMaxFilesIn, bool fMapIn);
+
+    // return the given file; a mapped file is reopened if it is shorter than nMinSize,
+    // as the file may have grown since it was mapped
+    boost::shared_ptr<CBlockFile> Get(int nFile, bool fUndo, uint64 nMinSize = 0);
+
+    // close a file, e.g. after it was truncated or removed
+    void Erase(int nFile);
+    void Clear();
+
+    void GetStats(CBlockFileCacheStats &stats) const;
+};
+
+extern CBlockFileCache blockFileCache;
+
+/** Read the record written at pos by CBlock::WriteToDisk or CBlockUndo::WriteToDisk.
+ *  Compressed block records are returned decompressed. For undo records the trailing
+ *  checksum is included. Returns false if the file cannot be opened or the record
+ *  header does not match.
+ */
+bool ReadBlockRecord(const CDiskBlockPos &pos, bool fUndo, CBlockRecord &record);
+
+/** Size of the block record at pos as stored on disk, header included */
+bool GetBlockRecordDiskSize(const CDiskBlockPos &pos, unsigned int &nDiskSize);
+
+/** Encode a serialized block for storage, compressing it if fCompress is set and that
+ *  makes it smaller. Returns the value for the size field of the record header.
+ */
+unsigned int EncodeBlockRecord(const char* pbegin, const char* pend, bool fCompress, std::vector<char> &vchRecord);
+
+/** Decompress the body of a record flagged BLOCKRECORD_COMPRESSED */
+bool DecompressBlockRecord(const char* pbegin, const char* pend, std::vector<char> &vchData);
+
+#endif // BITCOIN_BLOCKSTORE_H
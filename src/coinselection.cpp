@@ -0,0 +1,260 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinselection.h"
+#include "wallet.h"
+
+#include <algorithm>
+
+using namespace std;
+
+// coins visited by all passes of ApproximateBestSubset together, at most
+static const int64 APPROXIMATE_MAX_STEPS = 1000000;
+
+CInputCoin::CInputCoin(const COutput& output)
+{
+    tx = output.tx;
+    i = output.i;
+    nValue = output.tx->vout[output.i].nValue;
+    nDepth = output.nDepth;
+    fFromMe = output.tx->IsFromMe();
+}
+
+struct CompareInputValue
+{
+    bool operator()(const CInputCoin& a, const CInputCoin& b) const
+    {
+        return a.nValue < b.nValue;
+    }
+    bool operator()(const CInputCoin& a, int64 nValue) const
+    {
+        return a.nValue < nValue;
+    }
+};
+
+void SortCoins(const vector<COutput>& vCoins, vector<CInputCoin>& vSorted)
+{
+    vSorted.clear();
+    vSorted.reserve(vCoins.size());
+    BOOST_FOREACH(const COutput& output, vCoins)
+        vSorted.push_back(CInputCoin(output));
+    random_shuffle(vSorted.begin(), vSorted.end(), GetRandInt);
+    stable_sort(vSorted.begin(), vSorted.end(), CompareInputValue());
+}
+
+CCoinPool::CCoinPool(const vector<CInputCoin>& vSorted, int nConfMine, int nConfTheirs)
+{
+    vCoins.reserve(vSorted.size());
+    vTotal.reserve(vSorted.size() + 1);
+    vTotal.push_back(0);
+    BOOST_FOREACH(const CInputCoin& coin, vSorted)
+    {
+        if (coin.nDepth < (coin.fFromMe ? nConfMine : nConfTheirs))
+            continue;
+        vCoins.push_back(coin);
+        vTotal.push_back(vTotal.back() + coin.nValue);
+    }
+}
+
+bool SelectCoinsBnB(const vector<int64>& vValue, int64 nTarget, int64 nMaxExcess,
+                    vector<char>& vfBest, int64& nBest, bool* pfExhausted, unsigned int nMaxTries)
+{
+    vfBest.assign(vValue.size(), false);
+    nBest = 0;
+    if (pfExhausted)
+        *pfExhausted = false;
+
+    // value of the outputs not decided on yet
+    int64 nAvailable = 0;
+    BOOST_FOREACH(int64 n, vValue)
+        nAvailable += n;
+
+    vector<char> vfIncluded(vValue.size(), false);
+    vector<unsigned int> vSelected; // included outputs, in order
+    int64 nValue = 0;
+    bool fFound = false;
+    unsigned int i = 0; // next output to decide on
+    for (unsigned int nTry = 0; nTry < nMaxTries; nTry++, i++)
+    {
+        bool fBacktrack = false;
+        if (nValue + nAvailable < nTarget || nValue > nTarget + nMaxExcess)
+            fBacktrack = true;
+        else if (nValue >= nTarget)
+        {
+            if (!fFound || nValue < nBest)
+            {
+                fFound = true;
+                nBest = nValue;
+                vfBest = vfIncluded;
+                if (nBest == nTarget)
+                    break; // can't do better
+            }
+            fBacktrack = true;
+        }
+
+        if (fBacktrack)
+        {
+            if (vSelected.empty())
+            {
+                if (pfExhausted)
+                    *pfExhausted = true;
+                break;
+            }
+            // outputs left out after the last included one are undecided again
+            for (--i; i > vSelected.back(); --i)
+                nAvailable += vValue[i];
+            // and the last included one is left out now
+            vfIncluded[i] = false;
+            nValue -= vValue[i];
+            vSelected.pop_back();
+        }
+        else
+        {
+            nAvailable -= vValue[i];
+            // after leaving out an output, including one of the same value gives the same subsets
+            if (i > 0 && !vfIncluded[i-1] && vValue[i] == vValue[i-1])
+                continue;
+            vfIncluded[i] = true;
+            nValue += vValue[i];
+            vSelected.push_back(i);
+        }
+    }
+
+    if (!fFound)
+        vfBest.assign(vValue.size(), false);
+    return fFound;
+}
+
+void ApproximateBestSubset(const vector<int64>& vValue, int64 nTotalLower, int64 nTargetValue,
+                           vector<char>& vfBest, int64& nBest, int iterations)
+{
+    vector<char> vfIncluded;
+
+    vfBest.assign(vValue.size(), true);
+    nBest = nTotalLower;
+
+    if (!vValue.empty())
+        iterations = std::min((int64)iterations, std::max((int64)10, APPROXIMATE_MAX_STEPS / (int64)vValue.size()));
+
+    seed_insecure_rand();
+
+    for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++)
+    {
+        vfIncluded.assign(vValue.size(), false);
+        int64 nTotal = 0;
+        bool fReachedTarget = false;
+        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
+        {
+            for (unsigned int i = 0; i < vValue.size(); i++)
+            {
+                //The solver here uses a randomized algorithm,
+                //the randomness serves no real security purpose but is just
+                //needed to prevent degenerate behavior and it is important
+                //that the rng fast. We do not use a constant random sequence,
+                //because there may be some privacy improvement by making
+                //the selection random.
+                if (nPass == 0 ? insecure_rand()&1 : !vfIncluded[i])
+                {
+                    nTotal += vValue[i];
+                    vfIncluded[i] = true;
+                    if (nTotal >= nTargetValue)
+                    {
+                        fReachedTarget = true;
+                        if (nTotal < nBest)
+                        {
+                            nBest = nTotal;
+                            vfBest = vfIncluded;
+                        }
+                        nTotal -= vValue[i];
+                        vfIncluded[i] = false;
+                    }
+                }
+            }
+        }
+    }
+}
+
+bool SelectCoinsFromPool(const CCoinPool& pool, int64 nTargetValue, CoinSet& setCoinsRet, int64& nValueRet)
+{
+    setCoinsRet.clear();
+    nValueRet = 0;
+
+    const vector<CInputCoin>& vCoins = pool.vCoins;
+    vector<CInputCoin>::const_iterator it = lower_bound(vCoins.begin(), vCoins.end(), nTargetValue, CompareInputValue());
+    if (it != vCoins.end() && it->nValue == nTargetValue)
+    {
+        setCoinsRet.insert(make_pair(it->tx, it->i));
+        nValueRet += it->nValue;
+        return true;
+    }
+
+    // Outputs below the target plus a cent may make up a subset; the next one is the smallest larger output
+    unsigned int nLower = lower_bound(it, vCoins.end(), nTargetValue + CENT, CompareInputValue()) - vCoins.begin();
+    int64 nTotalLower = pool.vTotal[nLower];
+    const CInputCoin* pcoinLowestLarger = (nLower < vCoins.size() ? &vCoins[nLower] : NULL);
+
+    if (nTotalLower == nTargetValue)
+    {
+        for (unsigned int i = 0; i < nLower; ++i)
+        {
+            setCoinsRet.insert(make_pair(vCoins[i].tx, vCoins[i].i));
+            nValueRet += vCoins[i].nValue;
+        }
+        return true;
+    }
+
+    if (nTotalLower < nTargetValue)
+    {
+        if (pcoinLowestLarger == NULL)
+            return false;
+        setCoinsRet.insert(make_pair(pcoinLowestLarger->tx, pcoinLowestLarger->i));
+        nValueRet += pcoinLowestLarger->nValue;
+        return true;
+    }
+
+    // Values of the smaller outputs, largest first
+    vector<int64> vValue(nLower);
+    for (unsigned int i = 0; i < nLower; i++)
+        vValue[i] = vCoins[nLower - 1 - i].nValue;
+
+    // A subset of exactly the target needs no change; failing that, solve subset sum
+    // by stochastic approximation, preferably leaving at least a cent of change
+    vector<char> vfBest;
+    int64 nBest;
+    bool fExhausted;
+    if (!SelectCoinsBnB(vValue, nTargetValue, 0, vfBest, nBest, &fExhausted))
+    {
+        if (!fExhausted || nTotalLower < nTargetValue + CENT)
+            ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
+        if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
+            ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+    }
+
+    // If we have a bigger coin and (either the subset search didn't find a good solution,
+    //                               or the next bigger coin is closer), return the bigger coin
+    if (pcoinLowestLarger &&
+        ((nBest != nTargetValue && nBest < nTargetValue + CENT) || pcoinLowestLarger->nValue <= nBest))
+    {
+        setCoinsRet.insert(make_pair(pcoinLowestLarger->tx, pcoinLowestLarger->i));
+        nValueRet += pcoinLowestLarger->nValue;
+    }
+    else {
+        for (unsigned int i = 0; i < vValue.size(); i++)
+            if (vfBest[i])
+            {
+                const CInputCoin& coin = vCoins[nLower - 1 - i];
+                setCoinsRet.insert(make_pair(coin.tx, coin.i));
+                nValueRet += coin.nValue;
+            }
+
+        //// debug print
+        printf("SelectCoins() best subset: ");
+        for (unsigned int i = 0; i < vValue.size(); i++)
+            if (vfBest[i])
+                printf("%s ", FormatMoney(vValue[i]).c_str());
+        printf("total %s\n", FormatMoney(nBest).c_str());
+    }
+
+    return true;
+}
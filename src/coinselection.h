@@ -0,0 +1,68 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_COINSELECTION_H
+#define BITCOIN_COINSELECTION_H
+
+#include "util.h"
+
+#include <set>
+#include <vector>
+
+class COutput;
+class CWalletTx;
+
+typedef std::set<std::pair<const CWalletTx*,unsigned int> > CoinSet;
+
+/** A spendable wallet output, with what coin selection needs to know about it */
+class CInputCoin
+{
+public:
+    const CWalletTx* tx;
+    unsigned int i;
+    int64 nValue;
+    int nDepth;
+    bool fFromMe;
+
+    CInputCoin(const COutput& output);
+};
+
+/** Sort outputs by value, ascending. Outputs of the same value are left in random
+ *  order, so that picking the first of them picks one at random.
+ */
+void SortCoins(const std::vector<COutput>& vCoins, std::vector<CInputCoin>& vSorted);
+
+/** The outputs of a sorted list that have enough confirmations to be spent,
+ *  still sorted by value, and their running totals.
+ */
+class CCoinPool
+{
+public:
+    std::vector<CInputCoin> vCoins;
+    std::vector<int64> vTotal; // vTotal[k] is the value of the first k outputs
+
+    CCoinPool(const std::vector<CInputCoin>& vSorted, int nConfMine, int nConfTheirs);
+};
+
+/** Look for a subset of vValue, sorted by value descending, worth between nTarget and
+ *  nTarget + nMaxExcess, with the least excess. Depth-first search over including or
+ *  leaving out each value, stopped after nMaxTries steps; returns false if none was found.
+ *  pfExhausted is set when the whole tree was searched, i.e. there is no such subset.
+ */
+bool SelectCoinsBnB(const std::vector<int64>& vValue, int64 nTarget, int64 nMaxExcess,
+                    std::vector<char>& vfBest, int64& nBest, bool* pfExhausted = NULL,
+                    unsigned int nMaxTries = 100000);
+
+/** Look for a small subset of vValue worth at least nTarget by stochastic approximation.
+ *  The number of passes is limited so that large pools take bounded time.
+ */
+void ApproximateBestSubset(const std::vector<int64>& vValue, int64 nTotalLower, int64 nTargetValue,
+                           std::vector<char>& vfBest, int64& nBest, int iterations = 1000);
+
+/** Select outputs of a pool worth at least nTargetValue. A single output of the target
+ *  value wins; then a subset of the smaller outputs of exactly the target value; then
+ *  the smaller of the best subset, avoiding sub-cent change, and the next bigger output.
+ */
+bool SelectCoinsFromPool(const CCoinPool& pool, int64 nTargetValue, CoinSet& setCoinsRet, int64& nValueRet);
+
+#endif
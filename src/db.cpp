@@ -44,6 +44,7 @@ CDBEnv::CDBEnv() : dbenv(DB_CXX_NO_EXCEPTIONS)
 {
     fDbEnvInit = false;
     fMockDb = false;
+    fUseLevelDb = false;
 }
 
 CDBEnv::~CDBEnv()
@@ -208,14 +209,14 @@ bool CDBEnv::Salvage(std::string strFile, bool fAggressive,
 void CDBEnv::CheckpointLSN(std::string strFile)
 {
     dbenv.txn_checkpoint(0, 0, 0);
-    if (fMockDb)
+    if (fMockDb || fUseLevelDb)
         return;
     dbenv.lsn_reset(strFile.c_str(), 0);
 }
 
 
 CDB::CDB(const char *pszFile, const char* pszMode) :
-    pdb(NULL), activeTxn(NULL)
+    pdb(NULL), pldb(NULL), activeTxn(NULL), activeBatch(NULL)
 {
     int ret;
     if (pszFile == NULL)
@@ -234,6 +235,26 @@ CDB::CDB(const char *pszFile, const char* pszMode) :
 
         strFile = pszFile;
         ++bitdb.mapFileUseCount[strFile];
+
+        if (bitdb.fUseLevelDb)
+        {
+            try {
+                pldb = bitdb.GetLevelDb(strFile);
+            } catch (std::runtime_error &e) {
+                --bitdb.mapFileUseCount[strFile];
+                strFile = "";
+                throw;
+            }
+            if (fCreate && !Exists(string("version")))
+            {
+                bool fTmp = fReadOnly;
+                fReadOnly = false;
+                WriteVersion(CLIENT_VERSION);
+                fReadOnly = fTmp;
+            }
+            return;
+        }
+
         pdb = bitdb.mapDb[strFile];
         if (pdb == NULL)
         {
@@ -292,6 +313,16 @@ void CDB::Flush()
 
 void CDB::Close()
 {
+    if (pldb)
+    {
+        // LevelDB has written everything to its log already
+        delete activeBatch;
+        activeBatch = NULL;
+        pldb = NULL;
+        LOCK(bitdb.cs_db);
+        --bitdb.mapFileUseCount[strFile];
+        return;
+    }
     if (!pdb)
         return;
     if (activeTxn)
@@ -311,6 +342,12 @@ void CDBEnv::CloseDb(const string& strFile)
 {
     {
         LOCK(cs_db);
+        if (mapLevelDb[strFile] != NULL)
+        {
+            // Closing the database syncs its log
+            delete mapLevelDb[strFile];
+            mapLevelDb[strFile] = NULL;
+        }
         if (mapDb[strFile] != NULL)
         {
             // Close the database handle
@@ -331,6 +368,204 @@ bool CDBEnv::RemoveDb(const string& strFile)
     return (rc == 0);
 }
 
+boost::filesystem::path CDBEnv::GetLevelDbPath(const std::string& strFile) const
+{
+    // wallet.dat is kept in the directory wallet.ldb
+    return path / boost::filesystem::path(strFile).replace_extension(".ldb");
+}
+
+CLevelDB* CDBEnv::GetLevelDb(const std::string& strFile)
+{
+    LOCK(cs_db);
+    CLevelDB*& pldb = mapLevelDb[strFile];
+    if (pldb == NULL)
+        pldb = new CLevelDB(GetLevelDbPath(strFile), 1 << 21, fMockDb);
+    return pldb;
+}
+
+bool CDBEnv::ConvertToLevelDb(const std::string& strFile)
+{
+    LOCK(cs_db);
+    int64 nStart = GetTimeMillis();
+    printf("Converting %s to LevelDB...\n", strFile.c_str());
+
+    boost::filesystem::path pathLevelDb = GetLevelDbPath(strFile);
+    boost::filesystem::path pathTmp = pathLevelDb;
+    pathTmp.replace_extension(".ldb.tmp");
+
+    Db db(&dbenv, 0);
+    int ret = db.open(NULL, strFile.c_str(), "main", DB_BTREE, DB_RDONLY, 0);
+    if (ret != 0)
+    {
+        printf("ConvertToLevelDb() : can't open database file %s, error %d\n", strFile.c_str(), ret);
+        return false;
+    }
+    Dbc* pcursor = NULL;
+    if (db.cursor(NULL, &pcursor, 0) != 0)
+    {
+        db.close(0);
+        return false;
+    }
+
+    CLevelDBBatch batch;
+    unsigned int nRecords = 0;
+    bool fSuccess = true;
+    loop
+    {
+        Dbt datKey;
+        Dbt datValue;
+        ret = pcursor->get(&datKey, &datValue, DB_NEXT);
+        if (ret == DB_NOTFOUND)
+            break;
+        if (ret != 0)
+        {
+            printf("ConvertToLevelDb() : error %d reading %s\n", ret, strFile.c_str());
+            fSuccess = false;
+            break;
+        }
+        char* pKey = (char*)datKey.get_data();
+        char* pValue = (char*)datValue.get_data();
+        batch.Write(CFlatData(pKey, pKey + datKey.get_size()), CFlatData(pValue, pValue + datValue.get_size()));
+        nRecords++;
+    }
+    pcursor->close();
+    db.close(0);
+    if (!fSuccess)
+        return false;
+
+    // Write to a new directory and move it into place once complete, then move the
+    // Berkeley DB file aside so that it isn't used again by mistake
+    try {
+        {
+            CLevelDB ldb(pathTmp, 1 << 21, false, true);
+            if (!ldb.WriteBatch(batch, true))
+                return false;
+        }
+        boost::filesystem::rename(pathTmp, pathLevelDb);
+    } catch (std::runtime_error &e) {
+        printf("ConvertToLevelDb() : %s\n", e.what());
+        return false;
+    }
+    std::string strFileBak = strprintf("wallet.%"PRI64d".bak", GetTime());
+    if (dbenv.dbrename(NULL, strFile.c_str(), NULL, strFileBak.c_str(), DB_AUTO_COMMIT) != 0)
+    {
+        printf("ConvertToLevelDb() : failed to rename %s to %s\n", strFile.c_str(), strFileBak.c_str());
+        return false;
+    }
+
+    printf("Converted %u records of %s to %s, kept the original as %s  %"PRI64d"ms\n", nRecords, strFile.c_str(),
+           pathLevelDb.string().c_str(), strFileBak.c_str(), GetTimeMillis() - nStart);
+    return true;
+}
+
+int CDBCursor::Read(CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags)
+{
+    if (piter)
+    {
+        if (fFlags == DB_SET_RANGE)
+            piter->Seek(leveldb::Slice(&ssKey[0], ssKey.size()));
+        else if (fFlags == DB_NEXT && !fStarted)
+            piter->SeekToFirst();
+        else if (fFlags == DB_NEXT && piter->Valid())
+            piter->Next();
+        else if (fFlags != DB_NEXT)
+            return 99999;
+        fStarted = true;
+        if (!piter->Valid())
+            return piter->status().ok() ? DB_NOTFOUND : 99999;
+
+        leveldb::Slice slKey = piter->key();
+        leveldb::Slice slValue = piter->value();
+        ssKey.SetType(SER_DISK);
+        ssKey.clear();
+        ssKey.write(slKey.data(), slKey.size());
+        ssValue.SetType(SER_DISK);
+        ssValue.clear();
+        ssValue.write(slValue.data(), slValue.size());
+        return 0;
+    }
+
+    // Read at cursor
+    Dbt datKey;
+    if (fFlags == DB_SET || fFlags == DB_SET_RANGE || fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE)
+    {
+        datKey.set_data(&ssKey[0]);
+        datKey.set_size(ssKey.size());
+    }
+    Dbt datValue;
+    if (fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE)
+    {
+        datValue.set_data(&ssValue[0]);
+        datValue.set_size(ssValue.size());
+    }
+    datKey.set_flags(DB_DBT_MALLOC);
+    datValue.set_flags(DB_DBT_MALLOC);
+    int ret = pcursor->get(&datKey, &datValue, fFlags);
+    if (ret != 0)
+        return ret;
+    else if (datKey.get_data() == NULL || datValue.get_data() == NULL)
+        return 99999;
+
+    // Convert to streams
+    ssKey.SetType(SER_DISK);
+    ssKey.clear();
+    ssKey.write((char*)datKey.get_data(), datKey.get_size());
+    ssValue.SetType(SER_DISK);
+    ssValue.clear();
+    ssValue.write((char*)datValue.get_data(), datValue.get_size());
+
+    // Clear and free memory
+    memset(datKey.get_data(), 0, datKey.get_size());
+    memset(datValue.get_data(), 0, datValue.get_size());
+    free(datKey.get_data());
+    free(datValue.get_data());
+    return 0;
+}
+
+CDBCursor::~CDBCursor()
+{
+    if (pcursor)
+        pcursor->close();
+    delete piter;
+}
+
+bool CDB::RewriteLevelDb(const string& strFile, const char* pszSkip)
+{
+    // LevelDB drops erased and overwritten values, like the unencrypted keys of
+    // a wallet that was just encrypted, when it compacts its files
+    printf("Rewriting %s...\n", bitdb.GetLevelDbPath(strFile).string().c_str());
+    try {
+        CDB db(strFile.c_str(), "r+");
+        CLevelDBBatch batch;
+        CDBCursor* pcursor = db.GetCursor();
+        loop
+        {
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            int ret = db.ReadAtCursor(pcursor, ssKey, ssValue, DB_NEXT);
+            if (ret == DB_NOTFOUND)
+                break;
+            else if (ret != 0)
+            {
+                delete pcursor;
+                printf("Rewriting of %s FAILED!\n", strFile.c_str());
+                return false;
+            }
+            if (pszSkip &&
+                strncmp(&ssKey[0], pszSkip, std::min(ssKey.size(), strlen(pszSkip))) == 0)
+                batch.Erase(CFlatData(&ssKey[0], &ssKey[0] + ssKey.size()));
+        }
+        delete pcursor;
+        batch.Write(string("version"), CLIENT_VERSION);
+        db.pldb->WriteBatch(batch, true);
+        db.pldb->Compact();
+    } catch (std::runtime_error &e) {
+        printf("Rewriting of %s FAILED! %s\n", strFile.c_str(), e.what());
+        return false;
+    }
+    return true;
+}
+
 bool CDB::Rewrite(const string& strFile, const char* pszSkip)
 {
     while (true)
@@ -344,6 +579,9 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
                 bitdb.CheckpointLSN(strFile);
                 bitdb.mapFileUseCount.erase(strFile);
 
+                if (bitdb.fUseLevelDb)
+                    return RewriteLevelDb(strFile, pszSkip);
+
                 bool fSuccess = true;
                 printf("Rewriting %s...\n", strFile.c_str());
                 string strFileRes = strFile + ".rewrite";
@@ -363,7 +601,7 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
                         fSuccess = false;
                     }
 
-                    Dbc* pcursor = db.GetCursor();
+                    CDBCursor* pcursor = db.GetCursor();
                     if (pcursor)
                         while (fSuccess)
                         {
@@ -372,12 +610,12 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
                             int ret = db.ReadAtCursor(pcursor, ssKey, ssValue, DB_NEXT);
                             if (ret == DB_NOTFOUND)
                             {
-                                pcursor->close();
+                                delete pcursor;
                                 break;
                             }
                             else if (ret != 0)
                             {
-                                pcursor->close();
+                                delete pcursor;
                                 fSuccess = false;
                                 break;
                             }
@@ -448,7 +686,7 @@ void CDBEnv::Flush(bool fShutdown)
                 printf("%s checkpoint\n", strFile.c_str());
                 dbenv.txn_checkpoint(0, 0, 0);
                 printf("%s detach\n", strFile.c_str());
-                if (!fMockDb)
+                if (!fMockDb && !fUseLevelDb)
                     dbenv.lsn_reset(strFile.c_str(), 0);
                 printf("%s closed\n", strFile.c_str());
                 mapFileUseCount.erase(mi++);
@@ -6,6 +6,7 @@
 #define BITCOIN_DB_H
 
 #include "main.h"
+#include "leveldb.h"
 
 #include <map>
 #include <string>
@@ -43,6 +44,10 @@ public:
     std::map<std::string, int> mapFileUseCount;
     std::map<std::string, Db*> mapDb;
 
+    // Keep databases in LevelDB instead of Berkeley DB (-walletdb=leveldb)
+    bool fUseLevelDb;
+    std::map<std::string, CLevelDB*> mapLevelDb;
+
     CDBEnv();
     ~CDBEnv();
     void MakeMock();
@@ -74,6 +79,15 @@ public:
     void CloseDb(const std::string& strFile);
     bool RemoveDb(const std::string& strFile);
 
+    /* The directory of the LevelDB database that takes the place of strFile */
+    boost::filesystem::path GetLevelDbPath(const std::string& strFile) const;
+    CLevelDB* GetLevelDb(const std::string& strFile);
+    /*
+     * Copy all records of the Berkeley DB file strFile to a new LevelDB database,
+     * in a single synced batch, then move strFile out of the way.
+     */
+    bool ConvertToLevelDb(const std::string& strFile);
+
     DbTxn *TxnBegin(int flags=DB_TXN_WRITE_NOSYNC)
     {
         DbTxn* ptxn = NULL;
@@ -87,13 +101,39 @@ public:
 extern CDBEnv bitdb;
 
 
-/** RAII class that provides access to a Berkeley database */
+/** Cursor over the records of a database, in key order */
+class CDBCursor
+{
+private:
+    Dbc* pcursor;
+    leveldb::Iterator* piter;
+    bool fStarted;
+
+    CDBCursor(const CDBCursor&);
+    void operator=(const CDBCursor&);
+
+public:
+    explicit CDBCursor(Dbc* pcursorIn) : pcursor(pcursorIn), piter(NULL), fStarted(false) {}
+    explicit CDBCursor(leveldb::Iterator* piterIn) : pcursor(NULL), piter(piterIn), fStarted(false) {}
+    ~CDBCursor();
+
+    // fFlags is DB_NEXT or DB_SET_RANGE; returns 0, DB_NOTFOUND or another error
+    int Read(CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags);
+};
+
+
+/** RAII class that provides access to a Berkeley database, or the LevelDB database
+ *  that takes its place. Writes between TxnBegin and TxnCommit go to LevelDB in
+ *  one synced batch, and are not seen by reads before the commit.
+ */
 class CDB
 {
 protected:
     Db* pdb;
+    CLevelDB* pldb;
     std::string strFile;
     DbTxn *activeTxn;
+    CLevelDBBatch *activeBatch;
     bool fReadOnly;
 
     explicit CDB(const char* pszFile, const char* pszMode="r+");
@@ -109,6 +149,8 @@ protected:
     template<typename K, typename T>
     bool Read(const K& key, T& value)
     {
+        if (pldb)
+            return pldb->Read(key, value);
         if (!pdb)
             return false;
 
@@ -144,11 +186,23 @@ protected:
     template<typename K, typename T>
     bool Write(const K& key, const T& value, bool fOverwrite=true)
     {
-        if (!pdb)
+        if (!pdb && !pldb)
             return false;
         if (fReadOnly)
             assert(!"Write called on database in read-only mode");
 
+        if (pldb)
+        {
+            if (!fOverwrite && pldb->Exists(key))
+                return false;
+            if (activeBatch)
+            {
+                activeBatch->Write(key, value);
+                return true;
+            }
+            return pldb->Write(key, value);
+        }
+
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
@@ -173,11 +227,21 @@ protected:
     template<typename K>
     bool Erase(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !pldb)
             return false;
         if (fReadOnly)
             assert(!"Erase called on database in read-only mode");
 
+        if (pldb)
+        {
+            if (activeBatch)
+            {
+                activeBatch->Erase(key);
+                return true;
+            }
+            return pldb->Erase(key);
+        }
+
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
@@ -195,6 +259,8 @@ protected:
     template<typename K>
     bool Exists(const K& key)
     {
+        if (pldb)
+            return pldb->Exists(key);
         if (!pdb)
             return false;
 
@@ -212,59 +278,34 @@ protected:
         return (ret == 0);
     }
 
-    Dbc* GetCursor()
+    CDBCursor* GetCursor()
     {
+        if (pldb)
+            return new CDBCursor(pldb->NewIterator());
         if (!pdb)
             return NULL;
         Dbc* pcursor = NULL;
         int ret = pdb->cursor(NULL, &pcursor, 0);
         if (ret != 0)
             return NULL;
-        return pcursor;
+        return new CDBCursor(pcursor);
     }
 
-    int ReadAtCursor(Dbc* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags=DB_NEXT)
+    int ReadAtCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags=DB_NEXT)
     {
-        // Read at cursor
-        Dbt datKey;
-        if (fFlags == DB_SET || fFlags == DB_SET_RANGE || fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE)
-        {
-            datKey.set_data(&ssKey[0]);
-            datKey.set_size(ssKey.size());
-        }
-        Dbt datValue;
-        if (fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE)
-        {
-            datValue.set_data(&ssValue[0]);
-            datValue.set_size(ssValue.size());
-        }
-        datKey.set_flags(DB_DBT_MALLOC);
-        datValue.set_flags(DB_DBT_MALLOC);
-        int ret = pcursor->get(&datKey, &datValue, fFlags);
-        if (ret != 0)
-            return ret;
-        else if (datKey.get_data() == NULL || datValue.get_data() == NULL)
-            return 99999;
-
-        // Convert to streams
-        ssKey.SetType(SER_DISK);
-        ssKey.clear();
-        ssKey.write((char*)datKey.get_data(), datKey.get_size());
-        ssValue.SetType(SER_DISK);
-        ssValue.clear();
-        ssValue.write((char*)datValue.get_data(), datValue.get_size());
-
-        // Clear and free memory
-        memset(datKey.get_data(), 0, datKey.get_size());
-        memset(datValue.get_data(), 0, datValue.get_size());
-        free(datKey.get_data());
-        free(datValue.get_data());
-        return 0;
+        return pcursor->Read(ssKey, ssValue, fFlags);
     }
 
 public:
     bool TxnBegin()
     {
+        if (pldb)
+        {
+            if (activeBatch)
+                return false;
+            activeBatch = new CLevelDBBatch();
+            return true;
+        }
         if (!pdb || activeTxn)
             return false;
         DbTxn* ptxn = bitdb.TxnBegin();
@@ -276,6 +317,15 @@ public:
 
     bool TxnCommit()
     {
+        if (pldb)
+        {
+            if (!activeBatch)
+                return false;
+            bool fOk = pldb->WriteBatch(*activeBatch, true);
+            delete activeBatch;
+            activeBatch = NULL;
+            return fOk;
+        }
         if (!pdb || !activeTxn)
             return false;
         int ret = activeTxn->commit(0);
@@ -285,6 +335,14 @@ public:
 
     bool TxnAbort()
     {
+        if (pldb)
+        {
+            if (!activeBatch)
+                return false;
+            delete activeBatch;
+            activeBatch = NULL;
+            return true;
+        }
         if (!pdb || !activeTxn)
             return false;
         int ret = activeTxn->abort();
@@ -304,6 +362,8 @@ public:
     }
 
     bool static Rewrite(const std::string& strFile, const char* pszSkip = NULL);
+private:
+    bool static RewriteLevelDb(const std::string& strFile, const char* pszSkip);
 };
 
 
@@ -0,0 +1,258 @@
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "indexbuilder.h"
+#include "main.h"
+#include "txdb.h"
+
+using namespace std;
+
+CTxIndexBuilder txIndexBuilder;
+CTxFeeIndexBuilder txFeeIndexBuilder;
+CAddrIndexBuilder addrIndexBuilder;
+
+// blocks between two cursor writes
+static const int INDEX_CURSOR_INTERVAL = 500;
+
+bool CIndexBuilder::SetEnabled(bool fEnabled)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fBuilding = fEnabled;
+        nHeight = 0;
+    }
+    if (fEnabled) {
+        printf("%s enabled, building it in the background\n", strName.c_str());
+        return WriteCursor(hashGenesisBlock);
+    }
+    return EraseCursor();
+}
+
+void CIndexBuilder::Start()
+{
+    uint256 hashCursor;
+    if (!ReadCursor(hashCursor))
+        return;
+
+    CBlockIndex* pindexStart = pindexGenesisBlock;
+    {
+        LOCK(cs_main);
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashCursor);
+        if (mi != mapBlockIndex.end())
+            pindexStart = (*mi).second;
+    }
+    if (pindexStart == NULL)
+        return;
+
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fBuilding = true;
+        fStop = false;
+        nHeight = pindexStart->nHeight;
+    }
+    thread = boost::thread(boost::bind(&CIndexBuilder::ThreadBuild, this, pindexStart));
+}
+
+void CIndexBuilder::Stop()
+{
+    boost::this_thread::disable_interruption di;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
+    }
+    if (thread.joinable())
+        thread.join();
+}
+
+void CIndexBuilder::SetHeight(int nHeightIn)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    nHeight = nHeightIn;
+}
+
+void CIndexBuilder::GetProgress(CIndexBuildProgress& progress) const
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    progress.strName = strName;
+    progress.fBuilding = fBuilding;
+    progress.nHeight = nHeight;
+    progress.nTipHeight = nBestHeight;
+}
+
+bool CIndexBuilder::IsBuilding() const
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return fBuilding;
+}
+
+void CIndexBuilder::ThreadBuild(CBlockIndex* pindexStart)
+{
+    RenameThread(("bitcoin-" + strName).c_str());
+    printf("Building %s from height %d\n", strName.c_str(), pindexStart->nHeight);
+    int64 nStart = GetTimeMillis();
+
+    CBlockIndex* pindex = pindexStart; // last block added
+    int nSinceWrite = 0;
+    while (true) {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (fStop)
+                break;
+        }
+
+        CBlockIndex* pindexNext;
+        {
+            LOCK(cs_main);
+            // the last block added may have been reorganized away; continue from the fork
+            while (pindex->pprev && !pindex->IsInMainChain()) {
+                if (!UnindexBlock(pindex)) {
+                    printf("ERROR: %s build : failed to remove block at height %d\n", strName.c_str(), pindex->nHeight);
+                    return;
+                }
+                pindex = pindex->pprev;
+                SetHeight(pindex->nHeight);
+            }
+            if (pindex == pindexBest) {
+                // all further blocks are indexed by ConnectBlock, which runs under cs_main
+                if (!FinishBuild(pindex->GetBlockHash())) {
+                    printf("ERROR: %s build : failed to finish\n", strName.c_str());
+                    return;
+                }
+                boost::unique_lock<boost::mutex> lock(mutex);
+                fBuilding = false;
+                nHeight = pindex->nHeight;
+                printf("Built %s up to height %d in %"PRI64d"ms\n", strName.c_str(), pindex->nHeight, GetTimeMillis() - nStart);
+                return;
+            }
+            pindexNext = pindex->pnext;
+        }
+
+        if (!IndexBlock(pindexNext)) {
+            printf("ERROR: %s build : failed at height %d, will resume on restart\n", strName.c_str(), pindexNext->nHeight);
+            break;
+        }
+        pindex = pindexNext;
+        SetHeight(pindex->nHeight);
+
+        if (++nSinceWrite >= INDEX_CURSOR_INTERVAL) {
+            WriteCursor(pindex->GetBlockHash());
+            nSinceWrite = 0;
+        }
+    }
+    WriteCursor(pindex->GetBlockHash());
+}
+
+bool CTxIndexBuilder::ReadCursor(uint256& hashBlock)
+{
+    return pblocktree->ReadIndexCursor("txindex", hashBlock);
+}
+
+bool CTxIndexBuilder::WriteCursor(const uint256& hashBlock)
+{
+    return pblocktree->WriteIndexCursor("txindex", hashBlock);
+}
+
+bool CTxIndexBuilder::EraseCursor()
+{
+    return pblocktree->EraseIndexCursor("txindex");
+}
+
+bool CTxIndexBuilder::FinishBuild(const uint256& hashTip)
+{
+    return EraseCursor();
+}
+
+bool CTxIndexBuilder::IndexBlock(CBlockIndex* pindex)
+{
+    CBlock block;
+    if (!block.ReadFromDisk(pindex))
+        return error("CTxIndexBuilder::IndexBlock() : ReadFromDisk failed");
+
+    vector<pair<uint256, CDiskTxPos> > vPos;
+    vPos.reserve(block.vtx.size());
+    CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        vPos.push_back(make_pair(tx.GetHash(), pos));
+        pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+    }
+    return pblocktree->WriteTxIndex(vPos);
+}
+
+bool CTxFeeIndexBuilder::ReadCursor(uint256& hashBlock)
+{
+    return pblocktree->ReadIndexCursor("txfeeindex", hashBlock);
+}
+
+bool CTxFeeIndexBuilder::WriteCursor(const uint256& hashBlock)
+{
+    return pblocktree->WriteIndexCursor("txfeeindex", hashBlock);
+}
+
+bool CTxFeeIndexBuilder::EraseCursor()
+{
+    return pblocktree->EraseIndexCursor("txfeeindex");
+}
+
+bool CTxFeeIndexBuilder::FinishBuild(const uint256& hashTip)
+{
+    return EraseCursor();
+}
+
+bool CTxFeeIndexBuilder::IndexBlock(CBlockIndex* pindex)
+{
+    // the undo data holds the spent outputs, so no coins lookups are needed
+    CAddressIndexBlock block;
+    if (!ReadAddressIndexBlock(pindex, block))
+        return false;
+    if (block.undo.vtxundo.size() + 1 != block.vtx.size())
+        return error("CTxFeeIndexBuilder::IndexBlock() : undo data mismatch at height %d", pindex->nHeight);
+
+    vector<pair<uint256, CTxFeeInfo> > vFees;
+    vFees.reserve(block.vtx.size());
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction& tx = block.vtx[i];
+        int64 nValueIn = 0;
+        if (i > 0)
+            BOOST_FOREACH(const CTxInUndo& txin, block.undo.vtxundo[i-1].vprevout)
+                nValueIn += txin.txout.nValue;
+        unsigned int nSize = ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+        vFees.push_back(make_pair(block.vpos[i].first, CTxFeeInfo(tx, nValueIn, nSize, pindex->nHeight)));
+    }
+    return pblocktree->WriteTxFeeIndex(vFees);
+}
+
+bool CAddrIndexBuilder::ReadCursor(uint256& hashBlock)
+{
+    return paddressmap->ReadBuildCursor(hashBlock);
+}
+
+bool CAddrIndexBuilder::WriteCursor(const uint256& hashBlock)
+{
+    return paddressmap->WriteBuildCursor(hashBlock);
+}
+
+bool CAddrIndexBuilder::EraseCursor()
+{
+    return paddressmap->Erase('C');
+}
+
+bool CAddrIndexBuilder::FinishBuild(const uint256& hashTip)
+{
+    return paddressmap->FinishBuild(hashTip);
+}
+
+bool CAddrIndexBuilder::IndexBlock(CBlockIndex* pindex)
+{
+    CAddressIndexBlock block;
+    if (!ReadAddressIndexBlock(pindex, block))
+        return false;
+    return paddressmap->AddBlock(block, true);
+}
+
+bool CAddrIndexBuilder::UnindexBlock(CBlockIndex* pindex)
+{
+    CAddressIndexBlock block;
+    if (!ReadAddressIndexBlock(pindex, block))
+        return false;
+    return paddressmap->RemoveBlock(block, true);
+}
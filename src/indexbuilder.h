@@ -0,0 +1,115 @@
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_INDEXBUILDER_H
+#define BITCOIN_INDEXBUILDER_H
+
+#include "uint256.h"
+
+#include <string>
+#include <boost/thread.hpp>
+
+class CBlockIndex;
+
+struct CIndexBuildProgress
+{
+    std::string strName;
+    bool fBuilding;   // a build is in progress or pending
+    int nHeight;      // height of the last block added by the build
+    int nTipHeight;
+};
+
+/** Builds an optional index over the blocks that were connected before it was enabled,
+ *  so that enabling it does not need a -reindex. A background thread walks the main
+ *  chain from a persisted cursor to the tip; blocks connected in the meantime are
+ *  indexed by ConnectBlock as usual. The cursor is erased once the tip is reached.
+ */
+class CIndexBuilder
+{
+private:
+    std::string strName;
+    boost::thread thread;
+    mutable boost::mutex mutex;
+    bool fBuilding;
+    bool fStop;
+    int nHeight;
+
+    void ThreadBuild(CBlockIndex* pindexStart);
+    void SetHeight(int nHeightIn);
+
+protected:
+    virtual bool ReadCursor(uint256& hashBlock) = 0;
+    virtual bool WriteCursor(const uint256& hashBlock) = 0;
+    virtual bool EraseCursor() = 0;
+    // the build reached hashTip; ConnectBlock keeps the index up to date from here on
+    virtual bool FinishBuild(const uint256& hashTip) = 0;
+    virtual bool IndexBlock(CBlockIndex* pindex) = 0;
+    // undo IndexBlock for a block that was reorganized away
+    virtual bool UnindexBlock(CBlockIndex* pindex) { return true; }
+
+public:
+    CIndexBuilder(const std::string& strNameIn) : strName(strNameIn), fBuilding(false), fStop(false), nHeight(0) {}
+    virtual ~CIndexBuilder() {}
+
+    // Call when the index is switched on or off. Switching it on schedules a build
+    // from the genesis block, switching it off drops an unfinished build.
+    bool SetEnabled(bool fEnabled);
+
+    // Resume an unfinished build; requires the block index to be loaded
+    void Start();
+    void Stop();
+
+    void GetProgress(CIndexBuildProgress& progress) const;
+
+    // While building, ConnectBlock and DisconnectBlock must leave an index that is
+    // not idempotent to the builder; checked and cleared under cs_main
+    bool IsBuilding() const;
+};
+
+/** Builder for -txindex */
+class CTxIndexBuilder : public CIndexBuilder
+{
+protected:
+    bool ReadCursor(uint256& hashBlock);
+    bool WriteCursor(const uint256& hashBlock);
+    bool EraseCursor();
+    bool FinishBuild(const uint256& hashTip);
+    bool IndexBlock(CBlockIndex* pindex);
+
+public:
+    CTxIndexBuilder() : CIndexBuilder("txindex") {}
+};
+
+/** Builder for -txfeeindex */
+class CTxFeeIndexBuilder : public CIndexBuilder
+{
+protected:
+    bool ReadCursor(uint256& hashBlock);
+    bool WriteCursor(const uint256& hashBlock);
+    bool EraseCursor();
+    bool FinishBuild(const uint256& hashTip);
+    bool IndexBlock(CBlockIndex* pindex);
+
+public:
+    CTxFeeIndexBuilder() : CIndexBuilder("txfeeindex") {}
+};
+
+/** Builder for -addrindex */
+class CAddrIndexBuilder : public CIndexBuilder
+{
+protected:
+    bool ReadCursor(uint256& hashBlock);
+    bool WriteCursor(const uint256& hashBlock);
+    bool EraseCursor();
+    bool FinishBuild(const uint256& hashTip);
+    bool IndexBlock(CBlockIndex* pindex);
+    bool UnindexBlock(CBlockIndex* pindex);
+
+public:
+    CAddrIndexBuilder() : CIndexBuilder("addrindex") {}
+};
+
+extern CTxIndexBuilder txIndexBuilder;
+extern CTxFeeIndexBuilder txFeeIndexBuilder;
+extern CAddrIndexBuilder addrIndexBuilder;
+
+#endif // BITCOIN_INDEXBUILDER_H
@@ -4,6 +4,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "txdb.h"
+#include "indexbuilder.h"
 #include "walletdb.h"
 #include "bitcoinrpc.h"
 #include "net.h"
@@ -78,10 +79,14 @@ enum BindFlags {
 //
 
 volatile bool fRequestShutdown = false;
+// a rescan at startup was cut short: the wallet must not be marked as up to date
+static bool fRescanAborted = false;
 
 void StartShutdown()
 {
     fRequestShutdown = true;
+    if (pwalletMain)
+        pwalletMain->AbortRescan();
 }
 bool ShutdownRequested()
 {
@@ -106,14 +111,19 @@ void Shutdown()
         bitdb.Flush(false);
     GenerateBitcoins(false, NULL);
     StopNode();
+    txIndexBuilder.Stop();
+    txFeeIndexBuilder.Stop();
+    addrIndexBuilder.Stop();
+    FlushWalletEvents();
     {
         LOCK(cs_main);
-        if (pwalletMain)
+        if (pwalletMain && !fRescanAborted)
             pwalletMain->SetBestChain(CBlockLocator(pindexBest));
         if (pblocktree)
             pblocktree->Flush();
         if (pcoinsTip)
             pcoinsTip->Flush();
+        delete paddressqueue; paddressqueue = NULL;
         if (paddressmap)
             paddressmap->Flush();
         delete pcoinsTip; pcoinsTip = NULL;
@@ -121,6 +131,7 @@ void Shutdown()
         delete pblocktree; pblocktree = NULL;
         delete paddressmap; paddressmap = NULL;
     }
+    blockFileCache.Clear();
     if (pwalletMain)
         bitdb.Flush(true);
     boost::filesystem::remove(GetPidFile());
@@ -147,6 +158,8 @@ void DetectShutdownThread(boost::thread_group* threadGroup)
 void HandleSIGTERM(int)
 {
     fRequestShutdown = true;
+    if (pwalletMain)
+        pwalletMain->AbortRescan();
 }
 
 void HandleSIGHUP(int)
@@ -371,15 +384,24 @@ std::string HelpMessage()
         "  -alertnotify=<cmd>     " + _("Execute command when a relevant alert is received (%s in cmd is replaced by message)") + "\n" +
         "  -upgradewallet         " + _("Upgrade wallet to latest format") + "\n" +
         "  -keypool=<n>           " + _("Set key pool size to <n> (default: 100)") + "\n" +
+        "  -consolidate=<n>       " + _("Consolidate small outputs in the background when the wallet has more than <n> of them (default: 0 = off)") + "\n" +
+        "  -consolidateinput=<amt> " + _("Outputs worth less than <amt> are consolidated (default: 1)") + "\n" +
+        "  -consolidatemaxfee=<amt> " + _("Highest fee to pay for a consolidation (default: 0.01)") + "\n" +
         "  -rescan                " + _("Rescan the block chain for missing wallet transactions") + "\n" +
         "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n" +
+        "  -walletdb=<backend>    " + _("Keep the wallet in Berkeley DB (bdb) or LevelDB (leveldb); wallet.dat is converted to LevelDB on first use (default: bdb)") + "\n" +
         "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 288, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-4, default: 3)") + "\n" +
         "  -txindex               " + _("Maintain a full transaction index (default: 0)") + "\n" +
+        "  -txfeeindex            " + _("Maintain an index of transaction fees and input values (default: 0)") + "\n" +
         "  -addrindex             " + _("Maintain address index (default: 0)") + "\n" +
+        "  -prune=<n>             " + _("Delete old block and undo files to keep them under <n> MiB (default: 0 = disabled; incompatible with -txindex, -txfeeindex and -addrindex)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + "\n" +
         "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + "\n" +
         "  -par=<n>               " + _("Set the number of script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
+        "  -blockfilecache=<n>    " + _("Number of block and undo files kept open for reading (0 = open per read, default: 8)") + "\n" +
+        "  -blockfilemmap         " + _("Memory-map block and undo files for reading (default: 1)") + "\n" +
+        "  -blockcompress         " + _("Store new blocks zlib-compressed in the block files (default: 0)") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
         "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n" +
@@ -576,6 +598,27 @@ bool AppInit2(boost::thread_group& threadGroup)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    blockFileCache.SetOptions(std::max((int)GetArg("-blockfilecache", DEFAULT_BLOCKFILE_CACHE), 0), GetBoolArg("-blockfilemmap", true));
+    fBlockCompress = GetBoolArg("-blockcompress", false);
+
+    // block pruning; the node then no longer serves the full chain
+    if (GetArg("-prune", 0) < 0)
+        return InitError(_("Prune cannot be configured with a negative value."));
+    nPruneTarget = (uint64)GetArg("-prune", 0) * 1024 * 1024;
+    if (nPruneTarget) {
+        if (nPruneTarget < MIN_DISK_SPACE_FOR_BLOCK_FILES)
+            return InitError(strprintf(_("Prune configured below the minimum of %d MiB. Please use a higher number."), (int)(MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024)));
+        if (GetBoolArg("-txindex", false))
+            return InitError(_("Prune mode is incompatible with -txindex."));
+        if (GetBoolArg("-txfeeindex", false))
+            return InitError(_("Prune mode is incompatible with -txfeeindex."));
+        if (GetBoolArg("-addrindex", false))
+            return InitError(_("Prune mode is incompatible with -addrindex."));
+        fPruneMode = true;
+        nLocalServices &= ~NODE_NETWORK;
+        printf("Prune mode enabled, keeping block files under %"PRI64u" MiB\n", nPruneTarget / 1024 / 1024);
+    }
+
     // -debug implies fDebug*
     if (fDebug)
         fDebugNet = true;
@@ -707,10 +750,23 @@ bool AppInit2(boost::thread_group& threadGroup)
             }
         }
 
+        string strWalletDb = GetArg("-walletdb", "bdb");
+        if (strWalletDb != "bdb" && strWalletDb != "leveldb")
+            return InitError(strprintf(_("Unknown -walletdb backend requested: '%s'"), strWalletDb.c_str()));
+        bitdb.fUseLevelDb = (strWalletDb == "leveldb");
+        bool fLevelDbWallet = filesystem::exists(bitdb.GetLevelDbPath("wallet.dat"));
+        if (!bitdb.fUseLevelDb && fLevelDbWallet && !filesystem::exists(GetDataDir() / "wallet.dat"))
+            return InitError(_("The wallet has been converted to LevelDB, start with -walletdb=leveldb"));
+
         if (GetBoolArg("-salvagewallet"))
         {
             // Recover readable keypairs:
-            if (!CWalletDB::Recover(bitdb, "wallet.dat", true))
+            if (bitdb.fUseLevelDb && fLevelDbWallet)
+            {
+                if (!CWalletDB::RecoverLevelDb("wallet.dat"))
+                    return false;
+            }
+            else if (!CWalletDB::Recover(bitdb, "wallet.dat", true))
                 return false;
         }
 
@@ -727,6 +783,13 @@ bool AppInit2(boost::thread_group& threadGroup)
             }
             if (r == CDBEnv::RECOVER_FAIL)
                 return InitError(_("wallet.dat corrupt, salvage failed"));
+
+            if (bitdb.fUseLevelDb && !fLevelDbWallet)
+            {
+                uiInterface.InitMessage(_("Converting wallet..."));
+                if (!bitdb.ConvertToLevelDb("wallet.dat"))
+                    return InitError(_("Error converting wallet.dat to LevelDB"));
+            }
         }
     } // (!fDisableWallet)
 
@@ -931,15 +994,46 @@ bool AppInit2(boost::thread_group& threadGroup)
                     break;
                 }
 
-                // Check for changed -txindex state
+                // Switching -txindex, -txfeeindex or -addrindex on builds the index in the background,
+                // switching it off drops an unfinished build
                 if (fTxIndex != GetBoolArg("-txindex", false)) {
-                    strLoadError = _("You need to rebuild the database using -reindex to change -txindex");
-                    break;
+                    fTxIndex = !fTxIndex;
+                    if (!pblocktree->WriteFlag("txindex", fTxIndex) || !txIndexBuilder.SetEnabled(fTxIndex)) {
+                        strLoadError = _("Error changing -txindex");
+                        break;
+                    }
+                }
+
+                if (fTxFeeIndex != GetBoolArg("-txfeeindex", false)) {
+                    fTxFeeIndex = !fTxFeeIndex;
+                    if (!pblocktree->WriteFlag("txfeeindex", fTxFeeIndex) || !txFeeIndexBuilder.SetEnabled(fTxFeeIndex)) {
+                        strLoadError = _("Error changing -txfeeindex");
+                        break;
+                    }
                 }
 
-                // Check for changed -addrindex state
                 if (fAddrIndex != GetBoolArg("-addrindex", false)) {
-                    strLoadError = _("You need to rebuild the database using -reindex to change -addrindex");
+                    fAddrIndex = !fAddrIndex;
+                    // entries left from an earlier time the index was on are outdated
+                    unsigned int nErased;
+                    if ((fAddrIndex && !paddressmap->Clear(nErased)) ||
+                        !paddressmap->WriteEnable(fAddrIndex) || !addrIndexBuilder.SetEnabled(fAddrIndex)) {
+                        strLoadError = _("Error changing -addrindex");
+                        break;
+                    }
+                }
+
+                // An address index written in an older layout is dropped and built again
+                bool fRebuildAddrIndex = false;
+                if (fAddrIndex && (!paddressmap->Upgrade(fRebuildAddrIndex) ||
+                                   (fRebuildAddrIndex && !addrIndexBuilder.SetEnabled(true)))) {
+                    strLoadError = _("Error upgrading address index");
+                    break;
+                }
+
+                // Add blocks that were connected but not yet indexed at the last shutdown
+                if (fAddrIndex && !paddressmap->CatchUp(pindexBest)) {
+                    strLoadError = _("Error updating address index");
                     break;
                 }
 
@@ -985,6 +1079,15 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
     printf(" block index %15"PRI64d"ms\n", GetTimeMillis() - nStart);
 
+    // from here on, connected blocks are added to the address index in the background
+    if (fAddrIndex)
+        paddressqueue = new CAddressIndexQueue(*paddressmap);
+
+    // resume index builds interrupted by the last shutdown
+    txIndexBuilder.Start();
+    txFeeIndexBuilder.Start();
+    addrIndexBuilder.Start();
+
     if (GetBoolArg("-printblockindex") || GetBoolArg("-printblocktree"))
     {
         PrintBlockTree();
@@ -1098,11 +1201,27 @@ bool AppInit2(boost::thread_group& threadGroup)
         }
         if (pindexBest && pindexBest != pindexRescan)
         {
+            // the blocks to rescan must still be on disk
+            if (fHavePruned) {
+                CBlockIndex *pindex = pindexBest;
+                while (pindex != pindexRescan && pindex->pprev && (pindex->pprev->nStatus & BLOCK_HAVE_DATA))
+                    pindex = pindex->pprev;
+                if (pindex != pindexRescan)
+                    return InitError(_("Rescan needs blocks that have been pruned. You need to -reindex, which downloads the whole block chain again."));
+            }
+
             uiInterface.InitMessage(_("Rescanning..."));
             printf("Rescanning last %i blocks (from block %i)...\n", pindexBest->nHeight - pindexRescan->nHeight, pindexRescan->nHeight);
             nStart = GetTimeMillis();
             pwalletMain->ScanForWalletTransactions(pindexRescan, true);
             printf(" rescan      %15"PRI64d"ms\n", GetTimeMillis() - nStart);
+            if (pwalletMain->IsAbortingRescan())
+            {
+                // don't record the rescan as done, it starts over from pindexRescan next time
+                fRescanAborted = true;
+                printf("Shutdown requested. Exiting.\n");
+                return false;
+            }
             pwalletMain->SetBestChain(CBlockLocator(pindexBest));
             nWalletDBUpdated++;
         }
@@ -1115,6 +1234,10 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (!ConnectBestBlock(state))
         strErrors << "Failed to connect best block";
 
+    // Pass new transactions and blocks on to the wallet without holding cs_main
+    if (pwalletMain)
+        StartWalletEvents(threadGroup);
+
     std::vector<boost::filesystem::path> vImportFiles;
     if (mapArgs.count("-loadblock"))
     {
@@ -1176,6 +1299,19 @@ bool AppInit2(boost::thread_group& threadGroup)
 
         // Run a thread to flush wallet periodically
         threadGroup.create_thread(boost::bind(&ThreadFlushWalletDB, boost::ref(pwalletMain->strWalletFile)));
+
+        // Consolidate small outputs, e.g. mining payouts, in the background
+        int nConsolidate = GetArg("-consolidate", 0);
+        if (nConsolidate > 0)
+        {
+            int64 nMaxInputValue = COIN;
+            if (mapArgs.count("-consolidateinput") && !ParseMoney(mapArgs["-consolidateinput"], nMaxInputValue))
+                return InitError(strprintf(_("Invalid amount for -consolidateinput=<amount>: '%s'"), mapArgs["-consolidateinput"].c_str()));
+            int64 nMaxFee = CENT;
+            if (mapArgs.count("-consolidatemaxfee") && !ParseMoney(mapArgs["-consolidatemaxfee"], nMaxFee))
+                return InitError(strprintf(_("Invalid amount for -consolidatemaxfee=<amount>: '%s'"), mapArgs["-consolidatemaxfee"].c_str()));
+            threadGroup.create_thread(boost::bind(&ThreadConsolidateWallet, pwalletMain, (unsigned int)nConsolidate, nMaxInputValue, nMaxFee));
+        }
     }
 
     startBTTrackers();
@@ -19,10 +19,33 @@ bool CKeyStore::AddKey(const CKey &key) {
     return AddKeyPubKey(key, key.GetPubKey());
 }
 
+void CBasicKeyStore::IndexKey(const CKeyID &address)
+{
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(address);
+    setScriptPubKeys.insert(scriptPubKey);
+    if (!mapScripts.empty())
+        fScriptsIndexed = false;
+}
+
+void CBasicKeyStore::IndexScripts() const
+{
+    // IsMine of a redeem script looks up the index again
+    fScriptsIndexed = true;
+    BOOST_FOREACH(const ScriptMap::value_type& item, mapScripts)
+    {
+        CScript scriptPubKey;
+        scriptPubKey.SetDestination(item.first);
+        if (!setScriptPubKeys.count(scriptPubKey) && IsMine(*this, item.second))
+            setScriptPubKeys.insert(scriptPubKey);
+    }
+}
+
 bool CBasicKeyStore::AddKeyPubKey(const CKey& key, const CPubKey &pubkey)
 {
     LOCK(cs_KeyStore);
     mapKeys[pubkey.GetID()] = key;
+    IndexKey(pubkey.GetID());
     return true;
 }
 
@@ -30,9 +53,18 @@ bool CBasicKeyStore::AddCScript(const CScript& redeemScript)
 {
     LOCK(cs_KeyStore);
     mapScripts[redeemScript.GetID()] = redeemScript;
+    fScriptsIndexed = false;
     return true;
 }
 
+bool CBasicKeyStore::HaveScriptPubKey(const CScript& scriptPubKey) const
+{
+    LOCK(cs_KeyStore);
+    if (!fScriptsIndexed)
+        IndexScripts();
+    return setScriptPubKeys.count(scriptPubKey) > 0;
+}
+
 bool CBasicKeyStore::HaveCScript(const CScriptID& hash) const
 {
     LOCK(cs_KeyStore);
@@ -135,6 +167,7 @@ bool CCryptoKeyStore::AddCryptedKey(const CPubKey &vchPubKey, const std::vector<
             return false;
 
         mapCryptedKeys[vchPubKey.GetID()] = make_pair(vchPubKey, vchCryptedSecret);
+        IndexKey(vchPubKey.GetID());
     }
     return true;
 }
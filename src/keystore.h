@@ -6,8 +6,10 @@
 #define BITCOIN_KEYSTORE_H
 
 #include "crypter.h"
+#include "hash.h"
 #include "sync.h"
 #include <boost/signals2/signal.hpp>
+#include <boost/unordered_set.hpp>
 
 class CScript;
 
@@ -34,10 +36,23 @@ public:
     virtual bool AddCScript(const CScript& redeemScript) =0;
     virtual bool HaveCScript(const CScriptID &hash) const =0;
     virtual bool GetCScript(const CScriptID &hash, CScript& redeemScriptOut) const =0;
+
+    // Check whether an output script is a pay-to-pubkey-hash or pay-to-script-hash script
+    // that the keys and scripts in the store can spend.
+    virtual bool HaveScriptPubKey(const CScript& scriptPubKey) const =0;
+};
+
+struct CScriptPubKeyHasher
+{
+    size_t operator()(const std::vector<unsigned char>& script) const
+    {
+        return MurmurHash3(0, script);
+    }
 };
 
 typedef std::map<CKeyID, CKey> KeyMap;
 typedef std::map<CScriptID, CScript > ScriptMap;
+typedef boost::unordered_set<std::vector<unsigned char>, CScriptPubKeyHasher> ScriptPubKeySet;
 
 /** Basic key store, that keeps keys in an address->secret map */
 class CBasicKeyStore : public CKeyStore
@@ -46,7 +61,19 @@ protected:
     KeyMap mapKeys;
     ScriptMap mapScripts;
 
+    // Output scripts paying to the keys and scripts above, so that IsMine is a single lookup.
+    // Whether a script hash is spendable depends on the keys, so scripts are indexed lazily.
+    mutable ScriptPubKeySet setScriptPubKeys;
+    mutable bool fScriptsIndexed;
+
+    void IndexKey(const CKeyID &address);
+    void IndexScripts() const;
+
 public:
+    CBasicKeyStore() : fScriptsIndexed(true)
+    {
+    }
+
     bool AddKeyPubKey(const CKey& key, const CPubKey &pubkey);
     bool HaveKey(const CKeyID &address) const
     {
@@ -86,6 +113,7 @@ public:
     virtual bool AddCScript(const CScript& redeemScript);
     virtual bool HaveCScript(const CScriptID &hash) const;
     virtual bool GetCScript(const CScriptID &hash, CScript& redeemScriptOut) const;
+    bool HaveScriptPubKey(const CScript& scriptPubKey) const;
 };
 
 typedef std::map<CKeyID, std::pair<CPubKey, std::vector<unsigned char> > > CryptedKeyMap;
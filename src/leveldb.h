@@ -50,6 +50,10 @@ public:
 
         batch.Delete(slKey);
     }
+
+    void Clear() {
+        batch.Clear();
+    }
 };
 
 class CLevelDB
@@ -144,6 +148,10 @@ public:
         return WriteBatch(batch, true);
     }
 
+    // rewrite the files of the database without overwritten and erased values
+    void Compact() {
+        pdb->CompactRange(NULL, NULL);
+    }
     // not exactly clean encapsulation, but it's easiest for now
     leveldb::Iterator *NewIterator() {
         return pdb->NewIterator(iteroptions);
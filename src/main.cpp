@@ -7,6 +7,7 @@
 #include "checkpoints.h"
 #include "db.h"
 #include "txdb.h"
+#include "indexbuilder.h"
 #include "net.h"
 #include "init.h"
 #include "ui_interface.h"
@@ -53,7 +54,13 @@ bool fImporting = false;
 bool fReindex = false;
 bool fBenchmark = false;
 bool fTxIndex = false;
+bool fTxFeeIndex = false;
+bool fBlockCompress = false;
 bool fAddrIndex = false;
+bool fPruneMode = false;
+bool fHavePruned = false;
+uint64 nPruneTarget = 0;
+static bool fCheckForPruning = false; // block or undo files grew since the last pruning pass
 int RequestedMasterNodeList = 0;
 unsigned int nCoinCacheSize = 5000;
 
@@ -136,32 +143,169 @@ bool static GetTransaction(const uint256& hashTx, CWalletTx& wtx)
     return false;
 }
 
+// Wallets learn about transactions, blocks and the best chain through a queue of events,
+// handled by the wallet event thread so that cs_main is not held while wallets look for
+// their transactions and write them to disk. Before that thread runs (and after it stops)
+// events are handled right away by the thread that queues them.
+class CWalletEvent
+{
+public:
+    enum { SYNC_TX, SYNC_BLOCK, ERASE_TX, SET_BEST_CHAIN, UPDATED_TX } nType;
+    uint256 hash;
+    CTransaction tx;
+    bool fUpdate;
+    boost::shared_ptr<const CBlock> pblock;
+    std::vector<uint256> vTxHash;
+    CBlockLocator locator;
+};
+
+static CCriticalSection cs_walletEvents;
+static boost::condition_variable condWalletEvents;
+static boost::mutex mutexWalletEvents;
+static std::deque<CWalletEvent> queueWalletEvents;
+static bool fWalletEventThread = false;
+
+void static DispatchWalletEvent(const CWalletEvent& event)
+{
+    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+    {
+        switch (event.nType)
+        {
+        case CWalletEvent::SYNC_TX:
+            pwallet->SyncTransaction(event.hash, event.tx, event.pblock.get(), event.fUpdate);
+            break;
+        case CWalletEvent::SYNC_BLOCK:
+            for (unsigned int i = 0; i < event.pblock->vtx.size(); i++)
+                pwallet->SyncTransaction(event.vTxHash[i], event.pblock->vtx[i], event.pblock.get(), true);
+            break;
+        case CWalletEvent::ERASE_TX:
+            pwallet->EraseFromWallet(event.hash);
+            break;
+        case CWalletEvent::SET_BEST_CHAIN:
+            pwallet->SetBestChain(event.locator);
+            break;
+        case CWalletEvent::UPDATED_TX:
+            pwallet->UpdatedTransaction(event.hash);
+            break;
+        }
+    }
+}
+
+// Handle the queued events in order. Wallets take cs_main for their own transactions,
+// so this must not be called with cs_main held while the wallet event thread runs.
+void FlushWalletEvents()
+{
+    // one thread at a time, so that events are handled in order
+    LOCK(cs_walletEvents);
+    loop
+    {
+        CWalletEvent event;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexWalletEvents);
+            if (queueWalletEvents.empty())
+                break;
+            event = queueWalletEvents.front();
+            queueWalletEvents.pop_front();
+        }
+        DispatchWalletEvent(event);
+    }
+}
+
+void static PushWalletEvent(const CWalletEvent& event)
+{
+    if (setpwalletRegistered.empty())
+        return;
+    bool fQueued;
+    {
+        boost::unique_lock<boost::mutex> lock(mutexWalletEvents);
+        queueWalletEvents.push_back(event);
+        fQueued = fWalletEventThread;
+    }
+    if (fQueued)
+        condWalletEvents.notify_one();
+    else
+        FlushWalletEvents();
+}
+
+void static ThreadWalletEvents()
+{
+    try {
+        loop
+        {
+            {
+                boost::unique_lock<boost::mutex> lock(mutexWalletEvents);
+                while (queueWalletEvents.empty())
+                    condWalletEvents.wait(lock);
+            }
+            FlushWalletEvents();
+        }
+    } catch (...) {
+        boost::unique_lock<boost::mutex> lock(mutexWalletEvents);
+        fWalletEventThread = false;
+        throw;
+    }
+}
+
+void StartWalletEvents(boost::thread_group& threadGroup)
+{
+    // From now on events are queued; the thread handles those queued before it starts
+    {
+        boost::unique_lock<boost::mutex> lock(mutexWalletEvents);
+        fWalletEventThread = true;
+    }
+    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "wallet", &ThreadWalletEvents));
+}
+
 // erases transaction with the given hash from all wallets
 void static EraseFromWallets(uint256 hash)
 {
-    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
-        pwallet->EraseFromWallet(hash);
+    CWalletEvent event;
+    event.nType = CWalletEvent::ERASE_TX;
+    event.hash = hash;
+    PushWalletEvent(event);
 }
 
 // make sure all wallets know about the given transaction, in the given block
 void SyncWithWallets(const uint256 &hash, const CTransaction& tx, const CBlock* pblock, bool fUpdate)
 {
-    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
-        pwallet->AddToWalletIfInvolvingMe(hash, tx, pblock, fUpdate);
+    CWalletEvent event;
+    event.nType = CWalletEvent::SYNC_TX;
+    event.hash = hash;
+    event.tx = tx;
+    event.fUpdate = fUpdate;
+    if (pblock)
+        event.pblock.reset(new CBlock(*pblock));
+    PushWalletEvent(event);
+}
+
+// make sure all wallets know about the transactions of a connected block
+void static SyncBlockWithWallets(const CBlock& block, const std::vector<uint256>& vTxHash)
+{
+    if (setpwalletRegistered.empty())
+        return;
+    CWalletEvent event;
+    event.nType = CWalletEvent::SYNC_BLOCK;
+    event.pblock.reset(new CBlock(block));
+    event.vTxHash = vTxHash;
+    PushWalletEvent(event);
 }
 
 // notify wallets about a new best chain
 void static SetBestChain(const CBlockLocator& loc)
 {
-    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
-        pwallet->SetBestChain(loc);
+    CWalletEvent event;
+    event.nType = CWalletEvent::SET_BEST_CHAIN;
+    event.locator = loc;
+    PushWalletEvent(event);
 }
 
 // notify wallets about an updated transaction
 void static UpdatedTransaction(const uint256& hashTx)
 {
-    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
-        pwallet->UpdatedTransaction(hashTx);
+    CWalletEvent event;
+    event.nType = CWalletEvent::UPDATED_TX;
+    event.hash = hashTx;
+    PushWalletEvent(event);
 }
 
 // dump all wallets
@@ -307,6 +451,7 @@ bool CCoinsViewMemPool::HaveCoins(const uint256 &txid) {
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
 CAddressDB *paddressmap = NULL;
+CAddressIndexQueue *paddressqueue = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -1212,7 +1357,7 @@ bool CWalletTx::AcceptWalletTransaction(bool fCheckInputs)
     {
         LOCK(mempool.cs);
         // Add previous supporting transactions first
-        BOOST_FOREACH(CMerkleTx& tx, vtxPrev)
+        BOOST_FOREACH(CMerkleTx& tx, vtxPrev.Get())
         {
             if (!tx.IsCoinBase())
             {
@@ -1245,15 +1390,9 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
         if (fTxIndex) {
             CDiskTxPos postx;
             if (pblocktree->ReadTxIndex(hash, postx)) {
-                CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
                 CBlockHeader header;
-                try {
-                    file >> header;
-                    fseek(file, postx.nTxOffset, SEEK_CUR);
-                    file >> txOut;
-                } catch (std::exception &e) {
-                    return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
-                }
+                if (!ReadTransaction(postx, txOut, header))
+                    return false;
                 hashBlock = header.GetHash();
                 if (txOut.GetHash() != hash)
                     return error("%s() : txid mismatch", __PRETTY_FUNCTION__);
@@ -1300,22 +1439,134 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
+bool CBlockIndex::ReadBlockHeader(CBlockHeader& block) const
+{
+    block = GetPartialHeader();
+    if (!HasHeaderExtensions())
+        return true;
+    CDiskBlockIndex diskindex;
+    if (!pblocktree->ReadBlockIndex(GetBlockHash(), diskindex))
+        return error("CBlockIndex::ReadBlockHeader() : failed to read index entry of block %s", GetBlockHash().ToString().c_str());
+    block.hashWholeBlock = diskindex.hashWholeBlock;
+    block.MinerSignature = diskindex.MinerSignature;
+    return true;
+}
+
+// Write the index entry of a block after a change of its status or position; the
+// mining extensions of the header are taken from the entry already stored
+bool static UpdateBlockIndex(CBlockIndex* pindex)
+{
+    CBlockHeader block;
+    if (!pindex->ReadBlockHeader(block))
+        return false;
+    return pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex, block));
+}
+
+// Block index entries are allocated in large chunks and never freed one by one, which
+// saves the per-allocation overhead and keeps entries loaded together close in memory
+class CBlockIndexPool
+{
+private:
+    static const unsigned int CHUNK_SIZE = 4096;
+    std::vector<CBlockIndex*> vChunks;
+    unsigned int nUsed; // entries handed out from the last chunk
+
+public:
+    CBlockIndexPool() : nUsed(CHUNK_SIZE) {}
+
+    ~CBlockIndexPool()
+    {
+        BOOST_FOREACH(CBlockIndex* pchunk, vChunks)
+            delete[] pchunk;
+    }
+
+    CBlockIndex* Allocate()
+    {
+        if (nUsed == CHUNK_SIZE) {
+            vChunks.push_back(new CBlockIndex[CHUNK_SIZE]);
+            nUsed = 0;
+        }
+        return &vChunks.back()[nUsed++];
+    }
+};
+static CBlockIndexPool blockIndexPool;
+
+static CBlockIndex* NewBlockIndex()
+{
+    return blockIndexPool.Allocate();
+}
+
+// The main chain by height, kept in step with pindexBest and the pnext pointers
+static std::vector<CBlockIndex*> vChainActive;
+
+static void SetChainActiveTip(CBlockIndex* pindexTip)
+{
+    if (pindexTip == NULL) {
+        vChainActive.clear();
+        return;
+    }
+    vChainActive.resize(pindexTip->nHeight + 1);
+    // only the blocks above the fork point change
+    CBlockIndex* pindex = pindexTip;
+    while (pindex && vChainActive[pindex->nHeight] != pindex) {
+        vChainActive[pindex->nHeight] = pindex;
+        pindex = pindex->pprev;
+    }
+}
+
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    if (nHeight < 0 || nHeight >= (int)vChainActive.size())
+        return NULL;
+    return vChainActive[nHeight];
+}
+
+// Turn the lowest '1' bit in the binary representation of a number into a '0'
+static inline int InvertLowestOne(int n) { return n & (n - 1); }
+
+// Height to jump back to with the skip pointer of a block at the given height
+static inline int GetSkipHeight(int height)
+{
+    if (height < 2)
+        return 0;
+    // Jump back quickly to the same height as the next jumps of the predecessors,
+    // so that any ancestor is reached in O(log n) steps
+    return (height & 1) ? InvertLowestOne(InvertLowestOne(height - 1)) + 1 : InvertLowestOne(height);
+}
+
+CBlockIndex* CBlockIndex::GetAncestor(int height)
+{
+    if (height > nHeight || height < 0)
+        return NULL;
+
+    CBlockIndex* pindexWalk = this;
+    int heightWalk = nHeight;
+    while (heightWalk > height) {
+        int heightSkip = GetSkipHeight(heightWalk);
+        int heightSkipPrev = GetSkipHeight(heightWalk - 1);
+        if (pindexWalk->pskip != NULL &&
+            (heightSkip == height ||
+             (heightSkip > height && !(heightSkipPrev < heightSkip - 2 && heightSkipPrev >= height)))) {
+            // only follow pskip if pprev->pskip isn't better than pskip->pprev
+            pindexWalk = pindexWalk->pskip;
+            heightWalk = heightSkip;
+        } else {
+            pindexWalk = pindexWalk->pprev;
+            heightWalk--;
+        }
+    }
+    return pindexWalk;
+}
+
+const CBlockIndex* CBlockIndex::GetAncestor(int height) const
+{
+    return const_cast<CBlockIndex*>(this)->GetAncestor(height);
+}
+
+void CBlockIndex::BuildSkip()
+{
+    if (pprev)
+        pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex)
@@ -1663,7 +1914,7 @@ void static InvalidChainFound(CBlockIndex* pindexNew)
 
 void static InvalidBlockFound(CBlockIndex *pindex) {
     pindex->nStatus |= BLOCK_FAILED_VALID;
-    pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex));
+    UpdateBlockIndex(pindex);
     setBlockIndexValid.erase(pindex);
     InvalidChainFound(pindex);
     if (pindex->pnext) {
@@ -1696,7 +1947,7 @@ bool ConnectBestBlock(CValidationState &state) {
                 while (pindexTest != pindexFailed) {
                     pindexFailed->nStatus |= BLOCK_FAILED_CHILD;
                     setBlockIndexValid.erase(pindexFailed);
-                    pblocktree->WriteBlockIndex(CDiskBlockIndex(pindexFailed));
+                    UpdateBlockIndex(pindexFailed);
                     pindexFailed = pindexFailed->pprev;
                 }
                 InvalidChainFound(pindexNewBest);
@@ -1928,7 +2179,7 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
 
 
 
-bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &view, bool *pfClean)
+bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &view, bool *pfClean, CAddressIndexBlock *paddrblock)
 {
     assert(pindex == view.GetBestBlock());
 
@@ -2007,6 +2258,20 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
     // move best block pointer to prevout block
     view.SetBestBlock(pindex->pprev);
 
+    if (paddrblock) {
+        paddrblock->hashBlock = pindex->GetBlockHash();
+        paddrblock->hashPrevBlock = pindex->pprev->GetBlockHash();
+        paddrblock->nHeight = pindex->nHeight;
+        paddrblock->fDisconnect = true;
+        CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(vtx.size()));
+        for (unsigned int i = 0; i < vtx.size(); i++) {
+            paddrblock->vpos.push_back(make_pair(vtx[i].GetHash(), pos));
+            pos.nTxOffset += ::GetSerializeSize(vtx[i], SER_DISK, CLIENT_VERSION);
+        }
+        paddrblock->vtx = vtx;
+        paddrblock->undo.vtxundo.swap(blockUndo.vtxundo);
+    }
+
     if (pfClean) {
         *pfClean = fClean;
         return true;
@@ -2047,7 +2312,7 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
-bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsViewCache &view, bool fJustCheck)
+bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsViewCache &view, bool fJustCheck, CAddressIndexBlock *paddrblock)
 {
     // Check it again in case a previous version let a bad block in
     if (!CheckBlock(state, !fJustCheck, !fJustCheck))
@@ -2105,9 +2370,13 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(vtx.size()));
     std::vector<std::pair<uint256, CDiskTxPos> > vPos;
     vPos.reserve(vtx.size());
+    std::vector<std::pair<uint256, CTxFeeInfo> > vFees;
+    if (fTxFeeIndex)
+        vFees.reserve(vtx.size());
     for (unsigned int i=0; i<vtx.size(); i++)
     {
         const CTransaction &tx = vtx[i];
+        int64 nValueIn = 0;
 
         nInputs += tx.vin.size();
         nSigOps += tx.GetLegacySigOpCount();
@@ -2129,7 +2398,8 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
                      return state.DoS(100, error("ConnectBlock() : too many sigops"));
             }
 
-            nFees += tx.GetValueIn(view)-tx.GetValueOut();
+            nValueIn = tx.GetValueIn(view);
+            nFees += nValueIn-tx.GetValueOut();
 
             std::vector<CScriptCheck> vChecks;
             if (!tx.CheckInputs(state, view, fScriptChecks, flags, nScriptCheckThreads ? &vChecks : NULL))
@@ -2142,8 +2412,11 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
         if (!tx.IsCoinBase())
             blockundo.vtxundo.push_back(txundo);
 
+        unsigned int nTxSize = ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
         vPos.push_back(std::make_pair(GetTxHash(i), pos));
-        pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+        pos.nTxOffset += nTxSize;
+        if (fTxFeeIndex)
+            vFees.push_back(std::make_pair(GetTxHash(i), CTxFeeInfo(tx, nValueIn, nTxSize, pindex->nHeight)));
     }
     int64 nTime = GetTimeMicros() - nStart;
     if (fBenchmark)
@@ -2178,8 +2451,7 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
 
         pindex->nStatus = (pindex->nStatus & ~BLOCK_VALID_MASK) | BLOCK_VALID_SCRIPTS;
 
-        CDiskBlockIndex blockindex(pindex);
-        if (!pblocktree->WriteBlockIndex(blockindex))
+        if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex, *this)))
             return state.Abort(_("Failed to write block index"));
     }
 
@@ -2187,26 +2459,145 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
         if (!pblocktree->WriteTxIndex(vPos))
             return state.Abort(_("Failed to write transaction index"));
 
-    if (fAddrIndex)
-        if (!paddressmap->AddTx(vtx, vPos))
-            return state.Abort(_("Failed to write address index"));
+    if (fTxFeeIndex)
+        if (!pblocktree->WriteTxFeeIndex(vFees))
+            return state.Abort(_("Failed to write transaction fee index"));
+
+    if (paddrblock) {
+        // the undo data holds all spent outputs, so indexing needs no further lookups
+        paddrblock->hashBlock = pindex->GetBlockHash();
+        paddrblock->hashPrevBlock = pindex->pprev->GetBlockHash();
+        paddrblock->nHeight = pindex->nHeight;
+        paddrblock->vtx = vtx;
+        paddrblock->vpos = vPos;
+        paddrblock->undo.vtxundo.swap(blockundo.vtxundo);
+    }
 
     // add this block to the view's block chain
     assert(view.SetBestBlock(pindex));
 
     // Watch for transactions paying to me
+    std::vector<uint256> vTxHash(vtx.size());
     for (unsigned int i=0; i<vtx.size(); i++)
-        SyncWithWallets(GetTxHash(i), vtx[i], this, true);
+        vTxHash[i] = GetTxHash(i);
+    SyncBlockWithWallets(*this, vTxHash);
 
     return true;
 }
 
+// Delete the oldest block and undo files while they take more space than -prune allows.
+// Files holding any of the last MIN_BLOCKS_TO_KEEP blocks below nTipHeight are kept, as is
+// the file currently written to. Must be called with the coin database flushed, so the
+// blocks needed to replay the chain state after a crash are never removed.
+void static PruneBlockFiles(int nTipHeight)
+{
+    if (nTipHeight <= (int)MIN_BLOCKS_TO_KEEP)
+        return;
+    unsigned int nPruneBelow = nTipHeight - MIN_BLOCKS_TO_KEEP;
+
+    set<int> setPruned;
+    {
+        LOCK(cs_LastBlockFile);
+        fCheckForPruning = false;
+
+        vector<CBlockFileInfo> vinfo(nLastBlockFile + 1);
+        uint64 nUsage = 0;
+        for (int nFile = 0; nFile <= nLastBlockFile; nFile++) {
+            if (nFile == nLastBlockFile)
+                vinfo[nFile] = infoLastBlockFile;
+            else
+                pblocktree->ReadBlockFileInfo(nFile, vinfo[nFile]);
+            nUsage += vinfo[nFile].nSize + vinfo[nFile].nUndoSize;
+        }
+
+        // leave room for the next pre-allocation
+        uint64 nBuffer = BLOCKFILE_CHUNK_SIZE + UNDOFILE_CHUNK_SIZE;
+        for (int nFile = 0; nFile < nLastBlockFile && nUsage + nBuffer > nPruneTarget; nFile++) {
+            CBlockFileInfo &info = vinfo[nFile];
+            if (info.nSize == 0 || info.nHeightLast >= nPruneBelow)
+                continue;
+            nUsage -= info.nSize + info.nUndoSize;
+            info.SetNull();
+            if (!pblocktree->WriteBlockFileInfo(nFile, info))
+                return;
+            setPruned.insert(nFile);
+        }
+    }
+    if (setPruned.empty())
+        return;
+
+    // Stop pointing into the files before they go away
+    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi) {
+        CBlockIndex* pindex = (*mi).second;
+        if ((pindex->nStatus & BLOCK_HAVE_MASK) && setPruned.count(pindex->nFile)) {
+            pindex->nStatus &= ~BLOCK_HAVE_MASK;
+            pindex->nFile = 0;
+            pindex->nDataPos = 0;
+            pindex->nUndoPos = 0;
+            UpdateBlockIndex(pindex);
+        }
+    }
+    fHavePruned = true;
+    pblocktree->WriteFlag("prunedblockfiles", true);
+    pblocktree->Sync();
+
+    BOOST_FOREACH(int nFile, setPruned) {
+        CDiskBlockPos pos(nFile, 0);
+        blockFileCache.Erase(nFile);
+        boost::system::error_code ec;
+        boost::filesystem::remove(GetBlockPosFilename(pos, "blk"), ec);
+        boost::filesystem::remove(GetBlockPosFilename(pos, "rev"), ec);
+        printf("Pruned blk%05u.dat and rev%05u.dat\n", nFile, nFile);
+    }
+}
+
+/** Address index changes of a chain switch. They are handed to the index only once the
+ *  switch succeeded, in the order they were added, and dropped otherwise.
+ */
+class CAddressIndexUpdate
+{
+private:
+    std::vector<CAddressIndexBlock*> vBlocks;
+
+public:
+    ~CAddressIndexUpdate()
+    {
+        BOOST_FOREACH(CAddressIndexBlock* pblock, vBlocks)
+            delete pblock;
+    }
+
+    CAddressIndexBlock* Add()
+    {
+        vBlocks.push_back(new CAddressIndexBlock());
+        return vBlocks.back();
+    }
+
+    bool Commit()
+    {
+        bool fOk = true;
+        BOOST_FOREACH(CAddressIndexBlock* pblock, vBlocks) {
+            if (paddressqueue)
+                paddressqueue->Push(pblock);
+            else {
+                fOk = fOk && paddressmap->WriteBlock(*pblock);
+                delete pblock;
+            }
+        }
+        vBlocks.clear();
+        return fOk;
+    }
+};
+
 bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
 {
     // All modifications to the coin state will be done in this cache.
     // Only when all have succeeded, we push it to pcoinsTip.
     CCoinsViewCache view(*pcoinsTip, true);
 
+    // Likewise for the address index, unless a background build is adding the blocks
+    CAddressIndexUpdate addrupdate;
+    bool fIndexAddresses = fAddrIndex && !addrIndexBuilder.IsBuilding();
+
     // Find the fork (typically, there is none)
     CBlockIndex* pfork = view.GetBestBlock();
     CBlockIndex* plonger = pindexNew;
@@ -2245,7 +2636,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         if (!block.ReadFromDisk(pindex))
             return state.Abort(_("Failed to read block"));
         int64 nStart = GetTimeMicros();
-        if (!block.DisconnectBlock(state, pindex, view))
+        if (!block.DisconnectBlock(state, pindex, view, NULL, fIndexAddresses ? addrupdate.Add() : NULL))
             return error("SetBestBlock() : DisconnectBlock %s failed", pindex->GetBlockHash().ToString().c_str());
         if (fBenchmark)
             printf("- Disconnect: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
@@ -2265,7 +2656,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         if (!block.ReadFromDisk(pindex))
             return state.Abort(_("Failed to read block"));
         int64 nStart = GetTimeMicros();
-        if (!block.ConnectBlock(state, pindex, view)) {
+        if (!block.ConnectBlock(state, pindex, view, false, fIndexAddresses && pindex->pprev ? addrupdate.Add() : NULL)) {
             if (state.IsInvalid()) {
                 InvalidChainFound(pindexNew);
                 InvalidBlockFound(pindex);
@@ -2290,7 +2681,8 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
 
     // Make sure it's successfully written to disk before changing memory structure
     bool fIsInitialDownload = IsInitialBlockDownload();
-    if (!fIsInitialDownload || pcoinsTip->GetCacheSize() > nCoinCacheSize) {
+    bool fPrune = fPruneMode && fCheckForPruning;
+    if (!fIsInitialDownload || fPrune || pcoinsTip->GetCacheSize() > nCoinCacheSize) {
         // Typical CCoins structures on disk are around 100 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
@@ -2302,8 +2694,13 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         pblocktree->Sync();
         if (!pcoinsTip->Flush())
             return state.Abort(_("Failed to write to coin database"));
+        if (fPrune)
+            PruneBlockFiles(pindexNew->nHeight);
     }
 
+    if (!addrupdate.Commit())
+        return state.Abort(_("Failed to write address index"));
+
     // At this point, all changes have been done to the database.
     // Proceed by updating the memory structures.
 
@@ -2341,7 +2738,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = pindexNew->GetBlockHash();
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
+    SetChainActiveTip(pindexBest);
     nBestHeight = pindexBest->nHeight;
     nBestChainWork = pindexNew->nChainWork;
     nTimeBestReceived = GetTime();
@@ -2389,8 +2786,8 @@ bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
         return state.Invalid(error("AddToBlockIndex() : %s already exists", hash.ToString().c_str()));
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(*this);
-    assert(pindexNew);
+    CBlockIndex* pindexNew = NewBlockIndex();
+    *pindexNew = CBlockIndex(*this);
     map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
     map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
@@ -2398,6 +2795,7 @@ bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
     {
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
+        pindexNew->BuildSkip();
     }
     pindexNew->nTx = vtx.size();
     pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork().getuint256();
@@ -2408,7 +2806,7 @@ bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
     pindexNew->nStatus = BLOCK_VALID_TRANSACTIONS | BLOCK_HAVE_DATA;
     setBlockIndexValid.insert(pindexNew);
 
-    if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindexNew)))
+    if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindexNew, *this)))
         return state.Abort(_("Failed to write block index"));
 
     // New best?
@@ -2466,6 +2864,7 @@ bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAdd
         if (nNewChunks > nOldChunks) {
             if (CheckDiskSpace(nNewChunks * BLOCKFILE_CHUNK_SIZE - pos.nPos)) {
                 FILE *file = OpenBlockFile(pos);
+                fCheckForPruning = true;
                 if (file) {
                     printf("Pre-allocating up to position 0x%x in blk%05u.dat\n", nNewChunks * BLOCKFILE_CHUNK_SIZE, pos.nFile);
                     AllocateFileRange(file, pos.nPos, nNewChunks * BLOCKFILE_CHUNK_SIZE - pos.nPos);
@@ -2512,6 +2911,7 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
     if (nNewChunks > nOldChunks) {
         if (CheckDiskSpace(nNewChunks * UNDOFILE_CHUNK_SIZE - pos.nPos)) {
             FILE *file = OpenUndoFile(pos);
+            fCheckForPruning = true;
             if (file) {
                 printf("Pre-allocating up to position 0x%x in rev%05u.dat\n", nNewChunks * UNDOFILE_CHUNK_SIZE, pos.nFile);
                 AllocateFileRange(file, pos.nPos, nNewChunks * UNDOFILE_CHUNK_SIZE - pos.nPos);
@@ -2526,6 +2926,12 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
 }
 
 
+// Hashes of blocks whose proof of work (including the whole block hash and the miner
+// signature) was verified by this process. Lets ConnectBlock skip repeating the check for
+// blocks that ProcessBlock or the import pipeline have just accepted.
+static CCriticalSection cs_setPoWChecked;
+static mruset<uint256> setPoWChecked(1000);
+
 bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckVotes) const
 {
     // These are checks that are independent of context
@@ -2537,8 +2943,22 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
 
 
     // Check proof of work matches claimed amount
-    if (fCheckPOW && !CheckProofOfWork())
-        return state.DoS(50, error("CheckBlock() : proof of work failed"));
+    // (the cached result is only trusted together with the merkle root check below,
+    // which binds the transactions to the header hash)
+    if (fCheckPOW) {
+        uint256 hash = GetHash();
+        bool fCached = false;
+        if (fCheckMerkleRoot) {
+            LOCK(cs_setPoWChecked);
+            fCached = setPoWChecked.count(hash) > 0;
+        }
+        if (!fCached) {
+            if (!CheckProofOfWork())
+                return state.DoS(50, error("CheckBlock() : proof of work failed"));
+            LOCK(cs_setPoWChecked);
+            setPoWChecked.insert(hash);
+        }
+    }
 
     // Check timestamp
     if (GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
@@ -2776,14 +3196,22 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
 
     // Write block to history file
     try {
-        unsigned int nBlockSize = ::GetSerializeSize(*this, SER_DISK, CLIENT_VERSION);
+        std::vector<char> vchRecord;
+        unsigned int nRecordSize = 0, nDiskSize;
         CDiskBlockPos blockPos;
-        if (dbp != NULL)
+        if (dbp != NULL) {
+            // already stored, possibly in another format than we would write it in
             blockPos = *dbp;
-        if (!FindBlockPos(state, blockPos, nBlockSize+8, nHeight, nTime, dbp != NULL))
+            if (!GetBlockRecordDiskSize(blockPos, nDiskSize))
+                nDiskSize = ::GetSerializeSize(*this, SER_DISK, CLIENT_VERSION) + 8;
+        } else {
+            nRecordSize = GetDiskRecord(vchRecord);
+            nDiskSize = vchRecord.size() + 8;
+        }
+        if (!FindBlockPos(state, blockPos, nDiskSize, nHeight, nTime, dbp != NULL))
             return error("AcceptBlock() : FindBlockPos failed");
         if (dbp == NULL)
-            if (!WriteToDisk(blockPos))
+            if (!WriteToDisk(blockPos, vchRecord, nRecordSize))
                 return state.Abort(_("Failed to write block"));
         if (!AddToBlockIndex(state, blockPos))
             return error("AcceptBlock() : AddToBlockIndex failed");
@@ -3076,11 +3504,16 @@ CCriticalSection cs_LastBlockFile;
 CBlockFileInfo infoLastBlockFile;
 int nLastBlockFile = 0;
 
+boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char *prefix)
+{
+    return GetDataDir() / "blocks" / strprintf("%s%05u.dat", prefix, pos.nFile);
+}
+
 FILE* OpenDiskFile(const CDiskBlockPos &pos, const char *prefix, bool fReadOnly)
 {
     if (pos.IsNull())
         return NULL;
-    boost::filesystem::path path = GetDataDir() / "blocks" / strprintf("%s%05u.dat", prefix, pos.nFile);
+    boost::filesystem::path path = GetBlockPosFilename(pos, prefix);
     boost::filesystem::create_directories(path.parent_path());
     FILE* file = fopen(path.string().c_str(), "rb+");
     if (!file && !fReadOnly)
@@ -3118,9 +3551,7 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = NewBlockIndex();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
@@ -3134,23 +3565,29 @@ bool static LoadBlockIndexDB()
 
     boost::this_thread::interruption_point();
 
-    // Calculate nChainWork
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
+    // Calculate nChainWork; LoadBlockIndexGuts left the work of each block in it.
+    // Predecessors must come first, so order by height with a counting sort
+    int64 nStart = GetTimeMillis();
+    int nMaxHeight = 0;
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        nMaxHeight = std::max(nMaxHeight, item.second->nHeight);
+    vector<unsigned int> vHeightStart(nMaxHeight + 2, 0);
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vHeightStart[item.second->nHeight + 1]++;
+    for (int nHeight = 1; nHeight <= nMaxHeight + 1; nHeight++)
+        vHeightStart[nHeight] += vHeightStart[nHeight - 1];
+    vector<CBlockIndex*> vSortedByHeight(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vSortedByHeight[vHeightStart[item.second->nHeight]++] = item.second;
+    BOOST_FOREACH(CBlockIndex* pindex, vSortedByHeight)
     {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
-    }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
-    {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork().getuint256();
+        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->nChainWork;
         pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
+        pindex->BuildSkip();
         if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK))
             setBlockIndexValid.insert(pindex);
     }
+    printf("LoadBlockIndexDB(): chain work of %u blocks in %"PRI64d"ms\n", (unsigned int)vSortedByHeight.size(), GetTimeMillis() - nStart);
 
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
@@ -3171,6 +3608,13 @@ bool static LoadBlockIndexDB()
     // Check whether we have a transaction index
     pblocktree->ReadFlag("txindex", fTxIndex);
     printf("LoadBlockIndexDB(): transaction index %s\n", fTxIndex ? "enabled" : "disabled");
+    pblocktree->ReadFlag("txfeeindex", fTxFeeIndex);
+    printf("LoadBlockIndexDB(): transaction fee index %s\n", fTxFeeIndex ? "enabled" : "disabled");
+
+    // Check whether block files have been pruned
+    pblocktree->ReadFlag("prunedblockfiles", fHavePruned);
+    if (fHavePruned)
+        printf("LoadBlockIndexDB(): block files have been pruned\n");
 
     // Check whether we have a address index
     paddressmap->ReadEnable(fAddrIndex);
@@ -3191,6 +3635,7 @@ bool static LoadBlockIndexDB()
          pindexPrev->pnext = pindex;
          pindex = pindexPrev;
     }
+    SetChainActiveTip(pindexBest);
     printf("LoadBlockIndexDB(): hashBestChain=%s  height=%d date=%s\n",
         hashBestChain.ToString().c_str(), nBestHeight,
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", pindexBest->GetBlockTime()).c_str());
@@ -3220,6 +3665,10 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
         boost::this_thread::interruption_point();
         if (pindex->nHeight < nBestHeight-nCheckDepth)
             break;
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA)) {
+            printf("VerifyDB(): block data pruned below height %d, stopping\n", pindex->nHeight + 1);
+            break;
+        }
         CBlock block;
         // check level 0: read from disk
         if (!block.ReadFromDisk(pindex))
@@ -3281,6 +3730,7 @@ void UnloadBlockIndex()
     nBestInvalidWork = 0;
     hashBestChain = 0;
     pindexBest = NULL;
+    SetChainActiveTip(NULL);
 }
 
 static CBlock getGenesisBlock()
@@ -3331,6 +3781,8 @@ bool InitBlockIndex() {
     // Use the provided setting for -txindex in the new database
     fTxIndex = GetBoolArg("-txindex", false);
     pblocktree->WriteFlag("txindex", fTxIndex);
+    fTxFeeIndex = GetBoolArg("-txfeeindex", false);
+    pblocktree->WriteFlag("txfeeindex", fTxFeeIndex);
     // Use the provided setting for -addrindex in the new database
     fAddrIndex = GetBoolArg("-addrindex", false);
     paddressmap->WriteEnable(fAddrIndex);
@@ -3359,12 +3811,13 @@ bool InitBlockIndex() {
 
         // Start new block file
         try {
-            unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+            std::vector<char> vchRecord;
+            unsigned int nRecordSize = block.GetDiskRecord(vchRecord);
             CDiskBlockPos blockPos;
             CValidationState state;
-            if (!FindBlockPos(state, blockPos, nBlockSize+8, 0, block.nTime))
+            if (!FindBlockPos(state, blockPos, vchRecord.size()+8, 0, block.nTime))
                 return error("LoadBlockIndex() : FindBlockPos failed");
-            if (!block.WriteToDisk(blockPos))
+            if (!block.WriteToDisk(blockPos, vchRecord, nRecordSize))
                 return error("LoadBlockIndex() : writing genesis block to disk failed");
             if (!block.AddToBlockIndex(state, blockPos))
                 return error("LoadBlockIndex() : genesis block not accepted");
@@ -3448,33 +3901,179 @@ void PrintBlockTree()
     }
 }
 
-bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
+/** Pipeline used to import block files. A reader thread scans the input for block
+ *  records, worker threads deserialize the blocks and run the context-free checks
+ *  (CheckBlock, including the proof of work and whole block hash) in parallel, and
+ *  the calling thread hands the checked blocks to ProcessBlock in file order.
+ */
+class CBlockImportQueue
 {
-    int64 nStart = GetTimeMillis();
+public:
+    struct CImportItem
+    {
+        uint64 nBlockPos;
+        std::vector<char> vchData;
+        bool fCompressed;
+        CBlock block;
+        bool fReady;
+        bool fValid;
+
+        CImportItem() : nBlockPos(0), fCompressed(false), fReady(false), fValid(false) {}
+    };
+
+private:
+    boost::mutex mutex;
+    boost::condition_variable condWork;  // records queued for the workers
+    boost::condition_variable condReady; // a record was checked, or the input ended
+    boost::condition_variable condSpace; // room for the reader to queue more records
+
+    std::deque<CImportItem*> queueOrdered; // all records in flight, in file order
+    std::deque<CImportItem*> queueWork;    // records not yet picked up by a worker
+    unsigned int nMaxInFlight;
+    bool fEof;
+    bool fStop;
+    boost::thread_group threads;
+
+    void ThreadWorker()
+    {
+        RenameThread("bitcoin-loadchk");
+        while (true) {
+            CImportItem *pitem;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queueWork.empty() && !fEof && !fStop)
+                    condWork.wait(lock);
+                if (fStop || queueWork.empty())
+                    return;
+                pitem = queueWork.front();
+                queueWork.pop_front();
+            }
 
-    unsigned char pchMessageStart[4];
+            try {
+                if (pitem->fCompressed) {
+                    std::vector<char> vchRaw;
+                    if (!DecompressBlockRecord(&pitem->vchData[0], &pitem->vchData[0] + pitem->vchData.size(), vchRaw))
+                        throw std::runtime_error("invalid compressed block record");
+                    pitem->vchData.swap(vchRaw);
+                }
+                CBufferReader reader(&pitem->vchData[0], &pitem->vchData[0] + pitem->vchData.size(), SER_DISK, CLIENT_VERSION);
+                reader >> pitem->block;
+                // failures are reported again, with context, by ProcessBlock
+                CValidationState state;
+                pitem->block.CheckBlock(state);
+                pitem->fValid = true;
+            } catch (std::exception &e) {
+                printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
+            }
+            std::vector<char>().swap(pitem->vchData);
 
-    int nLoaded = 0;
-    try {
-        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
-        uint64 nStartByte = 0;
-        if (dbp) {
-            // (try to) skip already indexed part
-            CBlockFileInfo info;
-            if (pblocktree->ReadBlockFileInfo(dbp->nFile, info)) {
-                nStartByte = info.nSize;
-                blkdat.Seek(info.nSize);
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                pitem->fReady = true;
+            }
+            condReady.notify_all();
+        }
+    }
+
+public:
+    CBlockImportQueue(int nWorkers) : nMaxInFlight(8 * nWorkers), fEof(false), fStop(false)
+    {
+        for (int i = 0; i < nWorkers; i++)
+            threads.create_thread(boost::bind(&CBlockImportQueue::ThreadWorker, this));
+    }
+
+    ~CBlockImportQueue()
+    {
+        Stop();
+        BOOST_FOREACH(CImportItem *pitem, queueOrdered)
+            delete pitem;
+    }
+
+    template<typename Stream>
+    void StartReader(Stream &blkdat, uint64 nStartByte)
+    {
+        threads.create_thread(boost::bind(&CBlockImportQueue::ThreadReader<Stream>, this, boost::ref(blkdat), nStartByte));
+    }
+
+    // Stop all pipeline threads; blocks not yet handed out are dropped
+    void Stop()
+    {
+        boost::this_thread::disable_interruption di;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+        }
+        condWork.notify_all();
+        condReady.notify_all();
+        condSpace.notify_all();
+        threads.join_all();
+    }
+
+    // Queue a block record; returns false if the pipeline was stopped
+    bool Push(uint64 nBlockPos, std::vector<char> &vchData, bool fCompressed)
+    {
+        CImportItem *pitem = new CImportItem();
+        pitem->nBlockPos = nBlockPos;
+        pitem->vchData.swap(vchData);
+        pitem->fCompressed = fCompressed;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (queueOrdered.size() >= nMaxInFlight && !fStop)
+                condSpace.wait(lock);
+            if (fStop) {
+                delete pitem;
+                return false;
             }
+            queueOrdered.push_back(pitem);
+            queueWork.push_back(pitem);
         }
+        condWork.notify_one();
+        return true;
+    }
+
+    void SetEof()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fEof = true;
+        }
+        condWork.notify_all();
+        condReady.notify_all();
+    }
+
+    // Return the next checked block in file order (owned by the caller), or NULL at the end
+    CImportItem* Pop()
+    {
+        CImportItem *pitem;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fStop && (queueOrdered.empty() ? !fEof : !queueOrdered.front()->fReady))
+                condReady.wait(lock);
+            if (fStop || queueOrdered.empty())
+                return NULL;
+            pitem = queueOrdered.front();
+            queueOrdered.pop_front();
+        }
+        condSpace.notify_one();
+        return pitem;
+    }
+
+private:
+    // Scan a stream for block records (message start, size, block) and queue them
+    template<typename Stream>
+    void ThreadReader(Stream &blkdat, uint64 nStartByte)
+    {
+        RenameThread("bitcoin-loadrd");
+        unsigned char pchMessageStart[4];
+        GetMessageStart(pchMessageStart);
+
         uint64 nRewind = blkdat.GetPos();
         while (blkdat.good() && !blkdat.eof()) {
-            boost::this_thread::interruption_point();
-            GetMessageStart(pchMessageStart);
-
             blkdat.SetPos(nRewind);
             nRewind++; // start one byte further next time, in case of failure
             blkdat.SetLimit(); // remove former limit
             unsigned int nSize = 0;
+            bool fCompressed = false;
             try {
                 // locate a header
                 unsigned char buf[4];
@@ -3485,36 +4084,101 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
                     continue;
                 // read size
                 blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                fCompressed = (nSize & BLOCKRECORD_COMPRESSED) != 0;
+                nSize &= ~BLOCKRECORD_COMPRESSED;
+                if (nSize < (fCompressed ? 4 : 80) || nSize > MAX_BLOCK_SIZE)
                     continue;
             } catch (std::exception &e) {
                 // no valid block header found; don't complain
                 break;
             }
             try {
-                // read block
+                // read the raw block; it is deserialized by a worker
                 uint64 nBlockPos = blkdat.GetPos();
                 blkdat.SetLimit(nBlockPos + nSize);
-                CBlock block;
-                blkdat >> block;
+                std::vector<char> vchData(nSize);
+                for (unsigned int nRead = 0; nRead < nSize; nRead += 4096)
+                    blkdat.read(&vchData[nRead], std::min(nSize - nRead, 4096U));
                 nRewind = blkdat.GetPos();
 
-                // process block
-                if (nBlockPos >= nStartByte) {
+                if (nBlockPos >= nStartByte && !Push(nBlockPos, vchData, fCompressed))
+                    break;
+            } catch (std::exception &e) {
+                printf("%s() : I/O error caught during load\n", __PRETTY_FUNCTION__);
+            }
+        }
+        SetEof();
+    }
+};
+
+bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
+{
+    int64 nStart = GetTimeMillis();
+
+    int nWorkers = std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS));
+
+    int nLoaded = 0;
+    try {
+        uint64 nStartByte = 0;
+        if (dbp) {
+            // (try to) skip already indexed part
+            CBlockFileInfo info;
+            if (pblocktree->ReadBlockFileInfo(dbp->nFile, info))
+                nStartByte = info.nSize;
+        }
+
+        // our own block files (-reindex) are scanned through a memory mapping with sequential readahead
+        boost::shared_ptr<CBlockFile> mapped;
+        if (dbp)
+            mapped = blockFileCache.Get(dbp->nFile, false);
+        boost::scoped_ptr<CBufferReader> preader;
+        boost::scoped_ptr<CBufferedFile> pfile;
+        if (mapped && mapped->IsMapped()) {
+            fclose(fileIn);
+            fileIn = NULL;
+            mapped->AdviseSequential();
+            preader.reset(new CBufferReader(mapped->begin(), mapped->end(), SER_DISK, CLIENT_VERSION));
+            preader->Seek(nStartByte);
+        } else {
+            pfile.reset(new CBufferedFile(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION));
+            if (nStartByte)
+                pfile->Seek(nStartByte);
+        }
+
+        {
+            // declared after the streams, so its threads are joined before the streams go away
+            CBlockImportQueue queue(nWorkers);
+            if (preader)
+                queue.StartReader(*preader, nStartByte);
+            else
+                queue.StartReader(*pfile, nStartByte);
+
+            // connect stage: hand the checked blocks to ProcessBlock in file order
+            while (true) {
+                boost::this_thread::interruption_point();
+                CBlockImportQueue::CImportItem *pitem = queue.Pop();
+                if (!pitem)
+                    break;
+                bool fError = false;
+                if (pitem->fValid) {
                     LOCK(cs_main);
                     if (dbp)
-                        dbp->nPos = nBlockPos;
+                        dbp->nPos = pitem->nBlockPos;
                     CValidationState state;
-                    if (ProcessBlock(state, NULL, &block, dbp))
+                    if (ProcessBlock(state, NULL, &pitem->block, dbp))
                         nLoaded++;
-                    if (state.IsError())
-                        break;
+                    fError = state.IsError();
                 }
-            } catch (std::exception &e) {
-                printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
+                delete pitem;
+                if (fError)
+                    break;
             }
         }
-        fclose(fileIn);
+
+        if (mapped)
+            mapped->AdviseSequential(false);
+        if (fileIn)
+            fclose(fileIn);
     } catch(std::runtime_error &e) {
         AbortNode(_("Error: system error: ") + e.what());
     }
@@ -3665,6 +4329,11 @@ void static ProcessGetData(CNode* pfrom)
                          send = false;
                        }
                     }
+                    // Pruned blocks can't be served
+                    if (!(((*mi).second)->nStatus & BLOCK_HAVE_DATA)) {
+                        printf("ProcessGetData(): ignoring request for pruned block %s\n", inv.hash.ToString().c_str());
+                        send = false;
+                    }
                 } else {
                     send = false;
                 }
@@ -4255,6 +4924,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 printf("  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
                 break;
             }
+            if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+            {
+                printf("  getblocks stopping at pruned block %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+                break;
+            }
             pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
             if (--nLimit <= 0)
             {
@@ -4297,7 +4971,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         printf("getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().c_str());
         for (; pindex; pindex = pindex->pnext)
         {
-            vHeaders.push_back(pindex->GetBlockHeader());
+            CBlockHeader header;
+            if (!pindex->ReadBlockHeader(header))
+                break;
+            vHeaders.push_back(header);
             if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
                 break;
         }
@@ -5577,10 +6254,7 @@ class CMainCleanup
 public:
     CMainCleanup() {}
     ~CMainCleanup() {
-        // block headers
-        std::map<uint256, CBlockIndex*>::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
+        // block headers, their memory is owned by the block index pool
         mapBlockIndex.clear();
 
         // orphan blocks
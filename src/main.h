@@ -11,6 +11,7 @@
 #include "script.h"
 #include "hashblock.h"
 #include "base58.h"
+#include "blockstore.h"
 
 #include <list>
 #include <algorithm>
@@ -85,6 +86,10 @@ inline bool MoneyRange(int64 nValue) { return (nValue >= 0 && nValue <= MAX_MONE
 static const int COINBASE_MATURITY = 100;
 /** Threshold for nLockTime: below this value it is interpreted as block number, otherwise as UNIX timestamp. */
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
+/** Number of recent blocks whose block and undo data is never pruned; enough to handle reorganizations */
+static const unsigned int MIN_BLOCKS_TO_KEEP = 1440;
+/** Smallest allowed -prune target, in bytes */
+static const uint64 MIN_DISK_SPACE_FOR_BLOCK_FILES = 550 * 1024 * 1024;
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 #ifdef USE_UPNP
@@ -126,7 +131,12 @@ extern bool fBenchmark;
 extern int nScriptCheckThreads;
 extern int nAskedForBlocks;    // Nodes sent a getblocks 0
 extern bool fTxIndex;
+extern bool fTxFeeIndex;
+extern bool fBlockCompress;
 extern bool fAddrIndex;
+extern bool fPruneMode;
+extern bool fHavePruned;
+extern uint64 nPruneTarget;
 extern unsigned int nCoinCacheSize;
 #if ENABLE_DARKSEND_FEATURES
 extern CDarkSendPool darkSendPool;
@@ -151,6 +161,8 @@ class CReserveKey;
 class CCoinsDB;
 class CBlockTreeDB;
 class CAddressDB;
+class CAddressIndexQueue;
+struct CAddressIndexBlock;
 struct CDiskBlockPos;
 class CCoins;
 class CTxUndo;
@@ -167,6 +179,10 @@ void RegisterWallet(CWallet* pwalletIn);
 void UnregisterWallet(CWallet* pwalletIn);
 /** Push an updated transaction to all registered wallets */
 void SyncWithWallets(const uint256 &hash, const CTransaction& tx, const CBlock* pblock = NULL, bool fUpdate = false);
+/** Handle the wallet events queued so far; must not be called with cs_main held */
+void FlushWalletEvents();
+/** Start the thread that passes transactions, blocks and the best chain on to the wallets */
+void StartWalletEvents(boost::thread_group& threadGroup);
 /** Process an incoming block */
 bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL);
 /** Check whether enough disk space is available for an incoming block */
@@ -175,6 +191,8 @@ bool CheckDiskSpace(uint64 nAdditionalBytes = 0);
 FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 /** Open an undo file (rev?????.dat) */
 FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
+/** Translate a block file position into the path of its blk?????.dat or rev?????.dat file */
+boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char *prefix);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL);
 /** Initialize a new block tree database + block data on disk */
@@ -187,7 +205,7 @@ void UnloadBlockIndex();
 bool VerifyDB(int nCheckLevel, int nCheckDepth);
 /** Print the loaded block tree */
 void PrintBlockTree();
-/** Find a block by height in the currently-connected chain */
+/** Find a block by height in the currently-connected chain, NULL if out of range */
 CBlockIndex* FindBlockByHeight(int nHeight);
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
@@ -860,16 +878,22 @@ public:
 
     bool ReadFromDisk(const CDiskBlockPos &pos, const uint256 &hashBlock)
     {
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlockUndo::ReadFromDisk() : OpenBlockFile failed");
-
-        // Read block
+        // Read undo data, preferably straight from the mapped undo file
         uint256 hashChecksum;
+        CBlockRecord record;
         try {
-            filein >> *this;
-            filein >> hashChecksum;
+            if (ReadBlockRecord(pos, true, record)) {
+                CBufferReader reader(record.begin(), record.end(), SER_DISK, CLIENT_VERSION);
+                reader >> *this;
+                reader >> hashChecksum;
+            } else {
+                // Open history file to read
+                CAutoFile filein = CAutoFile(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
+                if (!filein)
+                    return error("CBlockUndo::ReadFromDisk() : OpenBlockFile failed");
+                filein >> *this;
+                filein >> hashChecksum;
+            }
         }
         catch (std::exception &e) {
             return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
@@ -1640,7 +1664,23 @@ public:
         return hash;
     }
 
+    // The block as it is stored in a block file, compressed if -blockcompress is set.
+    // Returns the size field for the record header; see EncodeBlockRecord.
+    unsigned int GetDiskRecord(std::vector<char> &vchRecord) const
+    {
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << *this;
+        return EncodeBlockRecord(&ss[0], &ss[0] + ss.size(), fBlockCompress, vchRecord);
+    }
+
     bool WriteToDisk(CDiskBlockPos &pos)
+    {
+        std::vector<char> vchRecord;
+        unsigned int nSize = GetDiskRecord(vchRecord);
+        return WriteToDisk(pos, vchRecord, nSize);
+    }
+
+    bool WriteToDisk(CDiskBlockPos &pos, const std::vector<char> &vchRecord, unsigned int nSize)
     {
         // Open history file to append
         CAutoFile fileout = CAutoFile(OpenBlockFile(pos), SER_DISK, CLIENT_VERSION);
@@ -1650,7 +1690,6 @@ public:
         // Write index header
         unsigned char pchMessageStart[4];
         GetMessageStart(pchMessageStart);
-        unsigned int nSize = fileout.GetSerializeSize(*this);
         fileout << FLATDATA(pchMessageStart) << nSize;
 
         // Write block
@@ -1658,7 +1697,7 @@ public:
         if (fileOutPos < 0)
             return error("CBlock::WriteToDisk() : ftell failed");
         pos.nPos = (unsigned int)fileOutPos;
-        fileout << *this;
+        fileout.write(&vchRecord[0], vchRecord.size());
 
         // Flush stdio buffers and commit to disk before returning
         fflush(fileout);
@@ -1672,14 +1711,19 @@ public:
     {
         SetNull();
 
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-
-        // Read block
+        // Read block, preferably straight from the mapped block file
+        CBlockRecord record;
         try {
-            filein >> *this;
+            if (ReadBlockRecord(pos, false, record)) {
+                CBufferReader reader(record.begin(), record.end(), SER_DISK, CLIENT_VERSION);
+                reader >> *this;
+            } else {
+                // Open history file to read
+                CAutoFile filein = CAutoFile(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+                if (!filein)
+                    return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
+                filein >> *this;
+            }
         }
         catch (std::exception &e) {
             return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
@@ -1723,11 +1767,13 @@ public:
     /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
      *  In case pfClean is provided, operation will try to be tolerant about errors, and *pfClean
      *  will be true if no problems were found. Otherwise, the return value will be false in case
-     *  of problems. Note that in any case, coins may be modified. */
-    bool DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool *pfClean = NULL);
+     *  of problems. Note that in any case, coins may be modified. If paddrblock is provided,
+     *  it is filled with what the address index needs to remove the block. */
+    bool DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool *pfClean = NULL, CAddressIndexBlock *paddrblock = NULL);
 
-    // Apply the effects of this block (with given index) on the UTXO set represented by coins
-    bool ConnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool fJustCheck=false);
+    // Apply the effects of this block (with given index) on the UTXO set represented by coins,
+    // filling paddrblock, if provided, with what the address index needs to add it
+    bool ConnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool fJustCheck=false, CAddressIndexBlock *paddrblock = NULL);
 
     // Read a block from disk
     bool ReadFromDisk(const CBlockIndex* pindex);
@@ -1813,7 +1859,7 @@ public:
          if (nBlocks==0 || nTimeFirst > nTimeIn)
              nTimeFirst = nTimeIn;
          nBlocks++;
-         if (nHeightIn > nHeightFirst)
+         if (nHeightIn > nHeightLast)
              nHeightLast = nHeightIn;
          if (nTimeIn > nTimeLast)
              nTimeLast = nTimeIn;
@@ -1861,6 +1907,9 @@ public:
     // (memory only) pointer to the index of the *active* successor of this block
     CBlockIndex* pnext;
 
+    // (memory only) pointer to the index of some further predecessor of this block
+    CBlockIndex* pskip;
+
     // height of the entry in the chain. The genesis block has height 0
     int nHeight;
 
@@ -1887,21 +1936,20 @@ public:
     unsigned int nStatus;
 
     // block header
+    // The Spread mining extensions (hashWholeBlock, MinerSignature) are only needed to
+    // rebuild headers, and stay in the block tree database to keep the index small
     int nVersion;
     uint256 hashMerkleRoot;
     int64 nTime;
     unsigned int nBits;
     unsigned int nNonce;
 
-    // Spread mining extensions:
-    uint256 hashWholeBlock;
-    CMinerSignature MinerSignature;
-
     CBlockIndex()
     {
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nHeight = 0;
         nFile = 0;
         nDataPos = 0;
@@ -1913,11 +1961,9 @@ public:
 
         nVersion       = 0;
         hashMerkleRoot = 0;
-        hashWholeBlock = 0;
         nTime          = 0;
         nBits          = 0;
         nNonce         = 0;
-        MinerSignature.SetNull();
     }
 
     CBlockIndex(CBlockHeader& block)
@@ -1925,6 +1971,7 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nHeight = 0;
         nFile = 0;
         nDataPos = 0;
@@ -1936,11 +1983,9 @@ public:
 
         nVersion       = block.nVersion;
         hashMerkleRoot = block.hashMerkleRoot;
-        hashWholeBlock = block.hashWholeBlock;
         nTime          = block.nTime;
         nBits          = block.nBits;
         nNonce         = block.nNonce;
-        MinerSignature = block.MinerSignature;
     }
 
     CDiskBlockPos GetBlockPos() const {
@@ -1961,22 +2006,30 @@ public:
         return ret;
     }
 
-    CBlockHeader GetBlockHeader() const
+    // Whether the header has the Spread mining extensions
+    bool HasHeaderExtensions() const
+    {
+        return nHeight > (int)getSecondHardforkBlock();
+    }
+
+    // The header fields kept in memory; hashWholeBlock and MinerSignature are null
+    CBlockHeader GetPartialHeader() const
     {
         CBlockHeader block;
         block.nVersion       = nVersion;
         if (pprev)
             block.hashPrevBlock = pprev->GetBlockHash();
         block.hashMerkleRoot = hashMerkleRoot;
-        block.hashWholeBlock = hashWholeBlock;
         block.nTime          = nTime;
         block.nBits          = nBits;
         block.nHeight        = nHeight;
         block.nNonce         = nNonce;
-        block.MinerSignature = MinerSignature;
         return block;
     }
 
+    // The full header, reading the mining extensions from the block tree database
+    bool ReadBlockHeader(CBlockHeader& block) const;
+
     uint256 GetBlockHash() const
     {
         return *phashBlock;
@@ -2001,6 +2054,13 @@ public:
         return (pnext || this == pindexBest);
     }
 
+    // Set pskip; requires pprev and nHeight, and pskip of the predecessors
+    void BuildSkip();
+
+    // Efficiently find the predecessor of this block at the given height, NULL if there is none
+    CBlockIndex* GetAncestor(int height);
+    const CBlockIndex* GetAncestor(int height) const;
+
     bool CheckIndex() const
     {
         /** Scrypt is used for block proof-of-work, but for purposes of performance the index internally uses sha256.
@@ -2045,10 +2105,9 @@ public:
 
     std::string ToString() const
     {
-        return strprintf("CBlockIndex(pprev=%p, pnext=%p, nHeight=%d, merkle=%s, whole=%s, hashBlock=%s)",
+        return strprintf("CBlockIndex(pprev=%p, pnext=%p, nHeight=%d, merkle=%s, hashBlock=%s)",
             pprev, pnext, nHeight,
             hashMerkleRoot.ToString().c_str(),
-            hashWholeBlock.ToString().c_str(),
             GetBlockHash().ToString().c_str());
     }
 
@@ -2078,13 +2137,19 @@ class CDiskBlockIndex : public CBlockIndex
 {
 public:
     uint256 hashPrev;
+    uint256 hashWholeBlock;
+    CMinerSignature MinerSignature;
 
     CDiskBlockIndex() {
         hashPrev = 0;
+        hashWholeBlock = 0;
     }
 
-    explicit CDiskBlockIndex(CBlockIndex* pindex) : CBlockIndex(*pindex) {
+    // The mining extensions are not in pindex; take them from the block header
+    CDiskBlockIndex(CBlockIndex* pindex, const CBlockHeader& block) : CBlockIndex(*pindex) {
         hashPrev = (pprev ? pprev->GetBlockHash() : 0);
+        hashWholeBlock = block.hashWholeBlock;
+        MinerSignature = block.MinerSignature;
     }
 
     IMPLEMENT_SERIALIZE
@@ -2116,11 +2181,18 @@ public:
         }
     )
 
-    uint256 GetBlockHash() const
+    CBlockHeader GetBlockHeader() const
     {
-        CBlockHeader block = GetBlockHeader();
+        CBlockHeader block = GetPartialHeader();
         block.hashPrevBlock = hashPrev;
-        return block.GetHash();
+        block.hashWholeBlock = hashWholeBlock;
+        block.MinerSignature = MinerSignature;
+        return block;
+    }
+
+    uint256 GetBlockHash() const
+    {
+        return GetBlockHeader().GetHash();
     }
 
 
@@ -2255,8 +2327,7 @@ public:
             vHave.push_back(pindex->GetBlockHash());
 
             // Exponentially larger steps back
-            for (int i = 0; pindex && i < nStep; i++)
-                pindex = pindex->pprev;
+            pindex = pindex->GetAncestor(pindex->nHeight - nStep);
             if (vHave.size() > 10)
                 nStep *= 2;
         }
@@ -2485,6 +2556,9 @@ extern CBlockTreeDB *pblocktree;
 /** Global variable that points to the address database (protected by cs_main) */
 extern CAddressDB *paddressmap;
 
+/** Background writer for the address index; NULL if blocks are indexed synchronously */
+extern CAddressIndexQueue *paddressqueue;
+
 struct CBlockTemplate
 {
     CBlock block;
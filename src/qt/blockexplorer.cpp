@@ -1,6 +1,9 @@
+#include <QCache>
 #include <QDateTime>
 #include <QKeyEvent>
 #include <QMessageBox>
+#include <QMutex>
+#include <QThread>
 #include <set>
 #include "blockexplorer.h"
 #include "ui_blockexplorer.h"
@@ -23,14 +26,115 @@ static std::string makeHRef(const std::string& Str)
     return "<a href=\"" + Str + "\">" + Str + "</a>";
 }
 
+static std::string makeHRef(const std::string& Target, const std::string& Str)
+{
+    return "<a href=\"" + Target + "\">" + Str + "</a>";
+}
+
+inline uint qHash(const uint256& hash)
+{
+    return (uint)hash.Get64();
+}
+
+// transactions per page of an address
+static const int ADDRESS_PAGE_SIZE = 100;
+
+/** Recently shown transactions, shared by all pages. Most lookups are of outputs
+ *  spent by the inputs of a page, which would otherwise read the previous
+ *  transaction from disk for every input.
+ */
+class ExplorerTxCache
+{
+public:
+    struct Entry
+    {
+        CTransaction tx;
+        uint256 hashBlock;
+        int64 nBlockTime; // 0 if not known
+    };
+
+    ExplorerTxCache() : cache(2000) {}
+
+    bool Get(const uint256& hash, Entry& entry)
+    {
+        QMutexLocker lock(&mutex);
+        Entry* pentry = cache.object(hash);
+        if (!pentry)
+            return false;
+        entry = *pentry;
+        return true;
+    }
+
+    void Insert(const uint256& hash, const Entry& entry)
+    {
+        QMutexLocker lock(&mutex);
+        cache.insert(hash, new Entry(entry));
+    }
+
+private:
+    QMutex mutex;
+    QCache<uint256, Entry> cache;
+};
+
+static ExplorerTxCache txCache;
+
+static bool getTransaction(const uint256& hash, CTransaction& tx, uint256& hashBlock)
+{
+    ExplorerTxCache::Entry entry;
+    if (!txCache.Get(hash, entry))
+    {
+        LOCK(cs_main);
+        entry.nBlockTime = 0;
+        if (!GetTransaction(hash, entry.tx, entry.hashBlock, true))
+            return false;
+        txCache.Insert(hash, entry);
+    }
+    tx = entry.tx;
+    hashBlock = entry.hashBlock;
+    return true;
+}
+
+// Read a transaction listed in the address index
+static bool readTransaction(const uint256& hash, const CDiskTxPos& pos, CTransaction& tx, int64& nBlockTime)
+{
+    ExplorerTxCache::Entry entry;
+    if (!txCache.Get(hash, entry) || entry.nBlockTime == 0)
+    {
+        CBlockHeader header;
+        if (!ReadTransaction(pos, entry.tx, header))
+            return false;
+        entry.hashBlock = header.GetHash();
+        entry.nBlockTime = header.nTime;
+        txCache.Insert(hash, entry);
+    }
+    tx = entry.tx;
+    nBlockTime = entry.nBlockTime;
+    return true;
+}
+
+// The output spent by an input; nValue is -1 if it is not known
+static CTxOut getPrevOutCached(const CTxIn& In)
+{
+    CTransaction tx;
+    uint256 hashBlock;
+    if (getTransaction(In.prevout.hash, tx, hashBlock) && In.prevout.n < tx.vout.size())
+        return tx.vout[In.prevout.n];
+    return CTxOut();
+}
+
 static int64_t getTxIn(const CTransaction& tx)
 {
     if (tx.IsCoinBase())
         return 0;
 
+    // a single lookup with -txfeeindex, instead of reading every previous transaction
+    CTxFeeInfo info;
+    if (fTxFeeIndex && pblocktree->ReadTxFeeInfo(tx.GetHash(), info))
+        return info.nValueIn;
+
     int64_t Sum = 0;
     for (unsigned int i = 0; i < tx.vin.size(); i++)
-        Sum += getPrevOut(tx.vin[i]).nValue;
+        Sum += getPrevOutCached(tx.vin[i]).nValue;
     return Sum;
 }
 
@@ -94,7 +198,9 @@ static std::string makeHTMLTable(const std::string* pCells, int nRows, int nColu
     return Table;
 }
 
-static std::string TxToRow(const CTransaction& tx, const CScript& Highlight = CScript(), const std::string& Prepend = std::string(), int64_t* pSum = NULL)
+// With Highlight set, the row shows the change of its balance and, if pBalance is given,
+// the balance after the transaction; *pBalance is then set to the balance before it
+static std::string TxToRow(const CTransaction& tx, const CScript& Highlight = CScript(), const std::string& Prepend = std::string(), int64_t* pBalance = NULL)
 {
     std::string InAmounts, InAddresses, OutAmounts, OutAddresses;
     int64_t Delta = 0;
@@ -107,7 +213,7 @@ static std::string TxToRow(const CTransaction& tx, const CScript& Highlight = CS
         }
         else
         {
-            CTxOut PrevOut = getPrevOut(tx.vin[j]);
+            CTxOut PrevOut = getPrevOutCached(tx.vin[j]);
             InAmounts += ValueToString(PrevOut.nValue);
             InAddresses += ScriptToString(PrevOut.scriptPubKey, false, PrevOut.scriptPubKey == Highlight).c_str();
             if (PrevOut.scriptPubKey == Highlight)
@@ -150,8 +256,13 @@ static std::string TxToRow(const CTransaction& tx, const CScript& Highlight = CS
     if (!Highlight.empty())
     {
         List[n++] = std::string("<font color=\"") + ((Delta > 0)? "green" : "red") + "\">" + ValueToString(Delta, true) + "</font>";
-        *pSum += Delta;
-        List[n++] = ValueToString(*pSum);
+        if (pBalance)
+        {
+            List[n++] = ValueToString(*pBalance);
+            *pBalance -= Delta;
+        }
+        else
+            List[n++] = "-";
         return makeHTMLTableRow(List, n);
     }
     return makeHTMLTableRow(List + 1, n - 1);
@@ -260,7 +371,7 @@ std::string TxToString(uint256 BlockHash, const CTransaction& tx)
     else for (unsigned int i = 0; i < tx.vin.size(); i++)
     {
         COutPoint Out = tx.vin[i].prevout;
-        CTxOut PrevOut = getPrevOut(tx.vin[i]);
+        CTxOut PrevOut = getPrevOutCached(tx.vin[i]);
         if (PrevOut.nValue < 0)
             Input = -MAX_MONEY;
         else
@@ -308,12 +419,15 @@ std::string TxToString(uint256 BlockHash, const CTransaction& tx)
         _("Hash"),      "<pre>" + Hash + "</pre>",
     };
 
-    std::map<uint256, CBlockIndex*>::iterator iter = mapBlockIndex.find(BlockHash);
-    if (iter != mapBlockIndex.end())
     {
-        CBlockIndex* pIndex = iter->second;
-        Labels[0*2 + 1] = makeHRef(itostr(pIndex->nHeight));
-        Labels[5*2 + 1] = TimeToString(pIndex->nTime);
+        LOCK(cs_main);
+        std::map<uint256, CBlockIndex*>::iterator iter = mapBlockIndex.find(BlockHash);
+        if (iter != mapBlockIndex.end())
+        {
+            CBlockIndex* pIndex = iter->second;
+            Labels[0*2 + 1] = makeHRef(itostr(pIndex->nHeight));
+            Labels[5*2 + 1] = TimeToString(pIndex->nTime);
+        }
     }
 
     std::string Content;
@@ -329,7 +443,13 @@ std::string TxToString(uint256 BlockHash, const CTransaction& tx)
     return Content;
 }
 
-std::string AddressToString(const CBitcoinAddress& Address)
+// Balance after the newest transaction of an address page, remembered when the page
+// before it was shown: (address, page) -> (number of transactions, balance).
+// Only used by the executor thread.
+static std::map<std::pair<std::string, int>, std::pair<unsigned int, int64> > mapPageBalance;
+
+// Page nPage (from 1) of the transactions of an address, newest first
+std::string AddressToString(const CBitcoinAddress& Address, int nPage)
 {
     std::string TxLabels[] =
     {
@@ -344,47 +464,169 @@ std::string AddressToString(const CBitcoinAddress& Address)
     };
     std::string TxContent = table + makeHTMLTableRow(TxLabels, sizeof(TxLabels)/sizeof(std::string));
 
-    std::set<COutPoint> PrevOuts;
-
     CScript AddressScript;
     AddressScript.SetDestination(Address.Get());
-
-    int64_t Sum = 0;
+    CScriptID AddressID = AddressScript.GetID();
 
     if (!fAddrIndex)
         return ""; // it will take too long to find transactions by address
-    else
+
+    // the index only holds main chain transactions
+    std::vector<std::pair<CAddressIndexKey, uint256> > Txs;
+    paddressmap->GetTxids(Txs, AddressID, 0, std::numeric_limits<unsigned int>::max());
+    CAddressBalance Balance;
+    paddressmap->ReadBalance(AddressID, Balance);
+
+    int nPages = std::max(1, ((int)Txs.size() + ADDRESS_PAGE_SIZE - 1) / ADDRESS_PAGE_SIZE);
+    if (nPage < 1 || nPage > nPages)
+        return "";
+
+    std::pair<std::string, int> PageKey(Address.ToString(), nPage);
+    int64 Sum = Balance.nBalance;
+    bool fSum = nPage == 1;
+    if (!fSum && mapPageBalance.count(PageKey) && mapPageBalance[PageKey].first == Txs.size())
     {
-        std::vector<CDiskTxPos> Txs;
-        paddressmap->GetTxs(Txs, AddressScript.GetID());
-        BOOST_FOREACH (const CDiskTxPos& pos, Txs)
+        Sum = mapPageBalance[PageKey].second;
+        fSum = true;
+    }
+
+    int nFirst = (int)Txs.size() - 1 - (nPage - 1) * ADDRESS_PAGE_SIZE;
+    int nLast = std::max(0, nFirst - ADDRESS_PAGE_SIZE + 1);
+    for (int i = nFirst; i >= nLast; i--)
+    {
+        CTransaction tx;
+        int64 nBlockTime;
+        if (!readTransaction(Txs[i].second, Txs[i].first.txpos, tx, nBlockTime))
         {
-            CTransaction tx;
-            CBlockHeader block;
-            ReadTransaction(pos, tx, block);
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
-            if (mi == mapBlockIndex.end())
-                continue;
-            CBlockIndex* pindex = (*mi).second;
-            if (!pindex || !pindex->IsInMainChain())
-                continue;
-            std::string Prepend = "<a href=\"" + itostr(block.nHeight) + "\">" + TimeToString(block.nTime) + "</a>";
-            TxContent += TxToRow(tx, AddressScript, Prepend, &Sum);
+            fSum = false;
+            continue;
         }
+        std::string Prepend = "<a href=\"" + itostr(Txs[i].first.nHeight) + "\">" + TimeToString(nBlockTime) + "</a>";
+        TxContent += TxToRow(tx, AddressScript, Prepend, fSum ? &Sum : NULL);
     }
     TxContent += "</table>";
 
+    if (fSum && nPage < nPages)
+        mapPageBalance[std::make_pair(Address.ToString(), nPage + 1)] = std::make_pair((unsigned int)Txs.size(), Sum);
+
+    std::string Labels[] =
+    {
+        _("Balance"),      ValueToString(Balance.nBalance),
+        _("Received"),     ValueToString(Balance.nReceived),
+        _("Transactions"), itostr(Balance.nTxs),
+    };
+
+    std::string Pages;
+    if (nPages > 1)
+    {
+        std::string Target = Address.ToString() + "/";
+        if (nPage > 1)
+            Pages += makeHRef(Target + itostr(nPage - 1), "◄&nbsp;" + _("Newer")) + "&nbsp;";
+        Pages += strprintf(_("Page %d of %d").c_str(), nPage, nPages);
+        if (nPage < nPages)
+            Pages += "&nbsp;" + makeHRef(Target + itostr(nPage + 1), _("Older") + "&nbsp;►");
+        Pages = "<p>" + Pages + "</p>";
+    }
+
     std::string Content;
     Content += "<h1>" + _("Transactions to/from") + "&nbsp;<span class=\"mono\">" + Address.ToString() + "</span></h1>";
+    Content += makeHTMLTable(Labels, sizeof(Labels)/(2*sizeof(std::string)), 2);
+    Content += "</br>";
+    Content += Pages;
     Content += TxContent;
+    Content += Pages;
     return Content;
 }
 
+// Render the page for a block height or hash, a transaction id, or an address
+// optionally followed by "/page"; returns an empty string if there is none
+static std::string QueryToString(const QString& query)
+{
+    bool IsOk;
+    int AsInt = query.toInt(&IsOk);
+    if (IsOk && AsInt >= 0 && AsInt <= nBestHeight)
+    {
+        CBlockIndex* pIndex;
+        {
+            LOCK(cs_main);
+            pIndex = FindBlockByHeight(AsInt);
+        }
+        if (pIndex)
+            return BlockToString(pIndex);
+    }
+
+    uint256 hash(query.toUtf8().constData());
+
+    {
+        CBlockIndex* pIndex = NULL;
+        {
+            LOCK(cs_main);
+            std::map<uint256, CBlockIndex*>::iterator iter = mapBlockIndex.find(hash);
+            if (iter != mapBlockIndex.end())
+                pIndex = iter->second;
+        }
+        if (pIndex)
+            return BlockToString(pIndex);
+    }
+
+    CTransaction tx;
+    uint256 hashBlock = 0;
+    if (getTransaction(hash, tx, hashBlock))
+        return TxToString(hashBlock, tx);
+
+    QString AddressPart = query.section('/', 0, 0);
+    int nPage = 1;
+    if (query.contains('/'))
+    {
+        nPage = query.section('/', 1).toInt(&IsOk);
+        if (!IsOk)
+            return "";
+    }
+    CBitcoinAddress Address;
+    Address.SetString(AddressPart.toUtf8().constData());
+    if (Address.IsValid())
+        return AddressToString(Address, nPage);
+
+    return "";
+}
+
+/* Renders explorer pages in a separate thread, so that large blocks and addresses
+   don't block the GUI.
+*/
+class ExplorerExecutor : public QObject
+{
+    Q_OBJECT
+
+public slots:
+    void request(int id, const QString& query);
+
+signals:
+    void reply(int id, const QString& content);
+};
+
+#include "blockexplorer.moc"
+
+void ExplorerExecutor::request(int id, const QString& query)
+{
+    std::string Content;
+    try
+    {
+        Content = QueryToString(query);
+    }
+    catch (std::exception& e)
+    {
+        PrintExceptionContinue(&e, "ExplorerExecutor::request()");
+    }
+    emit reply(id, QString::fromUtf8(Content.c_str()));
+}
+
 BlockExplorer::BlockExplorer(QWidget *parent) :
     QMainWindow(parent),
     ui(new Ui::BlockExplorer),
     m_NeverShown(true),
-    m_HistoryIndex(0)
+    m_HistoryIndex(0),
+    m_RequestId(0),
+    m_PushHistory(false)
 {
     ui->setupUi(this);
 
@@ -392,13 +634,32 @@ BlockExplorer::BlockExplorer(QWidget *parent) :
     connect(ui->content, SIGNAL(linkActivated(const QString&)), this, SLOT(goTo(const QString&)));
     connect(ui->back, SIGNAL(released()), this, SLOT(back()));
     connect(ui->forward, SIGNAL(released()), this, SLOT(forward()));
+
+    startExecutor();
 }
 
 BlockExplorer::~BlockExplorer()
 {
+    emit stopExecutor();
     delete ui;
 }
 
+void BlockExplorer::startExecutor()
+{
+    QThread *thread = new QThread;
+    ExplorerExecutor *executor = new ExplorerExecutor();
+    executor->moveToThread(thread);
+
+    connect(executor, SIGNAL(reply(int,QString)), this, SLOT(onReply(int,QString)));
+    connect(this, SIGNAL(pageRequest(int,QString)), executor, SLOT(request(int,QString)));
+
+    connect(this, SIGNAL(stopExecutor()), executor, SLOT(deleteLater()));
+    connect(this, SIGNAL(stopExecutor()), thread, SLOT(quit()));
+    connect(thread, SIGNAL(finished()), thread, SLOT(deleteLater()));
+
+    thread->start();
+}
+
 void BlockExplorer::keyPressEvent(QKeyEvent *event)
 {
     switch ((Qt::Key)event->key())
@@ -419,8 +680,8 @@ void BlockExplorer::showEvent(QShowEvent*)
     {
         m_NeverShown = false;
 
-        setBlock(pindexBest);
-        QString text = QString("%1").arg(pindexBest->nHeight);
+        QString text = QString("%1").arg(nBestHeight);
+        request(text, false);
         ui->searchBox->setText(text);
         m_History.push_back(text);
         updateNavButtons();
@@ -433,78 +694,50 @@ void BlockExplorer::showEvent(QShowEvent*)
     }
 }
 
-bool BlockExplorer::switchTo(const QString& query)
+void BlockExplorer::request(const QString& query, bool pushHistory)
 {
-    bool IsOk;
-    int AsInt = query.toInt(&IsOk);
-    if (IsOk && AsInt >= 0 && AsInt <= nBestHeight)
-    {
-        CBlockIndex* pIndex = FindBlockByHeight(AsInt);
-        if (pIndex)
-        {
-            setBlock(pIndex);
-            return true;
-        }
-    }
-
-    uint256 hash(query.toUtf8().constData());
-
-    std::map<uint256, CBlockIndex*>::iterator iter = mapBlockIndex.find(hash);
-    if (iter != mapBlockIndex.end())
-    {
-        setBlock(iter->second);
-        return true;
-    }
-
-    CTransaction tx;
-    uint256 hashBlock = 0;
-    if (GetTransaction(hash, tx, hashBlock, true))
-    {
-        setContent(TxToString(hashBlock, tx));
-        return true;
-    }
-
-    CBitcoinAddress Address;
-    Address.SetString(query.toUtf8().constData());
-    if (Address.IsValid())
-    {
-        std::string Content = AddressToString(Address);
-        if (Content.empty())
-            return false;
-        setContent(Content);
-        return true;
-    }
-
-    return false;
+    // only the reply to the latest request is shown
+    m_RequestId++;
+    m_PendingQuery = query;
+    m_PushHistory = pushHistory;
+    setCursor(Qt::BusyCursor);
+    emit pageRequest(m_RequestId, query);
 }
 
-void BlockExplorer::goTo(const QString& query)
+void BlockExplorer::onReply(int id, const QString& content)
 {
-    if (switchTo(query))
+    if (id != m_RequestId)
+        return;
+    unsetCursor();
+    if (content.isEmpty())
+        return;
+
+    setContent(content);
+    if (m_PushHistory)
     {
-        ui->searchBox->setText(query);
+        ui->searchBox->setText(m_PendingQuery);
         while (m_History.size() > m_HistoryIndex + 1)
             m_History.pop_back();
-        m_History.push_back(query);
+        m_History.push_back(m_PendingQuery);
         m_HistoryIndex = m_History.size() - 1;
         updateNavButtons();
     }
 }
 
-void BlockExplorer::onSearch()
+void BlockExplorer::goTo(const QString& query)
 {
-    goTo(ui->searchBox->text());
+    request(query, true);
 }
 
-void BlockExplorer::setBlock(CBlockIndex* pBlock)
+void BlockExplorer::onSearch()
 {
-    setContent(BlockToString(pBlock));
+    goTo(ui->searchBox->text());
 }
 
-void BlockExplorer::setContent(const std::string& Content)
+void BlockExplorer::setContent(const QString& Content)
 {
     QString CSS = "a, .mono { font-family: \"monospace\" }\n h1, h2 { white-space:nowrap; }\n a { text-decoration: none; }";
-    QString FullContent = "<html><head><style type=\"text/css\">" + CSS + "</style></head>" + "<body>" + Content.c_str() + "</body></html>";
+    QString FullContent = "<html><head><style type=\"text/css\">" + CSS + "</style></head>" + "<body>" + Content + "</body></html>";
     ui->content->setText(FullContent);
 }
 
@@ -515,7 +748,7 @@ void BlockExplorer::back()
     {
          m_HistoryIndex = NewIndex;
          ui->searchBox->setText(m_History[NewIndex]);
-         switchTo(m_History[NewIndex]);
+         request(m_History[NewIndex], false);
          updateNavButtons();
     }
 }
@@ -527,7 +760,7 @@ void BlockExplorer::forward()
     {
          m_HistoryIndex = NewIndex;
          ui->searchBox->setText(m_History[NewIndex]);
-         switchTo(m_History[NewIndex]);
+         request(m_History[NewIndex], false);
          updateNavButtons();
     }
 }
@@ -31,16 +31,25 @@ private slots:
     void goTo(const QString& query);
     void back();
     void forward();
+    void onReply(int id, const QString& content);
+
+signals:
+    // For the page executor thread
+    void stopExecutor();
+    void pageRequest(int id, const QString& query);
 
 private:
     Ui::BlockExplorer *ui;
     bool m_NeverShown;
     int m_HistoryIndex;
     QStringList m_History;
+    int m_RequestId;
+    QString m_PendingQuery;
+    bool m_PushHistory;
 
-    void setBlock(CBlockIndex* pBlock);
-    bool switchTo(const QString& query);
-    void setContent(const std::string &content);
+    void startExecutor();
+    void request(const QString& query, bool pushHistory);
+    void setContent(const QString& content);
     void updateNavButtons();
 };
 
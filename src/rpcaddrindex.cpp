@@ -0,0 +1,146 @@
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "base58.h"
+#include "bitcoinrpc.h"
+#include "indexbuilder.h"
+#include "main.h"
+#include "txdb.h"
+
+using namespace std;
+using namespace json_spirit;
+
+// Queries of the address index (-addrindex). It holds main chain blocks only, and may
+// lag the tip by the blocks waiting in its write queue.
+
+static void EnsureAddressIndex()
+{
+    if (!fAddrIndex || paddressmap == NULL)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled (start with -addrindex)");
+    if (addrIndexBuilder.IsBuilding())
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index is still being built, see getindexinfo");
+}
+
+static CScriptID ParseAddressScriptID(const Value& value)
+{
+    CBitcoinAddress address(value.get_str());
+    if (!address.IsValid())
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid SpreadCoin address");
+    CScript script;
+    script.SetDestination(address.Get());
+    return script.GetID();
+}
+
+static unsigned int ParseHeight(const Value& value)
+{
+    int nHeight = value.get_int();
+    if (nHeight < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Block height out of range");
+    return nHeight;
+}
+
+Value getaddresstxids(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "getaddresstxids <address> [startheight=0] [endheight]\n"
+            "Returns the ids of the main chain transactions paying to or spending from <address>\n"
+            "in blocks <startheight> to <endheight>, ordered by height.\n"
+            "Query long histories in height ranges.");
+
+    EnsureAddressIndex();
+    CScriptID scriptID = ParseAddressScriptID(params[0]);
+    unsigned int nStartHeight = 0, nEndHeight = std::numeric_limits<unsigned int>::max();
+    if (params.size() > 1)
+        nStartHeight = ParseHeight(params[1]);
+    if (params.size() > 2)
+        nEndHeight = ParseHeight(params[2]);
+    if (nEndHeight < nStartHeight)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "endheight is below startheight");
+
+    vector<pair<CAddressIndexKey, uint256> > vTxids;
+    if (!paddressmap->GetTxids(vTxids, scriptID, nStartHeight, nEndHeight))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to read address index");
+
+    Array ret;
+    ret.reserve(vTxids.size());
+    for (unsigned int i = 0; i < vTxids.size(); i++)
+        ret.push_back(vTxids[i].second.GetHex());
+    return ret;
+}
+
+Value getaddressbalance(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressbalance <address>\n"
+            "Returns the balance of <address>, the total it received and its number of transactions.");
+
+    EnsureAddressIndex();
+    CScriptID scriptID = ParseAddressScriptID(params[0]);
+
+    CAddressBalance balance;
+    paddressmap->ReadBalance(scriptID, balance);
+
+    Object ret;
+    ret.push_back(Pair("balance", ValueFromAmount(balance.nBalance)));
+    ret.push_back(Pair("received", ValueFromAmount(balance.nReceived)));
+    ret.push_back(Pair("txcount", (int)balance.nTxs));
+    return ret;
+}
+
+Value getaddressutxos(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressutxos <address>\n"
+            "Returns the unspent main chain outputs paying to <address>.");
+
+    EnsureAddressIndex();
+    CScriptID scriptID = ParseAddressScriptID(params[0]);
+
+    vector<pair<COutPoint, CAddressUnspentValue> > vUnspent;
+    if (!paddressmap->GetUnspent(vUnspent, scriptID))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to read address index");
+
+    Array ret;
+    ret.reserve(vUnspent.size());
+    for (unsigned int i = 0; i < vUnspent.size(); i++) {
+        const COutPoint& outpoint = vUnspent[i].first;
+        const CAddressUnspentValue& unspent = vUnspent[i].second;
+        const CScript& script = unspent.txout.scriptPubKey;
+
+        Object entry;
+        entry.push_back(Pair("txid", outpoint.hash.GetHex()));
+        entry.push_back(Pair("vout", (int)outpoint.n));
+        entry.push_back(Pair("amount", ValueFromAmount(unspent.txout.nValue)));
+        entry.push_back(Pair("scriptPubKey", HexStr(script.begin(), script.end())));
+        entry.push_back(Pair("height", (int)unspent.nHeight));
+        ret.push_back(entry);
+    }
+    return ret;
+}
+
+Value getspentinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 2)
+        throw runtime_error(
+            "getspentinfo <txid> <n>\n"
+            "Returns the main chain input spending output <n> of transaction <txid>.");
+
+    EnsureAddressIndex();
+    uint256 hash(params[0].get_str());
+    int n = params[1].get_int();
+    if (n < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid output index");
+
+    CAddressSpentValue spent;
+    if (!paddressmap->ReadSpent(COutPoint(hash, n), spent))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Output not spent in the main chain");
+
+    Object ret;
+    ret.push_back(Pair("txid", spent.txid.GetHex()));
+    ret.push_back(Pair("index", (int)spent.nIn));
+    ret.push_back(Pair("height", (int)spent.nHeight));
+    return ret;
+}
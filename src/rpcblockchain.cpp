@@ -5,6 +5,7 @@
 
 #include "main.h"
 #include "bitcoinrpc.h"
+#include "indexbuilder.h"
 
 using namespace json_spirit;
 using namespace std;
@@ -171,6 +172,8 @@ Value getblock(const Array& params, bool fHelp)
 
     CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
+    if (!(pblockindex->nStatus & BLOCK_HAVE_DATA))
+        throw JSONRPCError(RPC_MISC_ERROR, "Block not available (pruned data)");
     block.ReadFromDisk(pblockindex);
 
     if (!fVerbose)
@@ -206,6 +209,56 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+Value getblockfilecacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getblockfilecacheinfo\n"
+            "Returns statistics about the cache of open block and undo files.");
+
+    CBlockFileCacheStats stats;
+    blockFileCache.GetStats(stats);
+
+    Object ret;
+    ret.push_back(Pair("files", (int)stats.nFiles));
+    ret.push_back(Pair("maxfiles", (int)stats.nMaxFiles));
+    ret.push_back(Pair("mmap", stats.fMap));
+    ret.push_back(Pair("hits", (boost::int64_t)stats.nHits));
+    ret.push_back(Pair("misses", (boost::int64_t)stats.nMisses));
+    return ret;
+}
+
+static Object IndexInfoToJSON(const CIndexBuilder& builder, bool fEnabled)
+{
+    CIndexBuildProgress progress;
+    builder.GetProgress(progress);
+
+    Object ret;
+    ret.push_back(Pair("name", progress.strName));
+    ret.push_back(Pair("enabled", fEnabled));
+    ret.push_back(Pair("building", progress.fBuilding));
+    if (progress.fBuilding) {
+        ret.push_back(Pair("height", progress.nHeight));
+        ret.push_back(Pair("tipheight", progress.nTipHeight));
+    }
+    return ret;
+}
+
+Value getindexinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getindexinfo\n"
+            "Returns the state of the optional -txindex, -txfeeindex and -addrindex indexes.\n"
+            "While an index is being built, height is the last block added to it.");
+
+    Array ret;
+    ret.push_back(IndexInfoToJSON(txIndexBuilder, fTxIndex));
+    ret.push_back(IndexInfoToJSON(txFeeIndexBuilder, fTxFeeIndex));
+    ret.push_back(IndexInfoToJSON(addrIndexBuilder, fAddrIndex));
+    return ret;
+}
+
 Value gettxout(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
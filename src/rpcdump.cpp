@@ -53,6 +53,8 @@ Value importprivkey(const Array& params, bool fHelp)
     bool fGood = vchSecret.SetString(strSecret);
 
     if (!fGood) throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid private key");
+    if (fRescan && fHavePruned)
+        throw JSONRPCError(RPC_WALLET_ERROR, "Rescan is disabled in pruned mode");
 
     CKey key = vchSecret.GetKey();
     CPubKey pubkey = key.GetPubKey();
@@ -75,6 +77,112 @@ Value importprivkey(const Array& params, bool fHelp)
     return Value::null;
 }
 
+// keys are looked for in blocks up to this long before their birth time, as block times may be off
+static const int64 IMPORT_TIMESTAMP_WINDOW = 2 * 60 * 60;
+
+Value importmulti(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "importmulti <'[{\"key\":\"<spreadcoinprivkey>\",\"label\":\"<label>\",\"timestamp\":<time>},...]'> [rescan=true]\n"
+            "Adds private keys (as returned by dumpprivkey) or P2SH redeem scripts, with an entry of\n"
+            "{\"redeemscript\":\"<hex>\"} instead of \"key\", to your wallet in a single database transaction.\n"
+            "\"timestamp\" is the time the key was created, or \"now\"; it defaults to 0.\n"
+            "A single rescan starts at the earliest timestamp of the keys imported.\n"
+            "Watch-only scripts are not supported by this wallet.");
+
+    const Array& imports = params[0].get_array();
+
+    // Whether to perform rescan after import
+    bool fRescan = true;
+    if (params.size() > 1)
+        fRescan = params[1].get_bool();
+
+    // Check all entries before adding any of them
+    vector<CKey> vKeys;
+    vector<CScript> vScripts;
+    map<CTxDestination, string> mapLabels;
+    int64 nTimeFirst = std::numeric_limits<int64>::max();
+    BOOST_FOREACH(const Value& value, imports)
+    {
+        const Object& entry = value.get_obj();
+        const Value& key = find_value(entry, "key");
+        const Value& redeemscript = find_value(entry, "redeemscript");
+        if (find_value(entry, "watchonly").type() != null_type)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Watch-only scripts are not supported");
+
+        CTxDestination dest;
+        if (key.type() == str_type && redeemscript.type() == null_type)
+        {
+            CBitcoinSecret vchSecret;
+            if (!vchSecret.SetString(key.get_str()))
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid private key");
+            vKeys.push_back(vchSecret.GetKey());
+            dest = vKeys.back().GetPubKey().GetID();
+        }
+        else if (redeemscript.type() == str_type && key.type() == null_type)
+        {
+            if (!IsHex(redeemscript.get_str()))
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid redeem script");
+            vector<unsigned char> vchScript = ParseHex(redeemscript.get_str());
+            vScripts.push_back(CScript(vchScript.begin(), vchScript.end()));
+            dest = vScripts.back().GetID();
+        }
+        else
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Each entry needs either \"key\" or \"redeemscript\"");
+
+        const Value& label = find_value(entry, "label");
+        if (label.type() != null_type)
+            mapLabels[dest] = label.get_str();
+        else if (!pwalletMain->mapAddressBook.count(dest))
+            mapLabels[dest] = "";
+
+        int64 nTime = 0;
+        const Value& timestamp = find_value(entry, "timestamp");
+        if (timestamp.type() == str_type && timestamp.get_str() == "now")
+            nTime = GetTime();
+        else if (timestamp.type() != null_type)
+            nTime = timestamp.get_int64();
+        nTimeFirst = std::min(nTimeFirst, nTime);
+    }
+    if (!vKeys.empty())
+        EnsureWalletIsUnlocked();
+
+    Object result;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+
+        // Blocks older than the earliest key can't involve it; the rescan starts after them
+        CBlockIndex* pindexRescan = NULL;
+        if (fRescan)
+        {
+            pindexRescan = pindexGenesisBlock;
+            while (pindexRescan && pindexRescan->GetBlockTime() < nTimeFirst - IMPORT_TIMESTAMP_WINDOW)
+                pindexRescan = pindexRescan->pnext;
+            if (fHavePruned)
+                for (CBlockIndex* pindex = pindexRescan; pindex; pindex = pindex->pnext)
+                    if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+                        throw JSONRPCError(RPC_WALLET_ERROR, "Rescan needs blocks that have been pruned");
+        }
+
+        pwalletMain->MarkDirty();
+        if (!pwalletMain->ImportKeys(vKeys, vScripts, mapLabels))
+            throw JSONRPCError(RPC_WALLET_ERROR, "Error adding keys to wallet");
+        result.push_back(Pair("keys", (int)vKeys.size()));
+        result.push_back(Pair("scripts", (int)vScripts.size()));
+
+        if (pindexRescan)
+        {
+            int nFound = pwalletMain->ScanForWalletTransactions(pindexRescan, true);
+            pwalletMain->ReacceptWalletTransactions();
+            result.push_back(Pair("rescanfrom", pindexRescan->nHeight));
+            result.push_back(Pair("found", nFound));
+        }
+    }
+
+    return result;
+}
+
 Value dumpprivkey(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
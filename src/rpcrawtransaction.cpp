@@ -8,9 +8,11 @@
 #include "base58.h"
 #include "bitcoinrpc.h"
 #include "db.h"
+#include "indexbuilder.h"
 #include "init.h"
 #include "main.h"
 #include "net.h"
+#include "txdb.h"
 #include "wallet.h"
 
 using namespace std;
@@ -163,6 +165,38 @@ Value getrawtransaction(const Array& params, bool fHelp)
     Object result;
     result.push_back(Pair("hex", strHex));
     TxToJSON(tx, hashBlock, result);
+    CTxFeeInfo info;
+    if (fTxFeeIndex && hashBlock != 0 && pblocktree->ReadTxFeeInfo(hash, info)) {
+        result.push_back(Pair("valuein", ValueFromAmount(info.nValueIn)));
+        result.push_back(Pair("fee", ValueFromAmount(info.nFee)));
+    }
+    return result;
+}
+
+Value gettxfeeinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "gettxfeeinfo <txid>\n"
+            "Returns the input value, fee, size and block height of a transaction\n"
+            "in the block chain, as recorded by -txfeeindex.");
+
+    if (!fTxFeeIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Transaction fee index not enabled (start with -txfeeindex)");
+
+    uint256 hash = ParseHashV(params[0], "parameter 1");
+    CTxFeeInfo info;
+    if (!pblocktree->ReadTxFeeInfo(hash, info))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, txFeeIndexBuilder.IsBuilding() ?
+                           "Transaction not indexed yet, see getindexinfo" : "No information available about transaction");
+
+    Object result;
+    result.push_back(Pair("valuein", ValueFromAmount(info.nValueIn)));
+    result.push_back(Pair("fee", ValueFromAmount(info.nFee)));
+    result.push_back(Pair("size", (int)info.nSize));
+    result.push_back(Pair("height", (int)info.nHeight));
+    if (info.nSize > 0)
+        result.push_back(Pair("feeperkb", ValueFromAmount(info.nFee * 1000 / info.nSize)));
     return result;
 }
 
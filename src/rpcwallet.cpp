@@ -614,7 +614,7 @@ Value movecmd(const Array& params, bool fHelp)
     debit.nTime = nNow;
     debit.strOtherAccount = strTo;
     debit.strComment = strComment;
-    walletdb.WriteAccountingEntry(debit);
+    pwalletMain->AddAccountingEntry(debit, walletdb);
 
     // Credit
     CAccountingEntry credit;
@@ -624,7 +624,7 @@ Value movecmd(const Array& params, bool fHelp)
     credit.nTime = nNow;
     credit.strOtherAccount = strFrom;
     credit.strComment = strComment;
-    walletdb.WriteAccountingEntry(credit);
+    pwalletMain->AddAccountingEntry(credit, walletdb);
 
     if (!walletdb.TxnCommit())
         throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
@@ -1079,11 +1079,9 @@ Value listtransactions(const Array& params, bool fHelp)
 
     Array ret;
 
-    std::list<CAccountingEntry> acentries;
-    CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
-
     // iterate backwards until we have nCount items to return:
-    for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+    const CWallet::TxItems& txOrdered = pwalletMain->wtxOrdered;
+    for (CWallet::TxItems::const_reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
     {
         CWalletTx *const pwtx = (*it).second.first;
         if (pwtx != 0)
@@ -1151,9 +1149,7 @@ Value listaccounts(const Array& params, bool fHelp)
         }
     }
 
-    list<CAccountingEntry> acentries;
-    CWalletDB(pwalletMain->strWalletFile).ListAccountCreditDebit("*", acentries);
-    BOOST_FOREACH(const CAccountingEntry& entry, acentries)
+    BOOST_FOREACH(const CAccountingEntry& entry, pwalletMain->laccentries)
         mapAccountBalances[entry.strAccount] += entry.nCreditDebit;
 
     Object ret;
@@ -1189,16 +1185,36 @@ Value listsinceblock(const Array& params, bool fHelp)
             throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter");
     }
 
-    int depth = pindex ? (1 + nBestHeight - pindex->nHeight) : -1;
-
     Array transactions;
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+    if (pindex == NULL)
+    {
+        for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+            ListTransactions((*it).second, "*", 0, true, transactions);
+    }
+    else
     {
-        CWalletTx tx = (*it).second;
+        typedef multimap<uint256, CWalletTx*>::const_iterator TxByBlockIter;
+        const multimap<uint256, CWalletTx*>& mapTxByBlock = pwalletMain->mapTxByBlock;
+
+        // Transactions without confirmations: not in a block, or in one off the main chain
+        for (TxByBlockIter it = mapTxByBlock.begin(); it != mapTxByBlock.end(); it = mapTxByBlock.upper_bound((*it).first))
+        {
+            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find((*it).first);
+            if (mi != mapBlockIndex.end() && (*mi).second->IsInMainChain())
+                continue;
+            pair<TxByBlockIter, TxByBlockIter> range = mapTxByBlock.equal_range((*it).first);
+            for (TxByBlockIter itTx = range.first; itTx != range.second; ++itTx)
+                ListTransactions(*(*itTx).second, "*", 0, true, transactions);
+        }
 
-        if (depth == -1 || tx.GetDepthInMainChain() < depth)
-            ListTransactions(tx, "*", 0, true, transactions);
+        // Transactions in the main chain blocks after pindex, looked up block by block
+        for (CBlockIndex* pindexWalk = pindex->pnext; pindexWalk; pindexWalk = pindexWalk->pnext)
+        {
+            pair<TxByBlockIter, TxByBlockIter> range = mapTxByBlock.equal_range(pindexWalk->GetBlockHash());
+            for (TxByBlockIter itTx = range.first; itTx != range.second; ++itTx)
+                ListTransactions(*(*itTx).second, "*", 0, true, transactions);
+        }
     }
 
     uint256 lastblock;
@@ -1211,10 +1227,7 @@ Value listsinceblock(const Array& params, bool fHelp)
     {
         int target_height = pindexBest->nHeight + 1 - target_confirms;
 
-        CBlockIndex *block;
-        for (block = pindexBest;
-             block && block->nHeight > target_height;
-             block = block->pprev)  { }
+        CBlockIndex *block = pindexBest->GetAncestor(target_height);
 
         lastblock = block ? block->GetBlockHash() : 0;
     }
@@ -1608,3 +1621,43 @@ Value listlockunspent(const Array& params, bool fHelp)
     return ret;
 }
 
+
+Value consolidateoutputs(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 2)
+        throw runtime_error(
+            "consolidateoutputs [maxvalue=1] [maxinputs=500]\n"
+            "Spends up to <maxinputs> of the smallest confirmed outputs worth less than <maxvalue>\n"
+            "to a new address of this wallet, so that later transactions need fewer inputs.\n"
+            "Locked outputs are left alone."
+            + HelpRequiringPassphrase());
+
+    int64 nMaxInputValue = COIN;
+    if (params.size() > 0)
+        nMaxInputValue = AmountFromValue(params[0]);
+    unsigned int nMaxInputs = DEFAULT_CONSOLIDATION_INPUTS;
+    if (params.size() > 1)
+    {
+        if (params[1].get_int() < 2)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, maxinputs must be at least 2");
+        nMaxInputs = params[1].get_int();
+    }
+
+    EnsureWalletIsUnlocked();
+
+    CWalletTx wtx;
+    CReserveKey reservekey(pwalletMain);
+    int64 nFee = 0;
+    string strFailReason;
+    if (!pwalletMain->CreateConsolidation(nMaxInputValue, nMaxInputs, wtx, reservekey, nFee, strFailReason))
+        throw JSONRPCError(RPC_WALLET_ERROR, strFailReason);
+    if (!pwalletMain->CommitTransaction(wtx, reservekey))
+        throw JSONRPCError(RPC_WALLET_ERROR, "Transaction commit failed");
+
+    Object result;
+    result.push_back(Pair("txid", wtx.GetHash().GetHex()));
+    result.push_back(Pair("inputs", (int)wtx.vin.size()));
+    result.push_back(Pair("amount", ValueFromAmount(wtx.vout[0].nValue)));
+    result.push_back(Pair("fee", ValueFromAmount(nFee)));
+    return result;
+}
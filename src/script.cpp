@@ -1336,6 +1336,13 @@ bool IsMine(const CKeyStore &keystore, const CTxDestination &dest)
 
 bool IsMine(const CKeyStore &keystore, const CScript& scriptPubKey)
 {
+    // Pay-to-pubkey-hash and pay-to-script-hash outputs of the store are indexed by their
+    // bytes, so Solver is only needed for bare multisig and unusually encoded scripts
+    if (keystore.HaveScriptPubKey(scriptPubKey))
+        return true;
+    if (scriptPubKey.IsPayToPubKeyHash() || scriptPubKey.IsPayToScriptHash())
+        return false;
+
     vector<valtype> vSolutions;
     txnouttype whichType;
     if (!Solver(scriptPubKey, whichType, vSolutions))
@@ -1739,6 +1746,14 @@ bool CScript::IsPayToScriptHash() const
             this->at(22) == OP_EQUAL);
 }
 
+bool CScript::IsPayToPubKeyHash() const
+{
+    // The form SetDestination writes for a key ID: 20 [20 byte hash] OP_CHECKSIG
+    return (this->size() == 22 &&
+            this->at(0) == 0x14 &&
+            this->at(21) == OP_CHECKSIG);
+}
+
 class CScriptVisitor : public boost::static_visitor<bool>
 {
 private:
@@ -530,6 +530,7 @@ public:
     unsigned int GetSigOpCount(const CScript& scriptSig) const;
 
     bool IsPayToScriptHash() const;
+    bool IsPayToPubKeyHash() const;
 
     // Called by CTransaction::IsStandard
     bool IsPushOnly() const
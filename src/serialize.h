@@ -1152,6 +1152,118 @@ public:
     }
 };
 
+/** In stream reading from a memory range it does not own (e.g. a mapped file).
+ *  Offers the same positioning interface as CBufferedFile, without copying.
+ */
+class CBufferReader
+{
+private:
+    const char* pbegin;
+    const char* pend;
+    const char* pread;
+    const char* plimit;
+
+    short state;
+    short exceptmask;
+
+    void setstate(short bits, const char *psz) {
+        state |= bits;
+        if (state & exceptmask)
+            throw std::ios_base::failure(psz);
+    }
+
+public:
+    int nType;
+    int nVersion;
+
+    CBufferReader(const char* pbeginIn, const char* pendIn, int nTypeIn, int nVersionIn) :
+        pbegin(pbeginIn), pend(pendIn), pread(pbeginIn), plimit(pendIn),
+        state(0), exceptmask(std::ios_base::badbit | std::ios_base::failbit), nType(nTypeIn), nVersion(nVersionIn) {
+    }
+
+    // check whether no error occurred
+    bool good() const {
+        return state == 0;
+    }
+
+    // check whether we're at the end of the range
+    bool eof() const {
+        return pread == pend;
+    }
+
+    const char* begin() const { return pbegin; }
+    const char* end() const { return pend; }
+
+    // read a number of bytes
+    CBufferReader& read(char *pch, size_t nSize) {
+        if (nSize > (size_t)(plimit - pread)) {
+            if (plimit != pend)
+                throw std::ios_base::failure("Read attempted past buffer limit");
+            setstate(std::ios_base::failbit, "CBufferReader::read : end of data");
+            return (*this);
+        }
+        memcpy(pch, pread, nSize);
+        pread += nSize;
+        return (*this);
+    }
+
+    // skip a number of bytes
+    CBufferReader& ignore(size_t nSize) {
+        if (nSize > (size_t)(plimit - pread))
+            setstate(std::ios_base::failbit, "CBufferReader::ignore : end of data");
+        else
+            pread += nSize;
+        return (*this);
+    }
+
+    // return the current reading position
+    uint64 GetPos() const {
+        return pread - pbegin;
+    }
+
+    // move to a given reading position
+    bool SetPos(uint64 nPos) {
+        if (nPos > (uint64)(pend - pbegin)) {
+            pread = pend;
+            return false;
+        }
+        pread = pbegin + nPos;
+        return true;
+    }
+
+    bool Seek(uint64 nPos) {
+        state = 0;
+        return SetPos(nPos);
+    }
+
+    // prevent reading beyond a certain position
+    // no argument removes the limit
+    bool SetLimit(uint64 nPos = (uint64)(-1)) {
+        if (nPos < GetPos())
+            return false;
+        plimit = (nPos >= (uint64)(pend - pbegin)) ? pend : pbegin + nPos;
+        return true;
+    }
+
+    template<typename T>
+    CBufferReader& operator>>(T& obj) {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+
+    // search for a given byte in the stream, and remain positioned on it
+    void FindByte(char ch) {
+        const char* p = (const char*)memchr(pread, ch, plimit - pread);
+        if (p == NULL) {
+            pread = plimit;
+            setstate(std::ios_base::failbit, "CBufferReader::FindByte : end of data");
+            return;
+        }
+        pread = p;
+    }
+};
+
 
 
 
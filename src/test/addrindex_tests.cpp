@@ -0,0 +1,231 @@
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+
+#include "main.h"
+#include "txdb.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(addrindex_tests)
+
+BOOST_AUTO_TEST_CASE(addrindex_key_order)
+{
+    CScriptID scid(uint160(1234));
+    CDiskTxPos pos(CDiskBlockPos(1, 300), 20);
+
+    CAddressIndexKey key(scid, 70000, pos), key2;
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << key;
+    BOOST_CHECK_EQUAL(ss.size(), key.GetSerializeSize(SER_DISK, CLIENT_VERSION));
+    ss >> key2;
+    BOOST_CHECK(key2.scriptID == scid);
+    BOOST_CHECK_EQUAL(key2.nHeight, 70000U);
+    BOOST_CHECK_EQUAL(key2.txpos.nFile, 1);
+    BOOST_CHECK_EQUAL(key2.txpos.nPos, 300U);
+    BOOST_CHECK_EQUAL(key2.txpos.nTxOffset, 20U);
+
+    // keys of one address sort by height, then position
+    CDataStream ssLow(SER_DISK, CLIENT_VERSION), ssHigh(SER_DISK, CLIENT_VERSION);
+    ssLow << CAddressIndexKey(scid, 255, CDiskTxPos(CDiskBlockPos(2, 1000), 5000));
+    ssHigh << CAddressIndexKey(scid, 256, CDiskTxPos(CDiskBlockPos(0, 10), 1));
+    BOOST_CHECK(ssLow.str() < ssHigh.str());
+}
+
+BOOST_AUTO_TEST_CASE(addrindex_upgrade)
+{
+    CAddressDB db(1 << 20, true, true);
+    bool fRebuild;
+
+    // a new index is current
+    BOOST_CHECK(db.Upgrade(fRebuild));
+    BOOST_CHECK(!fRebuild);
+
+    // version 1 records, without balances or unspent outputs
+    BOOST_CHECK(db.Erase('V'));
+    BOOST_CHECK(db.WriteEnable(true));
+    CScriptID scid(uint160(99));
+    vector<CDiskTxPos> vTxPos;
+    vTxPos.push_back(CDiskTxPos(CDiskBlockPos(0, 100), 1));
+    BOOST_CHECK(db.Write(scid, vTxPos));
+    uint256 txid = 555;
+    vector<pair<uint256, unsigned int> > vIns(3);
+    vIns[2] = make_pair(uint256(777), 1U);
+    BOOST_CHECK(db.Write(txid, vIns));
+
+    // are dropped for a rebuild, keeping the flags
+    BOOST_CHECK(db.Upgrade(fRebuild));
+    BOOST_CHECK(fRebuild);
+    BOOST_CHECK(!db.Exists(scid));
+    BOOST_CHECK(!db.Exists(txid));
+    bool fEnabled = false;
+    BOOST_CHECK(db.ReadEnable(fEnabled));
+    BOOST_CHECK(fEnabled);
+
+    // a second run has nothing to do
+    BOOST_CHECK(db.Upgrade(fRebuild));
+    BOOST_CHECK(!fRebuild);
+}
+
+// a block at nHeight whose coinbase pays nValue to scriptPubKey
+static CAddressIndexBlock MakeBlock(unsigned int nHeight, const CScript& scriptPubKey, int64 nValue)
+{
+    CAddressIndexBlock block;
+    block.hashBlock = nHeight;
+    block.hashPrevBlock = nHeight - 1;
+    block.nHeight = nHeight;
+    block.vtx.resize(1);
+    block.vtx[0].vin.resize(1);
+    block.vtx[0].vin[0].scriptSig << nHeight;
+    block.vtx[0].vout.push_back(CTxOut(nValue, scriptPubKey));
+    block.vpos.push_back(make_pair(block.vtx[0].GetHash(), CDiskTxPos(CDiskBlockPos(0, 100 * nHeight), 1)));
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(addrindex_addblock)
+{
+    CAddressDB db(1 << 20, true, true);
+
+    CScript scriptFrom, scriptTo;
+    scriptFrom << OP_1;
+    scriptTo << OP_2;
+
+    // a coinbase, and a transaction spending an output paying to scriptFrom
+    CAddressIndexBlock block = MakeBlock(10, scriptTo, 30);
+    block.vtx.resize(2);
+    block.vtx[1].vin.resize(1);
+    block.vtx[1].vin[0].prevout = COutPoint(uint256(1), 3);
+    block.vtx[1].vout.push_back(CTxOut(20, scriptTo));
+    block.vpos.push_back(make_pair(block.vtx[1].GetHash(), CDiskTxPos(CDiskBlockPos(0, 1000), 60)));
+    block.undo.vtxundo.resize(1);
+    block.undo.vtxundo[0].vprevout.push_back(CTxInUndo(CTxOut(50, scriptFrom)));
+
+    // the spent output comes from the undo data, not from a transaction lookup
+    BOOST_CHECK(db.AddBlock(block));
+    vector<CDiskTxPos> vTxs;
+    BOOST_CHECK(db.GetTxs(vTxs, scriptFrom.GetID()));
+    BOOST_CHECK_EQUAL(vTxs.size(), 1U);
+    BOOST_CHECK_EQUAL(vTxs[0].nTxOffset, 60U);
+    vTxs.clear();
+    BOOST_CHECK(db.GetTxs(vTxs, scriptTo.GetID()));
+    BOOST_CHECK_EQUAL(vTxs.size(), 2U);
+
+    // txids by height range
+    vector<pair<CAddressIndexKey, uint256> > vTxids;
+    BOOST_CHECK(db.GetTxids(vTxids, scriptTo.GetID(), 10, 10));
+    BOOST_CHECK_EQUAL(vTxids.size(), 2U);
+    BOOST_CHECK_EQUAL(vTxids[0].first.nHeight, 10U);
+    BOOST_CHECK_EQUAL(vTxids[1].first.txpos.nTxOffset, 60U);
+    BOOST_CHECK((vTxids[0].second == block.vtx[0].GetHash() && vTxids[1].second == block.vtx[1].GetHash()));
+    vTxids.clear();
+    BOOST_CHECK(db.GetTxids(vTxids, scriptTo.GetID(), 0, 9));
+    BOOST_CHECK(db.GetTxids(vTxids, scriptTo.GetID(), 11, 100));
+    BOOST_CHECK(vTxids.empty());
+
+    CAddressBalance balance;
+    BOOST_CHECK(db.ReadBalance(scriptTo.GetID(), balance));
+    BOOST_CHECK_EQUAL(balance.nBalance, 50);
+    BOOST_CHECK_EQUAL(balance.nReceived, 50);
+    BOOST_CHECK_EQUAL(balance.nTxs, 2U);
+    vector<pair<COutPoint, CAddressUnspentValue> > vUnspent;
+    BOOST_CHECK(db.GetUnspent(vUnspent, scriptTo.GetID()));
+    BOOST_CHECK_EQUAL(vUnspent.size(), 2U);
+
+    uint256 hashNext, hashBest;
+    unsigned int nNext;
+    BOOST_CHECK(db.ReadNextIn(COutPoint(uint256(1), 3), hashNext, nNext));
+    BOOST_CHECK(hashNext == block.vtx[1].GetHash());
+    BOOST_CHECK_EQUAL(nNext, 0U);
+    BOOST_CHECK(db.ReadBestBlock(hashBest));
+    BOOST_CHECK(hashBest == uint256(10));
+
+    // the same through the background writer; adding the last block again does nothing
+    {
+        CAddressIndexQueue queue(db);
+        queue.Push(new CAddressIndexBlock(block));
+        queue.Flush();
+    }
+    BOOST_CHECK(db.ReadBalance(scriptTo.GetID(), balance));
+    BOOST_CHECK_EQUAL(balance.nBalance, 50);
+    BOOST_CHECK_EQUAL(balance.nTxs, 2U);
+
+    // undo data has to match the block
+    block.hashBlock = 11;
+    block.undo.vtxundo.clear();
+    BOOST_CHECK(!db.AddBlock(block));
+}
+
+BOOST_AUTO_TEST_CASE(addrindex_removeblock)
+{
+    CAddressDB db(1 << 20, true, true);
+
+    CScript scriptFrom, scriptTo;
+    scriptFrom << OP_1;
+    scriptTo << OP_2;
+
+    // block 1 pays to scriptFrom, block 2 spends that output to scriptTo
+    CAddressIndexBlock block1 = MakeBlock(1, scriptFrom, 50);
+    CAddressIndexBlock block2 = MakeBlock(2, scriptTo, 50);
+    COutPoint prevout(block1.vtx[0].GetHash(), 0);
+    block2.vtx.resize(2);
+    block2.vtx[1].vin.push_back(CTxIn(prevout));
+    block2.vtx[1].vout.push_back(CTxOut(40, scriptTo));
+    block2.vtx[1].vout.push_back(CTxOut(10, scriptFrom));
+    block2.vpos.push_back(make_pair(block2.vtx[1].GetHash(), CDiskTxPos(CDiskBlockPos(0, 200), 60)));
+    block2.undo.vtxundo.resize(1);
+    block2.undo.vtxundo[0].vprevout.push_back(CTxInUndo(CTxOut(50, scriptFrom)));
+
+    BOOST_CHECK(db.AddBlock(block1));
+    BOOST_CHECK(db.AddBlock(block2));
+
+    CAddressBalance balance;
+    BOOST_CHECK(db.ReadBalance(scriptFrom.GetID(), balance));
+    BOOST_CHECK_EQUAL(balance.nBalance, 10);
+    BOOST_CHECK_EQUAL(balance.nReceived, 60);
+    BOOST_CHECK_EQUAL(balance.nTxs, 2U);
+    CAddressSpentValue spent;
+    BOOST_CHECK(db.ReadSpent(prevout, spent));
+    BOOST_CHECK(spent.txid == block2.vtx[1].GetHash());
+    BOOST_CHECK_EQUAL(spent.nHeight, 2U);
+    BOOST_CHECK_EQUAL(spent.nPrevHeight, 1U);
+    vector<pair<COutPoint, CAddressUnspentValue> > vUnspent;
+    BOOST_CHECK(db.GetUnspent(vUnspent, scriptFrom.GetID()));
+    BOOST_CHECK_EQUAL(vUnspent.size(), 1U);
+    BOOST_CHECK_EQUAL(vUnspent[0].second.txout.nValue, 10);
+
+    // only the last block added can be removed
+    BOOST_CHECK(!db.RemoveBlock(block1));
+
+    // removing block 2 restores the state after block 1
+    block2.fDisconnect = true;
+    BOOST_CHECK(db.WriteBlock(block2));
+    uint256 hashBest;
+    BOOST_CHECK(db.ReadBestBlock(hashBest));
+    BOOST_CHECK(hashBest == uint256(1));
+    BOOST_CHECK(db.ReadBalance(scriptFrom.GetID(), balance));
+    BOOST_CHECK_EQUAL(balance.nBalance, 50);
+    BOOST_CHECK_EQUAL(balance.nReceived, 50);
+    BOOST_CHECK_EQUAL(balance.nTxs, 1U);
+    BOOST_CHECK(!db.ReadSpent(prevout, spent));
+    vUnspent.clear();
+    BOOST_CHECK(db.GetUnspent(vUnspent, scriptFrom.GetID()));
+    BOOST_CHECK_EQUAL(vUnspent.size(), 1U);
+    BOOST_CHECK(vUnspent[0].first == prevout);
+    BOOST_CHECK_EQUAL(vUnspent[0].second.nHeight, 1U);
+    vector<CDiskTxPos> vTxs;
+    BOOST_CHECK(db.GetTxs(vTxs, scriptTo.GetID()));
+    BOOST_CHECK(vTxs.empty());
+    BOOST_CHECK(db.ReadBalance(scriptTo.GetID(), balance));
+    BOOST_CHECK(balance.IsNull());
+    BOOST_CHECK(!db.Exists(make_pair('b', CScriptID(scriptTo.GetID()))));
+
+    // and removing block 1 leaves nothing
+    BOOST_CHECK(db.RemoveBlock(block1));
+    vUnspent.clear();
+    BOOST_CHECK(db.GetUnspent(vUnspent, scriptFrom.GetID()));
+    BOOST_CHECK(vUnspent.empty());
+    BOOST_CHECK(db.ReadBalance(scriptFrom.GetID(), balance));
+    BOOST_CHECK(balance.IsNull());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
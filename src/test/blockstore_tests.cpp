@@ -0,0 +1,46 @@
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+
+#include "main.h"
+#include "blockstore.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockstore_tests)
+
+BOOST_AUTO_TEST_CASE(blockrecord_compression)
+{
+    // repetitive data compresses
+    vector<char> vchBlock(50000);
+    for (unsigned int i = 0; i < vchBlock.size(); i++)
+        vchBlock[i] = (char)(i % 97);
+
+    vector<char> vchRecord;
+    unsigned int nSize = EncodeBlockRecord(&vchBlock[0], &vchBlock[0] + vchBlock.size(), true, vchRecord);
+    BOOST_CHECK(nSize & BLOCKRECORD_COMPRESSED);
+    BOOST_CHECK_EQUAL(nSize & ~BLOCKRECORD_COMPRESSED, vchRecord.size());
+    BOOST_CHECK(vchRecord.size() < vchBlock.size());
+
+    vector<char> vchData;
+    BOOST_CHECK(DecompressBlockRecord(&vchRecord[0], &vchRecord[0] + vchRecord.size(), vchData));
+    BOOST_CHECK(vchData == vchBlock);
+
+    // a damaged stream is rejected
+    BOOST_CHECK(!DecompressBlockRecord(&vchRecord[0], &vchRecord[0] + vchRecord.size() / 2, vchData));
+    BOOST_CHECK(!DecompressBlockRecord(&vchRecord[0], &vchRecord[0] + 3, vchData));
+
+    // without compression, or if it does not help, the block is stored as is
+    nSize = EncodeBlockRecord(&vchBlock[0], &vchBlock[0] + vchBlock.size(), false, vchRecord);
+    BOOST_CHECK_EQUAL(nSize, vchBlock.size());
+    BOOST_CHECK(vchRecord == vchBlock);
+
+    vector<char> vchRandom(1000);
+    for (unsigned int i = 0; i < vchRandom.size(); i++)
+        vchRandom[i] = (char)insecure_rand();
+    nSize = EncodeBlockRecord(&vchRandom[0], &vchRandom[0] + vchRandom.size(), true, vchRecord);
+    BOOST_CHECK_EQUAL(nSize, vchRandom.size());
+    BOOST_CHECK(vchRecord == vchRandom);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
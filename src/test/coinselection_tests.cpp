@@ -0,0 +1,172 @@
+#include <boost/test/unit_test.hpp>
+
+#include "coinselection.h"
+#include "main.h"
+#include "util.h"
+#include "wallet.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(coinselection_tests)
+
+static CWallet wallet;
+static vector<COutput> vCoins;
+
+static void add_coin(int64 nValue, int nAge = 6*24)
+{
+    static int nextLockTime = 0;
+    CTransaction tx;
+    tx.nLockTime = nextLockTime++;        // so all transactions get different hashes
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    CWalletTx* wtx = new CWalletTx(&wallet, tx);
+    vCoins.push_back(COutput(wtx, 0, nAge));
+}
+
+static void empty_wallet(void)
+{
+    BOOST_FOREACH(COutput output, vCoins)
+        delete output.tx;
+    vCoins.clear();
+}
+
+static int64 sum(const vector<int64>& vValue, const vector<char>& vfSelected)
+{
+    int64 nTotal = 0;
+    for (unsigned int i = 0; i < vValue.size(); i++)
+        if (vfSelected[i])
+            nTotal += vValue[i];
+    return nTotal;
+}
+
+BOOST_AUTO_TEST_CASE(bnb_search)
+{
+    vector<char> vfBest;
+    int64 nBest;
+    bool fExhausted;
+
+    int64 values[] = {10, 8, 7, 5, 3};
+    vector<int64> vValue(values, values + 5);
+
+    // exact matches
+    BOOST_CHECK(SelectCoinsBnB(vValue, 15, 0, vfBest, nBest, &fExhausted));
+    BOOST_CHECK_EQUAL(nBest, 15);
+    BOOST_CHECK_EQUAL(sum(vValue, vfBest), 15);
+    BOOST_CHECK(SelectCoinsBnB(vValue, 33, 0, vfBest, nBest, &fExhausted));
+    BOOST_CHECK_EQUAL(sum(vValue, vfBest), 33);
+    BOOST_CHECK(SelectCoinsBnB(vValue, 4, 1, vfBest, nBest, &fExhausted));
+    BOOST_CHECK_EQUAL(nBest, 5);
+
+    // no subset makes 4 or 34; the whole tree is searched
+    BOOST_CHECK(!SelectCoinsBnB(vValue, 4, 0, vfBest, nBest, &fExhausted));
+    BOOST_CHECK(fExhausted);
+    BOOST_CHECK(!SelectCoinsBnB(vValue, 34, 0, vfBest, nBest, &fExhausted));
+    BOOST_CHECK(fExhausted);
+    BOOST_CHECK_EQUAL(sum(vValue, vfBest), 0);
+
+    // the least excess within the window wins
+    BOOST_CHECK(SelectCoinsBnB(vValue, 14, 2, vfBest, nBest, &fExhausted));
+    BOOST_CHECK_EQUAL(nBest, 15);
+
+    // outputs of equal value are not tried in every combination
+    vector<int64> vEqual(200, 5 * CENT);
+    BOOST_CHECK(!SelectCoinsBnB(vEqual, 501 * CENT, 0, vfBest, nBest, &fExhausted));
+    BOOST_CHECK(fExhausted);
+    BOOST_CHECK(SelectCoinsBnB(vEqual, 500 * CENT, 0, vfBest, nBest, &fExhausted));
+    BOOST_CHECK_EQUAL(sum(vEqual, vfBest), 500 * CENT);
+
+    // the search gives up after nMaxTries steps
+    vector<int64> vHard;
+    for (int i = 0; i < 40; i++)
+        vHard.push_back(2 * (1000 + i));
+    BOOST_CHECK(!SelectCoinsBnB(vHard, 20001, 0, vfBest, nBest, &fExhausted, 1000));
+    BOOST_CHECK(!fExhausted);
+}
+
+BOOST_AUTO_TEST_CASE(coin_pool)
+{
+    empty_wallet();
+    add_coin(3 * CENT);
+    add_coin(1 * CENT, 2);
+    add_coin(2 * CENT);
+    add_coin(5 * CENT, 0);
+
+    vector<CInputCoin> vSorted;
+    SortCoins(vCoins, vSorted);
+    BOOST_CHECK_EQUAL(vSorted.size(), 4U);
+    for (unsigned int i = 1; i < vSorted.size(); i++)
+        BOOST_CHECK(vSorted[i-1].nValue <= vSorted[i].nValue);
+
+    CCoinPool poolMature(vSorted, 1, 6);
+    BOOST_CHECK_EQUAL(poolMature.vCoins.size(), 2U);
+    BOOST_CHECK_EQUAL(poolMature.vTotal.back(), 5 * CENT);
+
+    CCoinPool poolAll(vSorted, 0, 0);
+    BOOST_CHECK_EQUAL(poolAll.vCoins.size(), 4U);
+    BOOST_CHECK_EQUAL(poolAll.vTotal.back(), 11 * CENT);
+
+    CoinSet setCoinsRet;
+    int64 nValueRet;
+    BOOST_CHECK(SelectCoinsFromPool(poolAll, 4 * CENT, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 4 * CENT);
+    BOOST_CHECK(!SelectCoinsFromPool(poolMature, 6 * CENT, setCoinsRet, nValueRet));
+
+    empty_wallet();
+}
+
+// Synthetic wallets: many small payouts from a pool, payouts of every size, and a few big coins
+static void fill_wallet(int nDistribution, int nCoins)
+{
+    empty_wallet();
+    for (int i = 0; i < nCoins; i++)
+    {
+        int64 nValue;
+        if (nDistribution == 0)
+            nValue = 5 * CENT + GetRand(45 * CENT);
+        else if (nDistribution == 1)
+            nValue = (int64)1 << (10 + GetRand(28));
+        else
+            nValue = (i % 10 == 0) ? (10 + GetRand(100)) * COIN : GetRand(COIN) + 1;
+        add_coin(nValue, 1 + GetRand(200));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(coinselection_benchmark)
+{
+    const char* pszDistribution[] = {"mining payouts", "log-uniform", "mixed"};
+    for (int nDistribution = 0; nDistribution < 3; nDistribution++)
+    {
+        fill_wallet(nDistribution, 5000);
+        int64 nTotal = 0;
+        BOOST_FOREACH(const COutput& output, vCoins)
+            nTotal += output.tx->vout[output.i].nValue;
+
+        int64 nStart = GetTimeMicros();
+        vector<CInputCoin> vSorted;
+        SortCoins(vCoins, vSorted);
+        CCoinPool pool(vSorted, 1, 6);
+        int64 nSort = GetTimeMicros() - nStart;
+
+        unsigned int nInputs = 0, nNoChange = 0, nRuns = 100;
+        nStart = GetTimeMicros();
+        for (unsigned int i = 0; i < nRuns; i++)
+        {
+            int64 nTarget = 1 + GetRand(pool.vTotal.back() / 4);
+            CoinSet setCoinsRet;
+            int64 nValueRet;
+            BOOST_CHECK(SelectCoinsFromPool(pool, nTarget, setCoinsRet, nValueRet));
+            BOOST_CHECK(nValueRet >= nTarget);
+            nInputs += setCoinsRet.size();
+            if (nValueRet == nTarget)
+                nNoChange++;
+        }
+        int64 nSelect = GetTimeMicros() - nStart;
+
+        if (fDebug) printf("coinselection_benchmark: %s, %u coins worth %s: sort %"PRI64d"us, %u selections %"PRI64d"us, %.1f inputs, %u without change\n",
+                           pszDistribution[nDistribution], (unsigned int)vCoins.size(), FormatMoney(nTotal).c_str(),
+                           nSort, nRuns, nSelect, (double)nInputs / nRuns, nNoChange);
+    }
+    empty_wallet();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,109 @@
+#include <boost/test/unit_test.hpp>
+
+#include <openssl/rand.h>
+
+#include "keystore.h"
+#include "main.h"
+#include "script.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(keystore_tests)
+
+BOOST_AUTO_TEST_CASE(ismine_index)
+{
+    CBasicKeyStore keystore;
+    CKey key[3];
+    for (int i = 0; i < 3; i++)
+        key[i].MakeNewKey(true);
+
+    CScript scriptMine, scriptOther;
+    scriptMine.SetDestination(key[0].GetPubKey().GetID());
+    scriptOther.SetDestination(key[1].GetPubKey().GetID());
+    BOOST_CHECK(scriptMine.IsPayToPubKeyHash());
+    BOOST_CHECK(!IsMine(keystore, scriptMine));
+
+    keystore.AddKey(key[0]);
+    BOOST_CHECK(keystore.HaveScriptPubKey(scriptMine));
+    BOOST_CHECK(IsMine(keystore, scriptMine));
+    BOOST_CHECK(!IsMine(keystore, scriptOther));
+
+    // the same hash pushed with OP_PUSHDATA1 is not indexed, but still mine
+    CScript scriptPushData;
+    scriptPushData.push_back(OP_PUSHDATA1);
+    scriptPushData.push_back(20);
+    scriptPushData.insert(scriptPushData.end(), scriptMine.begin() + 1, scriptMine.begin() + 21);
+    scriptPushData << OP_CHECKSIG;
+    BOOST_CHECK(!keystore.HaveScriptPubKey(scriptPushData));
+    BOOST_CHECK(IsMine(keystore, scriptPushData));
+
+    // a script hash is mine once all the keys of its redeem script are
+    vector<CKeyID> keys;
+    keys.push_back(key[0].GetPubKey().GetID());
+    keys.push_back(key[2].GetPubKey().GetID());
+    CScript redeemScript;
+    redeemScript.SetMultisig(1, keys);
+    CScript scriptHash;
+    scriptHash.SetDestination(redeemScript.GetID());
+    keystore.AddCScript(redeemScript);
+    BOOST_CHECK(!IsMine(keystore, redeemScript));
+    BOOST_CHECK(!IsMine(keystore, scriptHash));
+    keystore.AddKey(key[2]);
+    BOOST_CHECK(IsMine(keystore, redeemScript));
+    BOOST_CHECK(IsMine(keystore, scriptHash));
+    BOOST_CHECK(keystore.HaveScriptPubKey(scriptHash));
+    BOOST_CHECK(!keystore.HaveScriptPubKey(redeemScript));
+}
+
+BOOST_AUTO_TEST_CASE(ismine_benchmark)
+{
+    CBasicKeyStore keystore;
+    for (int i = 0; i < 1000; i++)
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        keystore.AddKey(key);
+    }
+
+    // a block full of payments that have nothing to do with the wallet
+    vector<CTransaction> vtx(2000);
+    BOOST_FOREACH(CTransaction& tx, vtx)
+    {
+        tx.vout.resize(2);
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            uint160 hash;
+            RAND_bytes((unsigned char*)&hash, sizeof(hash));
+            tx.vout[i].scriptPubKey.SetDestination(CKeyID(hash));
+        }
+    }
+
+    int64 nStart = GetTimeMicros();
+    unsigned int nMine = 0;
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+        BOOST_FOREACH(const CTxOut& txout, tx.vout)
+            if (IsMine(keystore, txout.scriptPubKey))
+                nMine++;
+    int64 nIndex = GetTimeMicros() - nStart;
+    BOOST_CHECK_EQUAL(nMine, 0U);
+
+    // what every output used to cost: Solver, then a key lookup
+    nStart = GetTimeMicros();
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+        BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        {
+            vector<vector<unsigned char> > vSolutions;
+            txnouttype whichType;
+            if (Solver(txout.scriptPubKey, whichType, vSolutions) && whichType == TX_PUBKEYHASH &&
+                keystore.HaveKey(CKeyID(uint160(vSolutions[0]))))
+                nMine++;
+        }
+    int64 nSolver = GetTimeMicros() - nStart;
+    BOOST_CHECK_EQUAL(nMine, 0U);
+
+    if (fDebug) printf("ismine_benchmark: %u outputs: index %"PRI64d"us, solver %"PRI64d"us\n",
+                       (unsigned int)(vtx.size() * 2), nIndex, nSolver);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
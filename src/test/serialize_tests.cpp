@@ -42,4 +42,31 @@ BOOST_AUTO_TEST_CASE(varints)
 
 }
 
+BOOST_AUTO_TEST_CASE(bufferreader)
+{
+    CDataStream ss(SER_DISK, 0);
+    ss << 'x' << VARINT(1234) << string("block");
+
+    CBufferReader reader(&ss[0], &ss[0] + ss.size(), SER_DISK, 0);
+    reader.FindByte('x');
+    BOOST_CHECK(reader.GetPos() == 0);
+
+    char ch;
+    int n = 0;
+    string str;
+    reader >> ch >> VARINT(n) >> str;
+    BOOST_CHECK(ch == 'x' && n == 1234 && str == "block");
+    BOOST_CHECK(reader.eof());
+    BOOST_CHECK_THROW(reader >> ch, std::ios_base::failure);
+
+    // reads are not allowed to cross the limit
+    BOOST_CHECK(reader.Seek(1));
+    BOOST_CHECK(reader.SetLimit(2));
+    BOOST_CHECK_THROW(reader >> str, std::ios_base::failure);
+    reader.SetLimit();
+    BOOST_CHECK(reader.SetPos(1));
+    reader >> VARINT(n);
+    BOOST_CHECK(n == 1234);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
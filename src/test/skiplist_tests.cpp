@@ -0,0 +1,100 @@
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+
+#include "main.h"
+#include "util.h"
+
+#define SKIPLIST_LENGTH 300000
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(skiplist_tests)
+
+BOOST_AUTO_TEST_CASE(skiplist_test)
+{
+    vector<CBlockIndex> vIndex(SKIPLIST_LENGTH);
+
+    for (int i = 0; i < SKIPLIST_LENGTH; i++) {
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = (i == 0) ? NULL : &vIndex[i - 1];
+        vIndex[i].BuildSkip();
+    }
+
+    for (int i = 0; i < SKIPLIST_LENGTH; i++) {
+        if (i > 0) {
+            BOOST_CHECK(vIndex[i].pskip == &vIndex[vIndex[i].pskip->nHeight]);
+            BOOST_CHECK(vIndex[i].pskip->nHeight < i);
+        } else {
+            BOOST_CHECK(vIndex[i].pskip == NULL);
+        }
+    }
+
+    for (int i = 0; i < 1000; i++) {
+        int from = insecure_rand() % (SKIPLIST_LENGTH - 1);
+        int to = insecure_rand() % (from + 1);
+
+        BOOST_CHECK(vIndex[SKIPLIST_LENGTH - 1].GetAncestor(from) == &vIndex[from]);
+        BOOST_CHECK(vIndex[from].GetAncestor(to) == &vIndex[to]);
+        BOOST_CHECK(vIndex[from].GetAncestor(0) == &vIndex[0]);
+    }
+
+    BOOST_CHECK(vIndex[100].GetAncestor(101) == NULL);
+    BOOST_CHECK(vIndex[100].GetAncestor(-1) == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(skiplist_fork_test)
+{
+    // two branches forking at height 50000
+    vector<CBlockIndex> vIndexA(100000), vIndexB(100000);
+    for (int i = 0; i < 100000; i++) {
+        vIndexA[i].nHeight = i;
+        vIndexA[i].pprev = (i == 0) ? NULL : &vIndexA[i - 1];
+        vIndexA[i].BuildSkip();
+        vIndexB[i].nHeight = i;
+        vIndexB[i].pprev = (i == 0) ? NULL : (i <= 50000 ? &vIndexA[i - 1] : &vIndexB[i - 1]);
+        vIndexB[i].BuildSkip();
+    }
+
+    for (int i = 0; i < 1000; i++) {
+        int height = insecure_rand() % 100000;
+        const CBlockIndex* pindex = vIndexB[99999].GetAncestor(height);
+        BOOST_CHECK_EQUAL(pindex->nHeight, height);
+        BOOST_CHECK(pindex == (height < 50000 ? &vIndexA[height] : &vIndexB[height]));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(skiplist_benchmark)
+{
+    // random height lookups from the tip, as done by getblockhash on a fork
+    vector<CBlockIndex> vIndex(SKIPLIST_LENGTH);
+    for (int i = 0; i < SKIPLIST_LENGTH; i++) {
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = (i == 0) ? NULL : &vIndex[i - 1];
+        vIndex[i].BuildSkip();
+    }
+
+    vector<int> vHeights(10000);
+    for (unsigned int i = 0; i < vHeights.size(); i++)
+        vHeights[i] = insecure_rand() % SKIPLIST_LENGTH;
+
+    CBlockIndex* pindexTip = &vIndex[SKIPLIST_LENGTH - 1];
+    int64 nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < vHeights.size(); i++)
+        BOOST_CHECK(pindexTip->GetAncestor(vHeights[i]) == &vIndex[vHeights[i]]);
+    int64 nSkip = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < vHeights.size() / 100; i++) {
+        CBlockIndex* pindex = pindexTip;
+        while (pindex->nHeight > vHeights[i])
+            pindex = pindex->pprev;
+        BOOST_CHECK(pindex == &vIndex[vHeights[i]]);
+    }
+    int64 nWalk = (GetTimeMicros() - nStart) * 100;
+
+    if (fDebug) printf("skiplist_benchmark: %u lookups, skip list %"PRI64d"us, pprev walk %"PRI64d"us (extrapolated)\n",
+                       (unsigned int)vHeights.size(), nSkip, nWalk);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -29,6 +29,7 @@ struct TestingSetup {
         pblocktree = new CBlockTreeDB(1 << 20, true);
         pcoinsdbview = new CCoinsViewDB(1 << 23, true);
         pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
+        paddressmap = new CAddressDB(1 << 20, true, false);
         InitBlockIndex();
         bool fFirstRun;
         pwalletMain = new CWallet("wallet.dat");
@@ -47,6 +48,7 @@ struct TestingSetup {
         delete pcoinsTip;
         delete pcoinsdbview;
         delete pblocktree;
+        delete paddressmap;
         bitdb.Flush(true);
         boost::filesystem::remove_all(pathTemp);
     }
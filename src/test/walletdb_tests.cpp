@@ -0,0 +1,62 @@
+#include <boost/test/unit_test.hpp>
+
+#include "db.h"
+#include "wallet.h"
+#include "walletdb.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(walletdb_tests)
+
+BOOST_AUTO_TEST_CASE(leveldb_wallet)
+{
+    const string strFile = "walletdb_tests.dat";
+    bitdb.fUseLevelDb = true;
+    {
+        CWalletDB walletdb(strFile, "cr+");
+        int nVersion;
+        BOOST_CHECK(walletdb.ReadVersion(nVersion));
+        BOOST_CHECK_EQUAL(nVersion, CLIENT_VERSION);
+
+        CKey key;
+        key.MakeNewKey(true);
+        CAccount account, accountRead;
+        account.vchPubKey = key.GetPubKey();
+        BOOST_CHECK(walletdb.WriteAccount("a", account));
+        BOOST_CHECK(walletdb.ReadAccount("a", accountRead));
+        BOOST_CHECK(accountRead.vchPubKey == account.vchPubKey);
+
+        // a batch is written when committed, and not at all when aborted
+        BOOST_CHECK(walletdb.TxnBegin());
+        BOOST_CHECK(walletdb.WriteAccount("b", account));
+        BOOST_CHECK(!walletdb.ReadAccount("b", accountRead));
+        BOOST_CHECK(walletdb.TxnAbort());
+        BOOST_CHECK(!walletdb.ReadAccount("b", accountRead));
+        BOOST_CHECK(walletdb.TxnBegin());
+        BOOST_CHECK(walletdb.WriteAccount("b", account));
+        BOOST_CHECK(walletdb.TxnCommit());
+        BOOST_CHECK(walletdb.ReadAccount("b", accountRead));
+
+        // cursors see the records in key order
+        for (int i = 0; i < 4; i++)
+        {
+            CAccountingEntry entry;
+            entry.strAccount = (i % 2) ? "x" : "y";
+            entry.nCreditDebit = i + 1;
+            BOOST_CHECK(walletdb.WriteAccountingEntry(entry));
+        }
+        list<CAccountingEntry> entries;
+        walletdb.ListAccountCreditDebit("x", entries);
+        BOOST_CHECK_EQUAL(entries.size(), 2U);
+        BOOST_CHECK_EQUAL(walletdb.GetAccountCreditDebit("x"), 6);
+        entries.clear();
+        walletdb.ListAccountCreditDebit("*", entries);
+        BOOST_CHECK_EQUAL(entries.size(), 4U);
+        BOOST_CHECK(entries.front().strAccount == "x");
+        BOOST_CHECK(entries.back().strAccount == "y");
+    }
+    bitdb.CloseDb(strFile);
+    bitdb.fUseLevelDb = false;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -6,6 +6,7 @@
 #include "txdb.h"
 #include "main.h"
 #include "hash.h"
+#include "ui_interface.h"
 
 using namespace std;
 
@@ -73,6 +74,11 @@ bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
     return Write(make_pair('b', blockindex.GetBlockHash()), blockindex);
 }
 
+bool CBlockTreeDB::ReadBlockIndex(const uint256& hash, CDiskBlockIndex& blockindex)
+{
+    return Read(make_pair('b', hash), blockindex);
+}
+
 bool CBlockTreeDB::ReadBestInvalidWork(CBigNum& bnBestInvalidWork)
 {
     return Read('I', bnBestInvalidWork);
@@ -173,6 +179,17 @@ bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos>
     return WriteBatch(batch);
 }
 
+bool CBlockTreeDB::ReadTxFeeInfo(const uint256 &txid, CTxFeeInfo &info) {
+    return Read(make_pair('e', txid), info);
+}
+
+bool CBlockTreeDB::WriteTxFeeIndex(const std::vector<std::pair<uint256, CTxFeeInfo> >&vect) {
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<uint256,CTxFeeInfo> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
+        batch.Write(make_pair('e', it->first), it->second);
+    return WriteBatch(batch);
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
     return Write(std::make_pair('F', name), fValue ? '1' : '0');
 }
@@ -185,62 +202,138 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+bool CBlockTreeDB::ReadIndexCursor(const std::string &name, uint256 &hashBlock) {
+    return Read(std::make_pair('I', name), hashBlock);
+}
+
+bool CBlockTreeDB::WriteIndexCursor(const std::string &name, const uint256 &hashBlock) {
+    return Write(std::make_pair('I', name), hashBlock);
+}
+
+bool CBlockTreeDB::EraseIndexCursor(const std::string &name) {
+    return Erase(std::make_pair('I', name));
+}
+
+// A block index record read by LoadBlockIndexGuts, decoded by one of its workers
+struct CBlockIndexRecord
+{
+    std::string strValue;
+    CDiskBlockIndex diskindex;
+    uint256 hash;
+    uint256 nWork;
+    bool fDecoded;
+
+    CBlockIndexRecord() : fDecoded(false) {}
+};
+
+// Deserializing and hashing the records, and the big number division of GetBlockWork,
+// are most of the work of loading the block index; they need no shared state
+void static DecodeBlockIndexRecords(std::vector<CBlockIndexRecord>* pvRecords, unsigned int nBegin, unsigned int nEnd)
+{
+    for (unsigned int i = nBegin; i < nEnd; i++) {
+        CBlockIndexRecord& record = (*pvRecords)[i];
+        try {
+            CDataStream ssValue(record.strValue.data(), record.strValue.data() + record.strValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> record.diskindex;
+            record.hash = record.diskindex.GetBlockHash();
+            record.nWork = record.diskindex.GetBlockWork().getuint256();
+            record.fDecoded = true;
+        } catch (std::exception &e) {
+            record.fDecoded = false;
+        }
+    }
+}
+
+// records read from the database before they are decoded
+static const unsigned int BLOCK_INDEX_LOAD_BATCH = 32768;
+
 bool CBlockTreeDB::LoadBlockIndexGuts()
 {
+    int64 nStart = GetTimeMillis();
+    int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS));
+
     leveldb::Iterator *pcursor = NewIterator();
 
     CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
     ssKeySet << make_pair('b', uint256(0));
     pcursor->Seek(ssKeySet.str());
 
-    // Load mapBlockIndex
-    while (pcursor->Valid()) {
+    // Load mapBlockIndex in batches: the records of a batch are read in key order,
+    // decoded by nThreads workers, then inserted in order by this thread
+    std::vector<CBlockIndexRecord> vRecords;
+    vRecords.reserve(BLOCK_INDEX_LOAD_BATCH);
+    unsigned int nLoaded = 0;
+    bool fMore = true;
+    while (fMore) {
         boost::this_thread::interruption_point();
-        try {
+
+        vRecords.clear();
+        while (vRecords.size() < BLOCK_INDEX_LOAD_BATCH) {
+            if (!pcursor->Valid()) {
+                fMore = false;
+                break;
+            }
             leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'b') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
-
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nFile          = diskindex.nFile;
-                pindexNew->nDataPos       = diskindex.nDataPos;
-                pindexNew->nUndoPos       = diskindex.nUndoPos;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->hashWholeBlock = diskindex.hashWholeBlock;
-                pindexNew->MinerSignature = diskindex.MinerSignature;
-                pindexNew->nStatus        = diskindex.nStatus;
-                pindexNew->nTx            = diskindex.nTx;
-
-                // Watch for genesis block
-                if (pindexGenesisBlock == NULL && diskindex.GetBlockHash() == hashGenesisBlock)
-                    pindexGenesisBlock = pindexNew;
-
-                if (!pindexNew->CheckIndex())
-                    return error("LoadBlockIndex() : CheckIndex failed: %s", pindexNew->ToString().c_str());
-
-                pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
+            if (slKey.size() == 0 || slKey.data()[0] != 'b') {
+                fMore = false; // finished loading block index
+                break;
             }
-        } catch (std::exception &e) {
-            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+            leveldb::Slice slValue = pcursor->value();
+            vRecords.push_back(CBlockIndexRecord());
+            vRecords.back().strValue.assign(slValue.data(), slValue.size());
+            pcursor->Next();
         }
+
+        unsigned int nPerThread = (vRecords.size() + nThreads - 1) / nThreads;
+        if (nThreads > 1 && vRecords.size() > 1024) {
+            boost::thread_group threadGroup;
+            for (unsigned int nBegin = nPerThread; nBegin < vRecords.size(); nBegin += nPerThread)
+                threadGroup.create_thread(boost::bind(&DecodeBlockIndexRecords, &vRecords, nBegin, std::min(nBegin + nPerThread, (unsigned int)vRecords.size())));
+            DecodeBlockIndexRecords(&vRecords, 0, nPerThread);
+            threadGroup.join_all();
+        } else {
+            DecodeBlockIndexRecords(&vRecords, 0, vRecords.size());
+        }
+
+        BOOST_FOREACH(CBlockIndexRecord& record, vRecords) {
+            if (!record.fDecoded) {
+                delete pcursor;
+                return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+            }
+            const CDiskBlockIndex& diskindex = record.diskindex;
+
+            // Construct block index object
+            CBlockIndex* pindexNew = InsertBlockIndex(record.hash);
+            pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nDataPos       = diskindex.nDataPos;
+            pindexNew->nUndoPos       = diskindex.nUndoPos;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+            pindexNew->nStatus        = diskindex.nStatus;
+            pindexNew->nTx            = diskindex.nTx;
+            // the work of this block only; LoadBlockIndexDB adds that of its predecessors
+            pindexNew->nChainWork     = record.nWork;
+
+            // Watch for genesis block
+            if (pindexGenesisBlock == NULL && record.hash == hashGenesisBlock)
+                pindexGenesisBlock = pindexNew;
+
+            if (!pindexNew->CheckIndex()) {
+                delete pcursor;
+                return error("LoadBlockIndex() : CheckIndex failed: %s", pindexNew->ToString().c_str());
+            }
+        }
+        nLoaded += vRecords.size();
     }
     delete pcursor;
 
+    printf("LoadBlockIndexGuts(): loaded %u block index entries with %d threads in %"PRI64d"ms\n",
+           nLoaded, nThreads, GetTimeMillis() - nStart);
     return true;
 }
 
@@ -284,12 +377,25 @@ void getNextIn(const COutPoint &Out, uint256& Hash, unsigned int& n)
 // Return transaction in tx, and if it was found inside a block, its header is placed in block
 bool ReadTransaction(const CDiskTxPos &postx, CTransaction &txOut, CBlockHeader &block)
 {
-    CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
     try
     {
-        file >> block;
-        fseek(file, postx.nTxOffset, SEEK_CUR);
-        file >> txOut;
+        CBlockRecord record;
+        if (ReadBlockRecord(postx, false, record))
+        {
+            CBufferReader reader(record.begin(), record.end(), SER_DISK, CLIENT_VERSION);
+            reader >> block;
+            reader.ignore(postx.nTxOffset);
+            reader >> txOut;
+        }
+        else
+        {
+            CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+            if (!file)
+                return error("%s() : OpenBlockFile failed", __PRETTY_FUNCTION__);
+            file >> block;
+            fseek(file, postx.nTxOffset, SEEK_CUR);
+            file >> txOut;
+        }
     }
     catch (std::exception &e)
     {
@@ -298,73 +404,487 @@ bool ReadTransaction(const CDiskTxPos &postx, CTransaction &txOut, CBlockHeader
     return true;
 }
 
+// Layout version of the address index, see CAddressDB
+static const int ADDRESS_INDEX_VERSION = 4;
+
 CAddressDB::CAddressDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDB(GetDataDir() / "blocks" / "addresses", nCacheSize, fMemory, fWipe)
 {
+    // a new index is written in the current layout
+    leveldb::Iterator *pcursor = NewIterator();
+    pcursor->SeekToFirst();
+    bool fEmpty = !pcursor->Valid();
+    delete pcursor;
+    if (fEmpty)
+        Write('V', ADDRESS_INDEX_VERSION);
+}
+
+bool CAddressDB::AddBlock(const CAddressIndexBlock& block, bool fBuild)
+{
+    return UpdateBlock(block, true, fBuild);
 }
 
-bool CAddressDB::AddTx(const std::vector<CTransaction>& vtx, const std::vector<std::pair<uint256, CDiskTxPos> >& vpos)
+bool CAddressDB::RemoveBlock(const CAddressIndexBlock& block, bool fBuild)
 {
-    for (unsigned int i = 0; i < vtx.size(); i++)
+    return UpdateBlock(block, false, fBuild);
+}
+
+bool CAddressDB::WriteBlock(const CAddressIndexBlock& block)
+{
+    return UpdateBlock(block, !block.fDisconnect, false);
+}
+
+bool CAddressDB::UpdateBlock(const CAddressIndexBlock& block, bool fAdd, bool fBuild)
+{
+    if (block.vpos.size() != block.vtx.size() || block.undo.vtxundo.size() + 1 != block.vtx.size())
+        return error("%s() : block and undo data mismatch", __PRETTY_FUNCTION__);
+
+    // Balances are not idempotent, so each block has to be applied exactly once
+    char chLast = fBuild ? 'C' : 'B';
+    uint256 hashLast;
+    bool fHaveLast = Read(chLast, hashLast);
+    if (fAdd && fHaveLast && hashLast == block.hashBlock)
+        return true;
+    if (!fAdd && (!fHaveLast || hashLast != block.hashBlock))
+        return error("%s() : block %s is not the last block added", __PRETTY_FUNCTION__, block.hashBlock.ToString().c_str());
+
+    CLevelDBBatch batch;
+    std::map<CScriptID, CAddressBalance> mapDelta;
+    for (unsigned int n = 0; n < block.vtx.size(); n++)
     {
-        const CDiskTxPos& pos = vpos[i].second;
-        uint256 TxHash = vtx[i].GetHash();
+        // transactions are removed in reverse order, so that outputs spent within the
+        // block are restored before they are removed
+        unsigned int i = fAdd ? n : block.vtx.size() - 1 - n;
+        const CTransaction& tx = block.vtx[i];
+        const uint256& TxHash = block.vpos[i].first;
+        const CDiskTxPos& pos = block.vpos[i].second;
+
+        std::set<CScriptID> setAddresses;
+        for (unsigned int j = 0; j < tx.vout.size(); j++)
+        {
+            const CTxOut& out = tx.vout[j];
+            CScriptID scid = out.scriptPubKey.GetID();
+            setAddresses.insert(scid);
+            mapDelta[scid].nBalance += out.nValue;
+            mapDelta[scid].nReceived += out.nValue;
+
+            CAddressUnspentKey key(scid, COutPoint(TxHash, j));
+            if (fAdd)
+                batch.Write(std::make_pair('u', key), CAddressUnspentValue(out, block.nHeight));
+            else
+                batch.Erase(std::make_pair('u', key));
+        }
+        if (i > 0)
+        {
+            const CTxUndo& txundo = block.undo.vtxundo[i-1];
+            if (txundo.vprevout.size() != tx.vin.size())
+                return error("%s() : transaction and undo data mismatch", __PRETTY_FUNCTION__);
+            for (unsigned int j = 0; j < tx.vin.size(); j++)
+            {
+                const COutPoint& prevout = tx.vin[j].prevout;
+                const CTxInUndo& undo = txundo.vprevout[j];
+                CScriptID scid = undo.txout.scriptPubKey.GetID();
+                setAddresses.insert(scid);
+                mapDelta[scid].nBalance -= undo.txout.nValue;
+
+                CAddressUnspentKey key(scid, prevout);
+                if (fAdd) {
+                    // the undo data only holds the height of the last unspent output
+                    // of a transaction; an output missing from the index was created
+                    // earlier in this block
+                    unsigned int nPrevHeight = undo.nHeight;
+                    CAddressUnspentValue unspent;
+                    if (nPrevHeight == 0)
+                        nPrevHeight = Read(std::make_pair('u', key), unspent) ? unspent.nHeight : block.nHeight;
+                    batch.Erase(std::make_pair('u', key));
+                    batch.Write(std::make_pair('s', prevout), CAddressSpentValue(TxHash, j, block.nHeight, nPrevHeight));
+                } else {
+                    CAddressSpentValue spent;
+                    if (!ReadSpent(prevout, spent))
+                        spent.nPrevHeight = undo.nHeight;
+                    batch.Write(std::make_pair('u', key), CAddressUnspentValue(undo.txout, spent.nPrevHeight));
+                    batch.Erase(std::make_pair('s', prevout));
+                }
+            }
+        }
 
-        std::vector<CScriptID> Inputs;
-        for (unsigned int j = 0; j < vtx[i].vin.size(); j++)
+        BOOST_FOREACH (const CScriptID& scid, setAddresses)
         {
-            const CTxIn& in = vtx[i].vin[j];
-            CScript script = getPrevOut(in).scriptPubKey;
-            if (script.empty())
-                continue;
-            CScriptID scid = script.GetID();
-
-            // ignore inputs from the same address
-            if (std::find(Inputs.begin(), Inputs.end(), scid) != Inputs.end())
-                continue;
-            Inputs.push_back(scid);
-
-            std::vector<CDiskTxPos> Txs;
-            Read(scid, Txs);
-            Txs.push_back(pos);
-            if (!Write(scid, Txs))
-                return false;
+            mapDelta[scid].nTxs++;
+            if (fAdd)
+                batch.Write(std::make_pair('a', CAddressIndexKey(scid, block.nHeight, pos)), TxHash);
+            else
+                batch.Erase(std::make_pair('a', CAddressIndexKey(scid, block.nHeight, pos)));
+        }
+    }
 
-            // store 'redeemed in' information for each tx output
-            std::vector<std::pair<uint256, unsigned int> > Ins;
-            Read(in.prevout.hash, Ins);
-            if (in.prevout.n >= Ins.size())
-                Ins.resize(in.prevout.n + 1);
-            Ins[in.prevout.n] = std::pair<uint256, unsigned int>(TxHash, j);
-            Write(in.prevout.hash, Ins);
+    for (std::map<CScriptID, CAddressBalance>::const_iterator it = mapDelta.begin(); it != mapDelta.end(); ++it)
+    {
+        const CAddressBalance& delta = it->second;
+        CAddressBalance balance;
+        ReadBalance(it->first, balance);
+        if (fAdd) {
+            balance.nBalance += delta.nBalance;
+            balance.nReceived += delta.nReceived;
+            balance.nTxs += delta.nTxs;
+        } else {
+            balance.nBalance -= delta.nBalance;
+            balance.nReceived -= delta.nReceived;
+            balance.nTxs -= delta.nTxs;
         }
-        BOOST_FOREACH (const CTxOut& out, vtx[i].vout)
-        {
-            CScriptID scid = out.scriptPubKey.GetID();
-            std::vector<CDiskTxPos> Txs;
-            Read(scid, Txs);
-            Txs.push_back(pos);
-            if (!Write(scid, Txs))
-                return false;
+        if (balance.IsNull())
+            batch.Erase(std::make_pair('b', it->first));
+        else
+            batch.Write(std::make_pair('b', it->first), balance);
+    }
+
+    batch.Write(chLast, fAdd ? block.hashBlock : block.hashPrevBlock);
+    return WriteBatch(batch);
+}
+
+bool CAddressDB::GetTxs(std::vector<CDiskTxPos>& Txs, const CScriptID &Address)
+{
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << std::make_pair('a', Address);
+    std::string strPrefix = ssKeySet.str();
+
+    leveldb::Iterator *pcursor = NewIterator();
+    pcursor->Seek(strPrefix);
+    while (pcursor->Valid() && pcursor->key().starts_with(strPrefix)) {
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressIndexKey key;
+            ssKey >> chType >> key;
+            Txs.push_back(key.txpos);
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
         }
+        pcursor->Next();
     }
+    delete pcursor;
     return true;
 }
 
-bool CAddressDB::GetTxs(std::vector<CDiskTxPos>& Txs, const CScriptID &Address)
+bool CAddressDB::GetTxids(std::vector<std::pair<CAddressIndexKey, uint256> >& vTxids, const CScriptID &Address, unsigned int nStartHeight, unsigned int nEndHeight)
+{
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << std::make_pair('a', Address);
+    std::string strPrefix = ssKeySet.str();
+    ssKeySet.clear();
+    ssKeySet << std::make_pair('a', CAddressIndexKey(Address, nStartHeight, CDiskTxPos(CDiskBlockPos(0, 0), 0)));
+
+    leveldb::Iterator *pcursor = NewIterator();
+    pcursor->Seek(ssKeySet.str());
+    while (pcursor->Valid() && pcursor->key().starts_with(strPrefix)) {
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressIndexKey key;
+            uint256 txid;
+            ssKey >> chType >> key;
+            if (key.nHeight > nEndHeight)
+                break;
+            ssValue >> txid;
+            vTxids.push_back(std::make_pair(key, txid));
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+        pcursor->Next();
+    }
+    delete pcursor;
+    return true;
+}
+
+bool CAddressDB::GetUnspent(std::vector<std::pair<COutPoint, CAddressUnspentValue> >& vUnspent, const CScriptID &Address)
 {
-    return Read(Address, Txs);
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << std::make_pair('u', Address);
+    std::string strPrefix = ssKeySet.str();
+
+    leveldb::Iterator *pcursor = NewIterator();
+    pcursor->Seek(strPrefix);
+    while (pcursor->Valid() && pcursor->key().starts_with(strPrefix)) {
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressUnspentKey key;
+            CAddressUnspentValue value;
+            ssKey >> chType >> key;
+            ssValue >> value;
+            vUnspent.push_back(std::make_pair(key.outpoint, value));
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+        pcursor->Next();
+    }
+    delete pcursor;
+    return true;
+}
+
+bool CAddressDB::ReadBalance(const CScriptID& Address, CAddressBalance& balance)
+{
+    // addresses without entries have no record
+    balance = CAddressBalance();
+    Read(std::make_pair('b', Address), balance);
+    return true;
+}
+
+bool CAddressDB::ReadSpent(const COutPoint& Out, CAddressSpentValue& spent)
+{
+    return Read(std::make_pair('s', Out), spent);
 }
 
 bool CAddressDB::ReadNextIn(const COutPoint &Out, uint256& Hash, unsigned int& n)
 {
-    std::vector<std::pair<uint256, unsigned int> > Ins;
-    if (!Read(Out.hash, Ins) || Out.n >= Ins.size())
+    CAddressSpentValue spent;
+    if (!ReadSpent(Out, spent))
+        return false;
+    Hash = spent.txid;
+    n = spent.nIn;
+    return true;
+}
+
+bool CAddressDB::ReadBestBlock(uint256& hashBlock)
+{
+    return Read('B', hashBlock);
+}
+
+bool CAddressDB::ReadBuildCursor(uint256& hashBlock)
+{
+    return Read('C', hashBlock);
+}
+
+bool CAddressDB::WriteBuildCursor(const uint256& hashBlock)
+{
+    return Write('C', hashBlock);
+}
+
+bool CAddressDB::FinishBuild(const uint256& hashTip)
+{
+    CLevelDBBatch batch;
+    batch.Erase('C');
+    batch.Write('B', hashTip);
+    return WriteBatch(batch, true);
+}
+
+bool CAddressDB::Upgrade(bool& fRebuild)
+{
+    fRebuild = false;
+    int nVersion = 1;
+    Read('V', nVersion);
+    if (nVersion >= ADDRESS_INDEX_VERSION)
+        return true;
+
+    // Older layouts miss the balances and unspent outputs, and may hold entries of
+    // blocks no longer in the main chain; none of that can be derived from them.
+    printf("Dropping address index of version %d...\n", nVersion);
+    unsigned int nErased;
+    if (!Clear(nErased))
+        return false;
+    fRebuild = nErased > 0;
+    return true;
+}
+
+bool CAddressDB::Clear(unsigned int& nErased)
+{
+    int64 nStart = GetTimeMillis();
+
+    std::set<std::string> setKeep;
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey << 'R';
+        setKeep.insert(ssKey.str());
+        ssKey.clear();
+        ssKey << std::string("Faddrindex");
+        setKeep.insert(ssKey.str());
+        ssKey.clear();
+        ssKey << 'V';
+        setKeep.insert(ssKey.str());
+    }
+
+    leveldb::Iterator *pcursor = NewIterator();
+    pcursor->SeekToFirst();
+    CLevelDBBatch batch;
+    unsigned int nBatch = 0;
+    nErased = 0;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        leveldb::Slice slKey = pcursor->key();
+        std::string strKey(slKey.data(), slKey.size());
+        if (!setKeep.count(strKey)) {
+            batch.Erase(CFlatData((void*)&strKey[0], (void*)(&strKey[0] + strKey.size())));
+            nErased++;
+            nBatch++;
+        }
+        if (nBatch >= 100000) {
+            if (!WriteBatch(batch)) {
+                delete pcursor;
+                return false;
+            }
+            batch.Clear();
+            nBatch = 0;
+        }
+        pcursor->Next();
+    }
+    delete pcursor;
+
+    batch.Write('V', ADDRESS_INDEX_VERSION);
+    if (!WriteBatch(batch, true))
         return false;
-    Hash = Ins[Out.n].first;
-    n = Ins[Out.n].second;
+    printf("Erased %u address index records, %"PRI64d"ms\n", nErased, GetTimeMillis() - nStart);
     return true;
 }
 
+bool ReadAddressIndexBlock(CBlockIndex* pindex, CAddressIndexBlock& block)
+{
+    CBlock blk;
+    if (!blk.ReadFromDisk(pindex))
+        return error("%s() : ReadFromDisk failed for block %s", __PRETTY_FUNCTION__, pindex->GetBlockHash().ToString().c_str());
+    CDiskBlockPos posUndo = pindex->GetUndoPos();
+    if (posUndo.IsNull() || !block.undo.ReadFromDisk(posUndo, pindex->pprev->GetBlockHash()))
+        return error("%s() : no undo data for block %s", __PRETTY_FUNCTION__, pindex->GetBlockHash().ToString().c_str());
+
+    block.hashBlock = pindex->GetBlockHash();
+    block.hashPrevBlock = pindex->pprev->GetBlockHash();
+    block.nHeight = pindex->nHeight;
+    CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(blk.vtx.size()));
+    BOOST_FOREACH(const CTransaction& tx, blk.vtx) {
+        block.vpos.push_back(std::make_pair(tx.GetHash(), pos));
+        pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+    }
+    block.vtx.swap(blk.vtx);
+    return true;
+}
+
+bool CAddressDB::CatchUp(CBlockIndex* pindexTip)
+{
+    if (pindexTip == NULL || Exists('C'))
+        return true;
+
+    // nothing was added yet if there is no last block
+    uint256 hashBest = hashGenesisBlock;
+    ReadBestBlock(hashBest);
+    std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBest);
+    if (mi == mapBlockIndex.end())
+        return error("%s() : last indexed block %s is unknown", __PRETTY_FUNCTION__, hashBest.ToString().c_str());
+
+    // remove the blocks of a branch that was reorganized away
+    CBlockIndex* pindex = (*mi).second;
+    while (pindex->pprev && !pindex->IsInMainChain()) {
+        CAddressIndexBlock block;
+        if (!ReadAddressIndexBlock(pindex, block) || !RemoveBlock(block))
+            return false;
+        pindex = pindex->pprev;
+    }
+    if (pindex->nHeight >= pindexTip->nHeight)
+        return true;
+
+    printf("Catching up address index from height %d to %d...\n", pindex->nHeight, pindexTip->nHeight);
+    for (pindex = pindex->pnext; pindex; pindex = pindex->pnext) {
+        boost::this_thread::interruption_point();
+        CAddressIndexBlock block;
+        if (!ReadAddressIndexBlock(pindex, block) || !AddBlock(block))
+            return false;
+        if (pindex == pindexTip)
+            break;
+    }
+    return true;
+}
+
+CAddressIndexQueue::CAddressIndexQueue(CAddressDB& dbIn, unsigned int nMaxQueuedIn) :
+    db(dbIn), nMaxQueued(nMaxQueuedIn), fBusy(false), fStop(false)
+{
+    thread = boost::thread(boost::bind(&CAddressIndexQueue::ThreadIndex, this));
+}
+
+CAddressIndexQueue::~CAddressIndexQueue()
+{
+    Stop();
+}
+
+void CAddressIndexQueue::ThreadIndex()
+{
+    RenameThread("bitcoin-addrindex");
+    while (true) {
+        CAddressIndexBlock* pblock;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (queue.empty() && !fStop)
+                condWork.wait(lock);
+            if (queue.empty())
+                return;
+            pblock = queue.front();
+            queue.pop_front();
+            fBusy = true;
+        }
+        condDone.notify_all();
+
+        bool fOk = false;
+        try {
+            fOk = db.WriteBlock(*pblock);
+        } catch (std::exception &e) {
+            printf("CAddressIndexQueue::ThreadIndex() : %s\n", e.what());
+        }
+        if (!fOk)
+            AbortNode(_("Failed to write address index"));
+        delete pblock;
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fBusy = false;
+        }
+        condDone.notify_all();
+    }
+}
+
+void CAddressIndexQueue::Push(CAddressIndexBlock* pblock)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (queue.size() >= nMaxQueued && !fStop)
+            condDone.wait(lock);
+        if (!fStop) {
+            queue.push_back(pblock);
+            condWork.notify_one();
+            return;
+        }
+    }
+    // the thread is gone; write it ourselves
+    if (!db.WriteBlock(*pblock))
+        AbortNode(_("Failed to write address index"));
+    delete pblock;
+}
+
+void CAddressIndexQueue::Flush()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (!queue.empty() || fBusy)
+        condDone.wait(lock);
+}
+
+void CAddressIndexQueue::Stop()
+{
+    boost::this_thread::disable_interruption di;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
+    }
+    condWork.notify_all();
+    condDone.notify_all();
+    if (thread.joinable())
+        thread.join();
+}
+
 bool CAddressDB::WriteReindexing(bool fReindexing) {
     if (fReindexing)
         return Write('R', '1');
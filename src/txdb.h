@@ -8,6 +8,9 @@
 #include "main.h"
 #include "leveldb.h"
 
+#include <deque>
+#include <boost/thread.hpp>
+
 /** CCoinsView backed by the LevelDB coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
 {
@@ -25,6 +28,26 @@ public:
     bool GetStats(CCoinsStats &stats);
 };
 
+/** Transaction fee index entry (-txfeeindex) */
+struct CTxFeeInfo
+{
+    int64 nValueIn;       // sum of the spent outputs, 0 for coinbases
+    int64 nFee;           // 0 for coinbases
+    unsigned int nSize;
+    unsigned int nHeight; // height of the block holding the transaction
+
+    CTxFeeInfo() : nValueIn(0), nFee(0), nSize(0), nHeight(0) {}
+    CTxFeeInfo(const CTransaction& tx, int64 nValueInIn, unsigned int nSizeIn, unsigned int nHeightIn) :
+        nValueIn(nValueInIn), nFee(tx.IsCoinBase() ? 0 : nValueInIn - tx.GetValueOut()), nSize(nSizeIn), nHeight(nHeightIn) {}
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(VARINT(nValueIn));
+        READWRITE(VARINT(nFee));
+        READWRITE(VARINT(nSize));
+        READWRITE(VARINT(nHeight));
+    )
+};
+
 /** Access to the block database (blocks/index/) */
 class CBlockTreeDB : public CLevelDB
 {
@@ -35,6 +58,7 @@ private:
     void operator=(const CBlockTreeDB&);
 public:
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
+    bool ReadBlockIndex(const uint256& hash, CDiskBlockIndex& blockindex);
     bool ReadBestInvalidWork(CBigNum& bnBestInvalidWork);
     bool WriteBestInvalidWork(const CBigNum& bnBestInvalidWork);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
@@ -45,8 +69,13 @@ public:
     bool ReadReindexing(bool &fReindex);
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    bool ReadTxFeeInfo(const uint256 &txid, CTxFeeInfo &info);
+    bool WriteTxFeeIndex(const std::vector<std::pair<uint256, CTxFeeInfo> > &list);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
+    bool ReadIndexCursor(const std::string &name, uint256 &hashBlock);
+    bool WriteIndexCursor(const std::string &name, const uint256 &hashBlock);
+    bool EraseIndexCursor(const std::string &name);
     bool LoadBlockIndexGuts();
 	bool ReadSyncCheckpoint(uint256& hashCheckpoint);
     bool WriteSyncCheckpoint(uint256 hashCheckpoint);
@@ -54,18 +83,201 @@ public:
     bool WriteCheckpointPubKey(const std::string& strPubKey);
 };
 
-/** Transactions by address */
+/** Address index entry: the transaction at txpos, in the block at nHeight, pays to or
+ *  spends from scriptID. Integers are stored big-endian, so that the entries of an
+ *  address are ordered by height.
+ */
+struct CAddressIndexKey
+{
+    CScriptID scriptID;
+    unsigned int nHeight;
+    CDiskTxPos txpos;
+
+    CAddressIndexKey() : nHeight(0) {}
+    CAddressIndexKey(const CScriptID& scriptIDIn, unsigned int nHeightIn, const CDiskTxPos& txposIn) :
+        scriptID(scriptIDIn), nHeight(nHeightIn), txpos(txposIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 20 + 4 * 4;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, scriptID, nType, nVersion);
+        WriteBE32(s, nHeight);
+        WriteBE32(s, txpos.nFile);
+        WriteBE32(s, txpos.nPos);
+        WriteBE32(s, txpos.nTxOffset);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, scriptID, nType, nVersion);
+        nHeight = ReadBE32(s);
+        txpos.nFile = ReadBE32(s);
+        txpos.nPos = ReadBE32(s);
+        txpos.nTxOffset = ReadBE32(s);
+    }
+
+private:
+    template<typename Stream>
+    static void WriteBE32(Stream& s, unsigned int n)
+    {
+        unsigned char buf[4] = { (unsigned char)(n >> 24), (unsigned char)(n >> 16), (unsigned char)(n >> 8), (unsigned char)n };
+        s.write((const char*)buf, 4);
+    }
+
+    template<typename Stream>
+    static unsigned int ReadBE32(Stream& s)
+    {
+        unsigned char buf[4];
+        s.read((char*)buf, 4);
+        return ((unsigned int)buf[0] << 24) | ((unsigned int)buf[1] << 16) | ((unsigned int)buf[2] << 8) | buf[3];
+    }
+};
+
+/** Address index key of an unspent output paying to scriptID */
+struct CAddressUnspentKey
+{
+    CScriptID scriptID;
+    COutPoint outpoint;
+
+    CAddressUnspentKey() {}
+    CAddressUnspentKey(const CScriptID& scriptIDIn, const COutPoint& outpointIn) : scriptID(scriptIDIn), outpoint(outpointIn) {}
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(scriptID);
+        READWRITE(outpoint);
+    )
+};
+
+struct CAddressUnspentValue
+{
+    CTxOut txout;
+    unsigned int nHeight; // height of the block holding the output
+
+    CAddressUnspentValue() : nHeight(0) {}
+    CAddressUnspentValue(const CTxOut& txoutIn, unsigned int nHeightIn) : txout(txoutIn), nHeight(nHeightIn) {}
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(txout);
+        READWRITE(nHeight);
+    )
+};
+
+/** The main chain input spending an output */
+struct CAddressSpentValue
+{
+    uint256 txid;
+    unsigned int nIn;
+    unsigned int nHeight;     // height of the block holding the spending transaction
+    unsigned int nPrevHeight; // height of the block holding the spent output
+
+    CAddressSpentValue() : nIn(0), nHeight(0), nPrevHeight(0) {}
+    CAddressSpentValue(const uint256& txidIn, unsigned int nInIn, unsigned int nHeightIn, unsigned int nPrevHeightIn) :
+        txid(txidIn), nIn(nInIn), nHeight(nHeightIn), nPrevHeight(nPrevHeightIn) {}
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(txid);
+        READWRITE(nIn);
+        READWRITE(nHeight);
+        READWRITE(nPrevHeight);
+    )
+};
+
+struct CAddressBalance
+{
+    int64 nBalance;    // sum of the unspent outputs
+    int64 nReceived;   // sum of all outputs
+    unsigned int nTxs; // number of transactions paying to or spending from the address
+
+    CAddressBalance() : nBalance(0), nReceived(0), nTxs(0) {}
+
+    bool IsNull() const { return nBalance == 0 && nReceived == 0 && nTxs == 0; }
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(nBalance);
+        READWRITE(nReceived);
+        READWRITE(nTxs);
+    )
+};
+
+/** A block connected to or disconnected from the main chain, as handed to the address
+ *  index. The undo data holds the outputs spent by the block, so no previous
+ *  transactions have to be looked up.
+ */
+struct CAddressIndexBlock
+{
+    uint256 hashBlock;
+    uint256 hashPrevBlock;
+    unsigned int nHeight;
+    bool fDisconnect;
+    std::vector<CTransaction> vtx;
+    std::vector<std::pair<uint256, CDiskTxPos> > vpos; // (txid, position) for each of vtx
+    CBlockUndo undo;
+
+    CAddressIndexBlock() : nHeight(0), fDisconnect(false) {}
+};
+
+/** Transactions, balances and unspent outputs by address, for the main chain only.
+ *
+ * Layout (version 4):
+ *  'a' + CAddressIndexKey   -> txid                  transaction involving an address
+ *  'u' + CAddressUnspentKey -> CAddressUnspentValue  unspent output of an address
+ *  'b' + CScriptID          -> CAddressBalance       totals of an address
+ *  's' + COutPoint          -> CAddressSpentValue    transaction input spending an output
+ *  'B'                      -> block hash            last block added
+ *  'C'                      -> block hash            last block added by a background build
+ * Blocks are added and removed in chain order, each in one batch together with 'B' or
+ * 'C', so a reorganization leaves no entries of the old branch behind. Older layouts
+ * have no balances or unspent outputs (version 3: no txids); Upgrade() drops them for
+ * a rebuild.
+ */
 class CAddressDB : public CLevelDB
 {
     CAddressDB(const CAddressDB&);
     void operator=(const CAddressDB&);
 
+    bool UpdateBlock(const CAddressIndexBlock& block, bool fAdd, bool fBuild);
+
 public:
     CAddressDB(size_t nCacheSize, bool fMemory, bool fWipe);
 
-    bool AddTx(const std::vector<CTransaction>& vtx, const std::vector<std::pair<uint256, CDiskTxPos> >& vpos);
+    // Add a block connected on top of the last block added, or remove the last block
+    // added. Adding the last block added again does nothing. A background build
+    // tracks its own last block (fBuild), see CIndexBuilder.
+    bool AddBlock(const CAddressIndexBlock& block, bool fBuild = false);
+    bool RemoveBlock(const CAddressIndexBlock& block, bool fBuild = false);
+    // AddBlock or RemoveBlock, as block.fDisconnect says
+    bool WriteBlock(const CAddressIndexBlock& block);
+
     bool GetTxs(std::vector<CDiskTxPos>& Txs, const CScriptID& Address);
+    // Entries and txids of the transactions of an address in blocks nStartHeight to nEndHeight
+    bool GetTxids(std::vector<std::pair<CAddressIndexKey, uint256> >& vTxids, const CScriptID& Address, unsigned int nStartHeight, unsigned int nEndHeight);
+    bool GetUnspent(std::vector<std::pair<COutPoint, CAddressUnspentValue> >& vUnspent, const CScriptID& Address);
+    bool ReadBalance(const CScriptID& Address, CAddressBalance& balance);
+    bool ReadSpent(const COutPoint& Out, CAddressSpentValue& spent);
     bool ReadNextIn(const COutPoint& Out, uint256& Hash, unsigned int &n);
+    bool ReadBestBlock(uint256& hashBlock);
+
+    // Progress of a background build, see CIndexBuilder; FinishBuild also records
+    // hashTip as the last block added
+    bool ReadBuildCursor(uint256& hashBlock);
+    bool WriteBuildCursor(const uint256& hashBlock);
+    bool FinishBuild(const uint256& hashTip);
+
+    // Drop an index written in an older layout; fRebuild is set if it held any entries
+    bool Upgrade(bool& fRebuild);
+    // Erase all entries, before building the index from scratch
+    bool Clear(unsigned int& nErased);
+
+    // Bring the index from the last block added to pindexTip, reading blocks and their
+    // undo data from disk; used after blocks queued for indexing were lost. Does nothing
+    // while a background build is in progress, which covers those blocks.
+    bool CatchUp(CBlockIndex* pindexTip);
 
     bool WriteReindexing(bool fReindex);
     bool ReadReindexing(bool &fReindex);
@@ -74,6 +286,42 @@ public:
     bool ReadEnable(bool &fValue);
 };
 
+/** Writes blocks to the address index from a background thread, so that connecting
+ *  a block only has to queue it. At most nMaxQueued blocks wait at a time; Push
+ *  blocks beyond that.
+ */
+class CAddressIndexQueue
+{
+private:
+    CAddressDB& db;
+    boost::mutex mutex;
+    boost::condition_variable condWork;
+    boost::condition_variable condDone;
+    std::deque<CAddressIndexBlock*> queue;
+    unsigned int nMaxQueued;
+    bool fBusy;
+    bool fStop;
+    boost::thread thread;
+
+    void ThreadIndex();
+
+public:
+    CAddressIndexQueue(CAddressDB& dbIn, unsigned int nMaxQueuedIn = 64);
+    ~CAddressIndexQueue();
+
+    // Queue a block to add or remove; takes ownership
+    void Push(CAddressIndexBlock* pblock);
+
+    // Wait until all queued blocks are written
+    void Flush();
+
+    // Write the remaining blocks and stop the thread
+    void Stop();
+};
+
+// Read a block and its undo data as ConnectBlock hands it to the address index
+bool ReadAddressIndexBlock(CBlockIndex* pindex, CAddressIndexBlock& block);
+
 CTxOut getPrevOut(const CTxIn& In);
 void getNextIn(const COutPoint& Out, uint256& Hash, unsigned int& n);
 // Return transaction in tx, and if it was found inside a block, its header is placed in block
@@ -9,6 +9,7 @@
 #include "ui_interface.h"
 #include "base58.h"
 #include "coincontrol.h"
+#include "coinselection.h"
 #include <boost/algorithm/string/replace.hpp>
 
 using namespace std;
@@ -19,15 +20,6 @@ using namespace std;
 // mapWallet
 //
 
-struct CompareValueOnly
-{
-    bool operator()(const pair<int64, pair<const CWalletTx*, unsigned int> >& t1,
-                    const pair<int64, pair<const CWalletTx*, unsigned int> >& t2) const
-    {
-        return t1.first < t2.first;
-    }
-};
-
 CPubKey CWallet::GenerateNewKey()
 {
     bool fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
@@ -83,11 +75,94 @@ bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    {
+        // outputs to the script that are already in the wallet became ours
+        LOCK(cs_wallet);
+        fUnspentDirty = true;
+    }
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
 }
 
+// Add keys and redeem scripts, and the labels of their addresses, in a single database
+// transaction instead of one per record. Keys and scripts already in the wallet are skipped.
+bool CWallet::ImportKeys(const std::vector<CKey>& vKeys, const std::vector<CScript>& vScripts, const std::map<CTxDestination, std::string>& mapLabels)
+{
+    bool fOk = true;
+    std::vector<std::pair<CTxDestination, ChangeType> > vChanged;
+    {
+        LOCK(cs_wallet);
+        CWalletDB* pwalletdb = NULL;
+        if (fFileBacked)
+        {
+            pwalletdb = new CWalletDB(strWalletFile);
+            if (!pwalletdb->TxnBegin())
+            {
+                delete pwalletdb;
+                return false;
+            }
+        }
+
+        // encrypted keys are written by AddCryptedKey, through pwalletdbEncryption
+        pwalletdbEncryption = pwalletdb;
+        BOOST_FOREACH(const CKey& key, vKeys)
+        {
+            CPubKey pubkey = key.GetPubKey();
+            if (HaveKey(pubkey.GetID()))
+                continue;
+            if (!CCryptoKeyStore::AddKeyPubKey(key, pubkey) ||
+                (pwalletdb && !IsCrypted() && !pwalletdb->WriteKey(pubkey, key.GetPrivKey())))
+            {
+                fOk = false;
+                break;
+            }
+        }
+        pwalletdbEncryption = NULL;
+
+        BOOST_FOREACH(const CScript& script, vScripts)
+        {
+            if (!fOk)
+                break;
+            CScriptID scriptID = script.GetID();
+            if (HaveCScript(scriptID))
+                continue;
+            if (!CCryptoKeyStore::AddCScript(script) ||
+                (pwalletdb && !pwalletdb->WriteCScript(scriptID, script)))
+                fOk = false;
+        }
+
+        for (std::map<CTxDestination, std::string>::const_iterator it = mapLabels.begin(); fOk && it != mapLabels.end(); ++it)
+        {
+            vChanged.push_back(make_pair((*it).first, mapAddressBook.count((*it).first) ? CT_UPDATED : CT_NEW));
+            mapAddressBook[(*it).first] = (*it).second;
+            if (pwalletdb && !pwalletdb->WriteName(CBitcoinAddress((*it).first).ToString(), (*it).second))
+                fOk = false;
+        }
+
+        if (pwalletdb)
+        {
+            if (fOk)
+                fOk = pwalletdb->TxnCommit();
+            else
+                pwalletdb->TxnAbort();
+            delete pwalletdb;
+        }
+
+        // outputs to the new keys that are already in the wallet became ours
+        fUnspentDirty = true;
+    }
+
+    if (!fOk)
+        return false;
+    for (unsigned int i = 0; i < vChanged.size(); i++)
+    {
+        const CTxDestination& dest = vChanged[i].first;
+        NotifyAddressBookChanged(this, dest, mapLabels.find(dest)->second, ::IsMine(*this, dest), vChanged[i].second);
+    }
+    return true;
+}
+
 bool CWallet::Unlock(const SecureString& strWalletPassphrase)
 {
     if (!IsLocked())
@@ -311,28 +386,46 @@ int64 CWallet::IncOrderPosNext(CWalletDB *pwalletdb)
     return nRet;
 }
 
-CWallet::TxItems CWallet::OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount)
+void CWallet::BuildOrderedTxItems()
 {
-    CWalletDB walletdb(strWalletFile);
-
-    // First: get all CWalletTx and CAccountingEntry into a sorted-by-order multimap.
-    TxItems txOrdered;
-
-    // Note: maintaining indices in the database of (account,time) --> txid and (account, time) --> acentry
-    // would make this much faster for applications that do this a lot.
+    LOCK(cs_wallet);
+    wtxOrdered.clear();
+    mapTxByBlock.clear();
     for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
     {
         CWalletTx* wtx = &((*it).second);
-        txOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
+        wtxOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
+        mapTxByBlock.insert(make_pair(wtx->hashBlock, wtx));
     }
-    acentries.clear();
-    walletdb.ListAccountCreditDebit(strAccount, acentries);
-    BOOST_FOREACH(CAccountingEntry& entry, acentries)
+    laccentries.clear();
+    if (fFileBacked)
+        CWalletDB(strWalletFile).ListAccountCreditDebit("*", laccentries);
+    BOOST_FOREACH(CAccountingEntry& entry, laccentries)
     {
-        txOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+        wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
     }
+}
 
-    return txOrdered;
+bool CWallet::AddAccountingEntry(const CAccountingEntry& acentry, CWalletDB& walletdb)
+{
+    if (!walletdb.WriteAccountingEntry(acentry))
+        return false;
+
+    LOCK(cs_wallet);
+    laccentries.push_back(acentry);
+    CAccountingEntry& entry = laccentries.back();
+    wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+    return true;
+}
+
+static void EraseTxByBlock(std::multimap<uint256, CWalletTx*>& mapTxByBlock, CWalletTx* pwtx)
+{
+    pair<multimap<uint256, CWalletTx*>::iterator, multimap<uint256, CWalletTx*>::iterator> range = mapTxByBlock.equal_range(pwtx->hashBlock);
+    for (multimap<uint256, CWalletTx*>::iterator it = range.first; it != range.second; ++it)
+        if ((*it).second == pwtx) {
+            mapTxByBlock.erase(it);
+            break;
+        }
 }
 
 void CWallet::WalletUpdateSpent(const CTransaction &tx)
@@ -354,6 +447,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx)
                 {
                     printf("WalletUpdateSpent found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkSpent(txin.prevout.n);
+                    UpdateUnspent(wtx);
                     wtx.WriteToDisk();
                     NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                 }
@@ -368,9 +462,43 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        // which outputs are ours may have changed as well
+        fUnspentDirty = true;
     }
 }
 
+bool CWallet::HasUnspentOutput(const CWalletTx& wtx) const
+{
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+        if (!wtx.IsSpent(i) && IsMine(wtx.vout[i]))
+            return true;
+    return false;
+}
+
+// Call with cs_wallet held whenever wtx was added, or some of its outputs were spent or confirmed
+void CWallet::UpdateUnspent(const CWalletTx& wtx)
+{
+    nUnspentUpdates++;
+    if (fUnspentDirty)
+        return;
+    if (HasUnspentOutput(wtx))
+        setUnspentTx.insert(wtx.GetHash());
+    else
+        setUnspentTx.erase(wtx.GetHash());
+}
+
+void CWallet::CheckUnspent() const
+{
+    if (!fUnspentDirty)
+        return;
+    setUnspentTx.clear();
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        if (HasUnspentOutput((*it).second))
+            setUnspentTx.insert(setUnspentTx.end(), (*it).first);
+    fUnspentDirty = false;
+    pindexBalances = NULL;
+}
+
 bool CWallet::AddToWallet(const CWalletTx& wtxIn)
 {
     uint256 hash = wtxIn.GetHash();
@@ -385,6 +513,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         {
             wtx.nTimeReceived = GetAdjustedTime();
             wtx.nOrderPos = IncOrderPosNext();
+            wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
+            mapTxByBlock.insert(make_pair(wtx.hashBlock, &wtx));
 
             wtx.nTimeSmart = wtx.nTimeReceived;
             if (wtxIn.hashBlock != 0)
@@ -396,9 +526,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
                     {
                         // Tolerate times up to the last timestamp in the wallet not more than 5 minutes into the future
                         int64 latestTolerated = latestNow + 300;
-                        std::list<CAccountingEntry> acentries;
-                        TxItems txOrdered = OrderedTxItems(acentries);
-                        for (TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+                        for (TxItems::reverse_iterator it = wtxOrdered.rbegin(); it != wtxOrdered.rend(); ++it)
                         {
                             CWalletTx *const pwtx = (*it).second.first;
                             if (pwtx == &wtx)
@@ -439,7 +567,9 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
             // Merge
             if (wtxIn.hashBlock != 0 && wtxIn.hashBlock != wtx.hashBlock)
             {
+                EraseTxByBlock(mapTxByBlock, &wtx);
                 wtx.hashBlock = wtxIn.hashBlock;
+                mapTxByBlock.insert(make_pair(wtx.hashBlock, &wtx));
                 fUpdated = true;
             }
             if (wtxIn.nIndex != -1 && (wtxIn.vMerkleBranch != wtx.vMerkleBranch || wtxIn.nIndex != wtx.nIndex))
@@ -455,6 +585,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
             }
             fUpdated |= wtx.UpdateSpent(wtxIn.vfSpent);
         }
+        UpdateUnspent(wtx);
 
         //// debug print
         printf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString().c_str(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
@@ -524,14 +655,43 @@ bool CWallet::AddToWalletIfInvolvingMe(const uint256 &hash, const CTransaction&
     return false;
 }
 
+bool CWallet::SyncTransaction(const uint256 &hash, const CTransaction& tx, const CBlock* pblock, bool fUpdate)
+{
+    // Most transactions don't involve the wallet; only those that do need cs_main
+    {
+        LOCK(cs_wallet);
+        if (!mapWallet.count(hash) && !IsMine(tx) && !IsFromMe(tx))
+        {
+            WalletUpdateSpent(tx);
+            return false;
+        }
+    }
+    LOCK(cs_main);
+    return AddToWalletIfInvolvingMe(hash, tx, pblock, fUpdate);
+}
+
 bool CWallet::EraseFromWallet(uint256 hash)
 {
     if (!fFileBacked)
         return false;
     {
         LOCK(cs_wallet);
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            CWalletTx* pwtx = &(*mi).second;
+            pair<TxItems::iterator, TxItems::iterator> range = wtxOrdered.equal_range(pwtx->nOrderPos);
+            for (TxItems::iterator it = range.first; it != range.second; ++it)
+                if ((*it).second.first == pwtx) {
+                    wtxOrdered.erase(it);
+                    break;
+                }
+            EraseTxByBlock(mapTxByBlock, pwtx);
+        }
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
+        setUnspentTx.erase(hash);
+        nUnspentUpdates++;
     }
     return true;
 }
@@ -711,7 +871,8 @@ void CWalletTx::GetAccountAmounts(const string& strAccount, int64& nReceived,
 
 void CWalletTx::AddSupportingTransactions()
 {
-    vtxPrev.clear();
+    vector<CMerkleTx>& vtx = vtxPrev.Get();
+    vtx.clear();
 
     const int COPY_DEPTH = 3;
     if (SetMerkleBranch() < COPY_DEPTH)
@@ -736,7 +897,7 @@ void CWalletTx::AddSupportingTransactions()
                 if (mi != pwallet->mapWallet.end())
                 {
                     tx = (*mi).second;
-                    BOOST_FOREACH(const CMerkleTx& txWalletPrev, (*mi).second.vtxPrev)
+                    BOOST_FOREACH(const CMerkleTx& txWalletPrev, (*mi).second.vtxPrev.Get())
                         mapWalletPrev[txWalletPrev.GetHash()] = &txWalletPrev;
                 }
                 else if (mapWalletPrev.count(hash))
@@ -749,7 +910,7 @@ void CWalletTx::AddSupportingTransactions()
                 }
 
                 int nDepth = tx.SetMerkleBranch();
-                vtxPrev.push_back(tx);
+                vtx.push_back(tx);
 
                 if (nDepth < COPY_DEPTH)
                 {
@@ -760,7 +921,7 @@ void CWalletTx::AddSupportingTransactions()
         }
     }
 
-    reverse(vtxPrev.begin(), vtxPrev.end());
+    reverse(vtx.begin(), vtx.end());
 }
 
 bool CWalletTx::WriteToDisk()
@@ -768,28 +929,178 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+// Collect what a transaction must touch to possibly be ours: the key IDs, public keys and
+// script IDs of the keystore go into a bloom filter, matched against the data pushed by
+// output scripts. Wallet transactions are kept in an exact set, as a large wallet would
+// saturate a filter of the protocol's maximum size; their spends are matched by prevout.
+void CWallet::GetRescanFilter(CBloomFilter& filter, std::set<uint256>& setWalletTx) const
+{
+    LOCK(cs_wallet);
+
+    std::set<CKeyID> setKeys;
+    GetKeys(setKeys);
+    std::vector<CScriptID> vScripts;
+    {
+        LOCK(cs_KeyStore);
+        for (ScriptMap::const_iterator mi = mapScripts.begin(); mi != mapScripts.end(); mi++)
+            vScripts.push_back((*mi).first);
+    }
+
+    filter = CBloomFilter(std::max((unsigned int)1, (unsigned int)(2 * setKeys.size() + vScripts.size())), 0.000001, GetRand(0xFFFFFFFF), BLOOM_UPDATE_NONE);
+    BOOST_FOREACH(const CKeyID& keyID, setKeys)
+    {
+        filter.insert(std::vector<unsigned char>(keyID.begin(), keyID.end()));
+        CPubKey pubkey;
+        if (GetPubKey(keyID, pubkey))
+            filter.insert(std::vector<unsigned char>(pubkey.begin(), pubkey.end()));
+    }
+    BOOST_FOREACH(const CScriptID& scriptID, vScripts)
+        filter.insert(std::vector<unsigned char>(scriptID.begin(), scriptID.end()));
+
+    setWalletTx.clear();
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        setWalletTx.insert((*it).first);
+}
+
+// Blocks of a rescan read from disk ahead of the wallet, and the transactions
+// in them that passed the prefilter
+struct CRescanBatch
+{
+    std::vector<CBlockIndex*> vpindex;
+    std::vector<CBlock> vblock;
+    std::vector<std::vector<unsigned int> > vMatches;
+
+    void Set(CBlockIndex* pindexStart, unsigned int nMax)
+    {
+        vpindex.clear();
+        for (CBlockIndex* pindex = pindexStart; pindex && vpindex.size() < nMax; pindex = pindex->pnext)
+            vpindex.push_back(pindex);
+        vblock.assign(vpindex.size(), CBlock());
+        vMatches.assign(vpindex.size(), std::vector<unsigned int>());
+    }
+
+    void swap(CRescanBatch& other)
+    {
+        vpindex.swap(other.vpindex);
+        vblock.swap(other.vblock);
+        vMatches.swap(other.vMatches);
+    }
+};
+
+// Reading and deserializing the blocks, and matching their transactions against the
+// filter, take no lock: the filter and the set of wallet transactions are only read
+void static ReadRescanBlocks(CRescanBatch* pbatch, const CBloomFilter* pfilter, const std::set<uint256>* psetWalletTx, unsigned int nBegin, unsigned int nStep)
+{
+    for (unsigned int i = nBegin; i < pbatch->vpindex.size(); i += nStep)
+    {
+        CBlock& block = pbatch->vblock[i];
+        if (!block.ReadFromDisk(pbatch->vpindex[i]))
+            continue;
+        for (unsigned int j = 0; j < block.vtx.size(); j++)
+        {
+            const CTransaction& tx = block.vtx[j];
+            bool fMatch = psetWalletTx->count(tx.GetHash()) > 0;
+            for (unsigned int k = 0; !fMatch && k < tx.vin.size(); k++)
+                fMatch = psetWalletTx->count(tx.vin[k].prevout.hash) > 0;
+            for (unsigned int k = 0; !fMatch && k < tx.vout.size(); k++)
+            {
+                const CScript& script = tx.vout[k].scriptPubKey;
+                CScript::const_iterator pc = script.begin();
+                std::vector<unsigned char> data;
+                opcodetype opcode;
+                while (!fMatch && pc < script.end() && script.GetOp(pc, opcode, data))
+                    fMatch = !data.empty() && pfilter->contains(data);
+            }
+            if (fMatch)
+                pbatch->vMatches[i].push_back(j);
+        }
+    }
+}
+
+// blocks read ahead by the workers of a rescan while the wallet processes the previous ones
+static const unsigned int RESCAN_BATCH_BLOCKS = 128;
+
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
+// Worker threads read the blocks ahead and prefilter their transactions;
+// cs_wallet is only taken for the transactions that may be ours.
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
-
-    CBlockIndex* pindex = pindexStart;
+    if (!pindexStart)
+        return ret;
+
+    int64 nStart = GetTimeMillis();
+    int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS));
+
+    // The filter is built once: keys are not added during a rescan. Transactions added
+    // by the rescan itself are tracked in setFound, to find the ones spending them.
+    CBloomFilter filter;
+    std::set<uint256> setWalletTx, setFound;
+    GetRescanFilter(filter, setWalletTx);
+
+    int nHeightStart = pindexStart->nHeight;
+    int nHeightEnd = std::max(nHeightStart, nBestHeight);
+    int64 nLastProgress = nStart;
+    unsigned int nBlocks = 0, nCandidates = 0;
+
+    CRescanBatch batch, batchNext;
+    batch.Set(pindexStart, RESCAN_BATCH_BLOCKS);
+    ReadRescanBlocks(&batch, &filter, &setWalletTx, 0, 1);
+    while (!batch.vpindex.empty() && !fAbortRescan)
     {
-        LOCK(cs_wallet);
-        while (pindex)
+        boost::this_thread::interruption_point();
+
+        // read the next batch while this one is processed
+        batchNext.Set(batch.vpindex.back()->pnext, RESCAN_BATCH_BLOCKS);
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&ReadRescanBlocks, &batchNext, &filter, &setWalletTx, i, nThreads));
+
+        for (unsigned int i = 0; i < batch.vpindex.size(); i++)
         {
-            CBlock block;
-            block.ReadFromDisk(pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            const CBlock& block = batch.vblock[i];
+            const std::vector<unsigned int>& vMatches = batch.vMatches[i];
+            std::vector<unsigned int>::const_iterator itMatch = vMatches.begin();
+            for (unsigned int j = 0; j < block.vtx.size(); j++)
             {
-                if (AddToWalletIfInvolvingMe(tx.GetHash(), tx, &block, fUpdate))
+                const CTransaction& tx = block.vtx[j];
+                bool fMatch = (itMatch != vMatches.end() && *itMatch == j);
+                if (fMatch)
+                    itMatch++;
+                for (unsigned int k = 0; !fMatch && !setFound.empty() && k < tx.vin.size(); k++)
+                    fMatch = setFound.count(tx.vin[k].prevout.hash) > 0;
+                if (!fMatch)
+                    continue;
+
+                nCandidates++;
+                uint256 hash = tx.GetHash();
+                if (AddToWalletIfInvolvingMe(hash, tx, &block, fUpdate))
+                {
                     ret++;
+                    if (!setWalletTx.count(hash))
+                        setFound.insert(hash);
+                }
             }
-            pindex = pindex->pnext;
         }
+        nBlocks += batch.vpindex.size();
+
+        int64 nNow = GetTimeMillis();
+        if (nNow - nLastProgress > 10000)
+        {
+            int nHeight = batch.vpindex.back()->nHeight;
+            printf("Rescanning... block %d of %d (%d%%)\n", nHeight, nHeightEnd,
+                   (int)(100 * (int64)(nHeight - nHeightStart) / std::max(1, nHeightEnd - nHeightStart)));
+            nLastProgress = nNow;
+        }
+
+        threadGroup.join_all();
+        batch.swap(batchNext);
     }
+
+    printf("ScanForWalletTransactions : %u blocks, %u candidate txs, %d found%s  %"PRI64d"ms\n",
+           nBlocks, nCandidates, ret, fAbortRescan ? " (aborted)" : "", GetTimeMillis() - nStart);
     return ret;
 }
 
@@ -828,6 +1139,7 @@ void CWallet::ReacceptWalletTransactions()
                 {
                     printf("ReacceptWalletTransactions found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkDirty();
+                    UpdateUnspent(wtx);
                     wtx.WriteToDisk();
                 }
             }
@@ -849,7 +1161,7 @@ void CWallet::ReacceptWalletTransactions()
 
 void CWalletTx::RelayWalletTransaction()
 {
-    BOOST_FOREACH(const CMerkleTx& tx, vtxPrev)
+    BOOST_FOREACH(const CMerkleTx& tx, vtxPrev.Get())
     {
         // Important: versions of bitcoin before 0.8.6 had a bug that inserted
         // empty transactions into the vtxPrev, which will cause the node to be
@@ -919,49 +1231,50 @@ void CWallet::ResendWalletTransactions()
 //
 
 
-int64 CWallet::GetBalance() const
+// Compute the three balances in one pass over the transactions with unspent outputs.
+// They only change with the wallet transactions or the chain tip, so the result is
+// kept until either changes. Call with cs_wallet held.
+void CWallet::CacheBalances() const
 {
-    int64 nTotal = 0;
+    CheckUnspent();
+    if (pindexBalances != NULL && pindexBalances == pindexBest && nBalancesUpdate == nUnspentUpdates)
+        return;
+
+    nBalanceCached = 0;
+    nUnconfirmedBalanceCached = 0;
+    nImmatureBalanceCached = 0;
+    BOOST_FOREACH(const uint256& hash, setUnspentTx)
     {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit();
-        }
+        const CWalletTx* pcoin = &mapWallet.find(hash)->second;
+        if (pcoin->IsConfirmed())
+            nBalanceCached += pcoin->GetAvailableCredit();
+        else
+            nUnconfirmedBalanceCached += pcoin->GetAvailableCredit();
+        nImmatureBalanceCached += pcoin->GetImmatureCredit();
     }
+    pindexBalances = pindexBest;
+    nBalancesUpdate = nUnspentUpdates;
+}
 
-    return nTotal;
+int64 CWallet::GetBalance() const
+{
+    LOCK(cs_wallet);
+    CacheBalances();
+    return nBalanceCached;
 }
 
 int64 CWallet::GetUnconfirmedBalance() const
 {
-    int64 nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    LOCK(cs_wallet);
+    CacheBalances();
+    return nUnconfirmedBalanceCached;
 }
 
 int64 CWallet::GetImmatureBalance() const
 {
-    int64 nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    LOCK(cs_wallet);
+    CacheBalances();
+    return nImmatureBalanceCached;
 }
 
 // populate vCoins with vector of spendable COutputs
@@ -971,8 +1284,10 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        CheckUnspent();
+        BOOST_FOREACH(const uint256& hash, setUnspentTx)
         {
+            map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
             const CWalletTx* pcoin = &(*it).second;
 
             if (!pcoin->IsFinal())
@@ -994,149 +1309,12 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
     }
 }
 
-static void ApproximateBestSubset(vector<pair<int64, pair<const CWalletTx*,unsigned int> > >vValue, int64 nTotalLower, int64 nTargetValue,
-                                  vector<char>& vfBest, int64& nBest, int iterations = 1000)
-{
-    vector<char> vfIncluded;
-
-    vfBest.assign(vValue.size(), true);
-    nBest = nTotalLower;
-
-    seed_insecure_rand();
-
-    for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++)
-    {
-        vfIncluded.assign(vValue.size(), false);
-        int64 nTotal = 0;
-        bool fReachedTarget = false;
-        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
-        {
-            for (unsigned int i = 0; i < vValue.size(); i++)
-            {
-                //The solver here uses a randomized algorithm,
-                //the randomness serves no real security purpose but is just
-                //needed to prevent degenerate behavior and it is important
-                //that the rng fast. We do not use a constant random sequence,
-                //because there may be some privacy improvement by making
-                //the selection random.
-                if (nPass == 0 ? insecure_rand()&1 : !vfIncluded[i])
-                {
-                    nTotal += vValue[i].first;
-                    vfIncluded[i] = true;
-                    if (nTotal >= nTargetValue)
-                    {
-                        fReachedTarget = true;
-                        if (nTotal < nBest)
-                        {
-                            nBest = nTotal;
-                            vfBest = vfIncluded;
-                        }
-                        nTotal -= vValue[i].first;
-                        vfIncluded[i] = false;
-                    }
-                }
-            }
-        }
-    }
-}
-
-bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins,
+bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins,
                                  set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
 {
-    setCoinsRet.clear();
-    nValueRet = 0;
-
-    // List of values less than target
-    pair<int64, pair<const CWalletTx*,unsigned int> > coinLowestLarger;
-    coinLowestLarger.first = std::numeric_limits<int64>::max();
-    coinLowestLarger.second.first = NULL;
-    vector<pair<int64, pair<const CWalletTx*,unsigned int> > > vValue;
-    int64 nTotalLower = 0;
-
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
-
-    BOOST_FOREACH(COutput output, vCoins)
-    {
-        const CWalletTx *pcoin = output.tx;
-
-        if (output.nDepth < (pcoin->IsFromMe() ? nConfMine : nConfTheirs))
-            continue;
-
-        int i = output.i;
-        int64 n = pcoin->vout[i].nValue;
-
-        pair<int64,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(pcoin, i));
-
-        if (n == nTargetValue)
-        {
-            setCoinsRet.insert(coin.second);
-            nValueRet += coin.first;
-            return true;
-        }
-        else if (n < nTargetValue + CENT)
-        {
-            vValue.push_back(coin);
-            nTotalLower += n;
-        }
-        else if (n < coinLowestLarger.first)
-        {
-            coinLowestLarger = coin;
-        }
-    }
-
-    if (nTotalLower == nTargetValue)
-    {
-        for (unsigned int i = 0; i < vValue.size(); ++i)
-        {
-            setCoinsRet.insert(vValue[i].second);
-            nValueRet += vValue[i].first;
-        }
-        return true;
-    }
-
-    if (nTotalLower < nTargetValue)
-    {
-        if (coinLowestLarger.second.first == NULL)
-            return false;
-        setCoinsRet.insert(coinLowestLarger.second);
-        nValueRet += coinLowestLarger.first;
-        return true;
-    }
-
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
-    vector<char> vfBest;
-    int64 nBest;
-
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
-    if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
-
-    // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
-    //                                   or the next bigger coin is closer), return the bigger coin
-    if (coinLowestLarger.second.first &&
-        ((nBest != nTargetValue && nBest < nTargetValue + CENT) || coinLowestLarger.first <= nBest))
-    {
-        setCoinsRet.insert(coinLowestLarger.second);
-        nValueRet += coinLowestLarger.first;
-    }
-    else {
-        for (unsigned int i = 0; i < vValue.size(); i++)
-            if (vfBest[i])
-            {
-                setCoinsRet.insert(vValue[i].second);
-                nValueRet += vValue[i].first;
-            }
-
-        //// debug print
-        printf("SelectCoins() best subset: ");
-        for (unsigned int i = 0; i < vValue.size(); i++)
-            if (vfBest[i])
-                printf("%s ", FormatMoney(vValue[i].first).c_str());
-        printf("total %s\n", FormatMoney(nBest).c_str());
-    }
-
-    return true;
+    vector<CInputCoin> vSorted;
+    SortCoins(vCoins, vSorted);
+    return SelectCoinsFromPool(CCoinPool(vSorted, nConfMine, nConfTheirs), nTargetValue, setCoinsRet, nValueRet);
 }
 
 bool CWallet::SelectCoins(int64 nTargetValue, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet, const CCoinControl* coinControl) const
@@ -1155,9 +1333,12 @@ bool CWallet::SelectCoins(int64 nTargetValue, set<pair<const CWalletTx*,unsigned
         return (nValueRet >= nTargetValue);
     }
 
-    return (SelectCoinsMinConf(nTargetValue, 1, 6, vCoins, setCoinsRet, nValueRet) ||
-            SelectCoinsMinConf(nTargetValue, 1, 1, vCoins, setCoinsRet, nValueRet) ||
-            SelectCoinsMinConf(nTargetValue, 0, 1, vCoins, setCoinsRet, nValueRet));
+    // sort once, then try the outputs with the most confirmations first
+    vector<CInputCoin> vSorted;
+    SortCoins(vCoins, vSorted);
+    return (SelectCoinsFromPool(CCoinPool(vSorted, 1, 6), nTargetValue, setCoinsRet, nValueRet) ||
+            SelectCoinsFromPool(CCoinPool(vSorted, 1, 1), nTargetValue, setCoinsRet, nValueRet) ||
+            SelectCoinsFromPool(CCoinPool(vSorted, 0, 1), nTargetValue, setCoinsRet, nValueRet));
 }
 
 
@@ -1326,6 +1507,109 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend,
     return true;
 }
 
+// Spend up to nMaxInputs of the smallest confirmed outputs worth less than nMaxInputValue
+// to a single new output of ours, so that later transactions need fewer inputs.
+// Locked coins and outputs below -mininput are left alone, like AvailableCoins does.
+bool CWallet::CreateConsolidation(int64 nMaxInputValue, unsigned int nMaxInputs, CWalletTx& wtxNew, CReserveKey& reservekey,
+                                  int64& nFeeRet, std::string& strFailReason)
+{
+    wtxNew.BindWallet(this);
+
+    {
+        LOCK2(cs_main, cs_wallet);
+
+        vector<COutput> vCoins;
+        AvailableCoins(vCoins, true);
+        vector<CInputCoin> vSorted;
+        SortCoins(vCoins, vSorted);
+        CCoinPool pool(vSorted, 1, 6);
+
+        unsigned int nInputs = 0;
+        while (nInputs < pool.vCoins.size() && nInputs < nMaxInputs && pool.vCoins[nInputs].nValue < nMaxInputValue)
+            nInputs++;
+        if (nInputs < 2)
+        {
+            strFailReason = _("Not enough small outputs to consolidate");
+            return false;
+        }
+
+        CPubKey vchPubKey;
+        if (!reservekey.GetReservedKey(vchPubKey))
+        {
+            strFailReason = _("Keypool ran out, please call keypoolrefill first");
+            return false;
+        }
+        CScript scriptPubKey;
+        scriptPubKey.SetDestination(vchPubKey.GetID());
+
+        nFeeRet = nTransactionFee;
+        loop
+        {
+            wtxNew.vin.clear();
+            wtxNew.vout.clear();
+            wtxNew.fFromMe = true;
+
+            int64 nValueIn = 0;
+            double dPriority = 0;
+            for (unsigned int i = 0; i < nInputs; i++)
+            {
+                const CInputCoin& coin = pool.vCoins[i];
+                wtxNew.vin.push_back(CTxIn(coin.tx->GetHash(), coin.i));
+                nValueIn += coin.nValue;
+                dPriority += (double)coin.nValue * (coin.nDepth+1);
+            }
+
+            CTxOut txout(nValueIn - nFeeRet, scriptPubKey);
+            if (txout.nValue <= 0 || txout.IsDust())
+            {
+                strFailReason = _("The outputs to consolidate are worth less than the fee");
+                return false;
+            }
+            wtxNew.vout.push_back(txout);
+
+            // Sign
+            for (unsigned int i = 0; i < nInputs; i++)
+                if (!SignSignature(*this, *pool.vCoins[i].tx, wtxNew, i))
+                {
+                    strFailReason = _("Signing transaction failed");
+                    return false;
+                }
+
+            // Limit size, by spending fewer outputs
+            unsigned int nBytes = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION);
+            if (nBytes >= MAX_CONSOLIDATION_TX_SIZE)
+            {
+                unsigned int nFewer = (unsigned int)((uint64)nInputs * (MAX_CONSOLIDATION_TX_SIZE * 9 / 10) / nBytes);
+                nInputs = std::min(nInputs - 1, nFewer);
+                if (nInputs < 2)
+                {
+                    strFailReason = _("Transaction too large");
+                    return false;
+                }
+                continue;
+            }
+            dPriority /= nBytes;
+
+            // Check that enough fee is included
+            int64 nPayFee = nTransactionFee * (1 + (int64)nBytes / 1000);
+            bool fAllowFree = CTransaction::AllowFree(dPriority);
+            int64 nMinFee = wtxNew.GetMinFee(1, fAllowFree, GMF_SEND);
+            if (nFeeRet < max(nPayFee, nMinFee))
+            {
+                nFeeRet = max(nPayFee, nMinFee);
+                continue;
+            }
+
+            // Fill vtxPrev by copying from previous transactions vtxPrev
+            wtxNew.AddSupportingTransactions();
+            wtxNew.fTimeReceivedIsTxTime = true;
+
+            break;
+        }
+    }
+    return true;
+}
+
 bool CWallet::CreateTransaction(CScript scriptPubKey, int64 nValue,
                                 CWalletTx& wtxNew, CReserveKey& reservekey, int64& nFeeRet, std::string& strFailReason, const CCoinControl* coinControl)
 {
@@ -1360,6 +1644,7 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 CWalletTx &coin = mapWallet[txin.prevout.hash];
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
+                UpdateUnspent(coin);
                 coin.WriteToDisk();
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
@@ -1456,6 +1741,8 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         return nLoadWalletRet;
     fFirstRunRet = !vchDefaultKey.IsValid();
 
+    BuildOrderedTxItems();
+
     return DB_LOAD_OK;
 }
 
@@ -1518,6 +1805,57 @@ bool CWallet::SetDefaultKey(const CPubKey &vchPubKey)
     return true;
 }
 
+// few enough transactions wait for a block that a consolidation doesn't compete for space
+static const unsigned int CONSOLIDATION_MAX_MEMPOOL_TX = 100;
+
+// Consolidate the wallet's small outputs in the background once it has more than nMinOutputs
+// of them: at most once per block, while the memory pool is short and for at most nMaxFee.
+void ThreadConsolidateWallet(CWallet* pwallet, unsigned int nMinOutputs, int64 nMaxInputValue, int64 nMaxFee)
+{
+    RenameThread("bitcoin-consolidate");
+
+    const CBlockIndex* pindexLast = NULL;
+    loop
+    {
+        MilliSleep(60 * 1000);
+
+        if (pindexBest == pindexLast || IsInitialBlockDownload() || pwallet->IsLocked())
+            continue;
+        pindexLast = pindexBest;
+        if (mempool.size() > CONSOLIDATION_MAX_MEMPOOL_TX)
+            continue;
+
+        vector<COutput> vCoins;
+        pwallet->AvailableCoins(vCoins, true);
+        unsigned int nSmall = 0;
+        BOOST_FOREACH(const COutput& output, vCoins)
+            if (output.tx->vout[output.i].nValue < nMaxInputValue)
+                nSmall++;
+        if (nSmall <= nMinOutputs)
+            continue;
+
+        CWalletTx wtx;
+        CReserveKey reservekey(pwallet);
+        int64 nFee = 0;
+        std::string strFailReason;
+        if (!pwallet->CreateConsolidation(nMaxInputValue, DEFAULT_CONSOLIDATION_INPUTS, wtx, reservekey, nFee, strFailReason))
+        {
+            printf("ThreadConsolidateWallet() : %s\n", strFailReason.c_str());
+            continue;
+        }
+        if (nFee > nMaxFee)
+        {
+            printf("ThreadConsolidateWallet() : fee %s is above -consolidatemaxfee, waiting\n", FormatMoney(nFee).c_str());
+            continue;
+        }
+        if (!pwallet->CommitTransaction(wtx, reservekey))
+            printf("ThreadConsolidateWallet() : commit of %s failed\n", wtx.GetHash().ToString().c_str());
+        else
+            printf("ThreadConsolidateWallet() : %"PRIszu" of %u small outputs consolidated in %s, fee %s\n",
+                   wtx.vin.size(), nSmall, wtx.GetHash().ToString().c_str(), FormatMoney(nFee).c_str());
+    }
+}
+
 bool GetWalletFile(CWallet* pwallet, string &strWalletFileOut)
 {
     if (!pwallet->fFileBacked)
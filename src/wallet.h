@@ -11,6 +11,7 @@
 #include <stdlib.h>
 
 #include "main.h"
+#include "bloom.h"
 #include "key.h"
 #include "keystore.h"
 #include "script.h"
@@ -24,6 +25,10 @@ class CReserveKey;
 class COutput;
 class CCoinControl;
 
+// Consolidation transactions stay well below the size of the blocks miners create by default
+static const unsigned int MAX_CONSOLIDATION_TX_SIZE = MAX_BLOCK_SIZE_GEN / 2;
+static const unsigned int DEFAULT_CONSOLIDATION_INPUTS = 500;
+
 /** (client) version numbers for particular wallet features */
 enum WalletFeature
 {
@@ -79,6 +84,30 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
+    // Wallet transactions with an output that is ours and not spent. The balances and
+    // AvailableCoins look at these only, not at the whole history in mapWallet.
+    // Rebuilt from mapWallet when dirty, i.e. after loading or when keys were added.
+    mutable std::set<uint256> setUnspentTx;
+    mutable bool fUnspentDirty;
+    unsigned int nUnspentUpdates; // changes of wallet transactions, for the balance cache
+
+    // Balances as of pindexBalances and nBalancesUpdate; see CacheBalances()
+    mutable const CBlockIndex* pindexBalances;
+    mutable unsigned int nBalancesUpdate;
+    mutable int64 nBalanceCached;
+    mutable int64 nUnconfirmedBalanceCached;
+    mutable int64 nImmatureBalanceCached;
+
+    bool HasUnspentOutput(const CWalletTx& wtx) const;
+    void UpdateUnspent(const CWalletTx& wtx);
+    void CheckUnspent() const;
+    void CacheBalances() const;
+
+    // Set on shutdown; makes ScanForWalletTransactions return early
+    volatile bool fAbortRescan;
+
+    void GetRescanFilter(CBloomFilter& filter, std::set<uint256>& setWalletTx) const;
+
 public:
     mutable CCriticalSection cs_wallet;
 
@@ -100,6 +129,11 @@ public:
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
+        fUnspentDirty = true;
+        nUnspentUpdates = 0;
+        pindexBalances = NULL;
+        nBalancesUpdate = 0;
+        fAbortRescan = false;
     }
     CWallet(std::string strWalletFileIn)
     {
@@ -110,6 +144,11 @@ public:
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
+        fUnspentDirty = true;
+        nUnspentUpdates = 0;
+        pindexBalances = NULL;
+        nBalancesUpdate = 0;
+        fAbortRescan = false;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -126,7 +165,7 @@ public:
     bool CanSupportFeature(enum WalletFeature wf) { return nWalletMaxVersion >= wf; }
 
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl=NULL) const;
-    bool SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
+    bool SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
     bool IsLockedCoin(uint256 hash, unsigned int n) const;
     void LockCoin(COutPoint& output);
     void UnlockCoin(COutPoint& output);
@@ -148,6 +187,7 @@ public:
     // Adds an encrypted key to the store, without saving it to disk (used by LoadWallet)
     bool LoadCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret);
     bool AddCScript(const CScript& redeemScript);
+    bool ImportKeys(const std::vector<CKey>& vKeys, const std::vector<CScript>& vScripts, const std::map<CTxDestination, std::string>& mapLabels);
     bool LoadCScript(const CScript& redeemScript) { return CCryptoKeyStore::AddCScript(redeemScript); }
 
     bool Unlock(const SecureString& strWalletPassphrase);
@@ -162,18 +202,28 @@ public:
     typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
     typedef std::multimap<int64, TxPair > TxItems;
 
-    /** Get the wallet's activity log
-        @return multimap of ordered transactions and accounting entries
-        @warning Returned pointers are *only* valid within the scope of passed acentries
-     */
-    TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
+    // The wallet's activity log: all wallet transactions and accounting entries by
+    // nOrderPos, maintained as they are added. Guarded by cs_wallet.
+    TxItems wtxOrdered;
+    // The accounting entries of all accounts, owned here so wtxOrdered can point to them
+    std::list<CAccountingEntry> laccentries;
+    // Wallet transactions by the block they were found in, 0 if none
+    std::multimap<uint256, CWalletTx*> mapTxByBlock;
+
+    // Build wtxOrdered and mapTxByBlock after loading the wallet
+    void BuildOrderedTxItems();
+    bool AddAccountingEntry(const CAccountingEntry& acentry, CWalletDB& walletdb);
 
     void MarkDirty();
     bool AddToWallet(const CWalletTx& wtxIn);
     bool AddToWalletIfInvolvingMe(const uint256 &hash, const CTransaction& tx, const CBlock* pblock, bool fUpdate = false, bool fFindBlock = false);
+    // Called by the wallet event thread, without cs_main held
+    bool SyncTransaction(const uint256 &hash, const CTransaction& tx, const CBlock* pblock, bool fUpdate);
     bool EraseFromWallet(uint256 hash);
     void WalletUpdateSpent(const CTransaction& prevout);
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    void AbortRescan() { fAbortRescan = true; }
+    bool IsAbortingRescan() const { return fAbortRescan; }
     void ReacceptWalletTransactions();
     void ResendWalletTransactions();
     int64 GetBalance() const;
@@ -183,6 +233,8 @@ public:
                            CWalletTx& wtxNew, CReserveKey& reservekey, int64& nFeeRet, std::string& strFailReason, const CCoinControl *coinControl=NULL);
     bool CreateTransaction(CScript scriptPubKey, int64 nValue,
                            CWalletTx& wtxNew, CReserveKey& reservekey, int64& nFeeRet, std::string& strFailReason, const CCoinControl *coinControl=NULL);
+    bool CreateConsolidation(int64 nMaxInputValue, unsigned int nMaxInputs, CWalletTx& wtxNew, CReserveKey& reservekey,
+                             int64& nFeeRet, std::string& strFailReason);
     bool CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey);
     std::string SendMoney(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew, bool fAskFee=false);
     std::string SendMoneyToDestination(const CTxDestination &address, int64 nValue, CWalletTx& wtxNew, bool fAskFee=false);
@@ -361,6 +413,116 @@ static void WriteOrderPos(const int64& nOrderPos, mapValue_t& mapValue)
 }
 
 
+/** Skip a serialized vector of CMerkleTx without building the transactions */
+template<typename Stream>
+void SkipMerkleTxs(Stream& s)
+{
+    uint64 nTx = ReadCompactSize(s);
+    for (uint64 i = 0; i < nTx; i++)
+    {
+        s.ignore(4);                            // nVersion
+        uint64 nIn = ReadCompactSize(s);
+        for (uint64 j = 0; j < nIn; j++)
+        {
+            s.ignore(sizeof(COutPoint));        // prevout
+            s.ignore(ReadCompactSize(s));       // scriptSig
+            s.ignore(4);                        // nSequence
+        }
+        uint64 nOut = ReadCompactSize(s);
+        for (uint64 j = 0; j < nOut; j++)
+        {
+            s.ignore(8);                        // nValue
+            s.ignore(ReadCompactSize(s));       // scriptPubKey
+        }
+        s.ignore(4);                            // nLockTime
+        s.ignore(sizeof(uint256));              // hashBlock
+        s.ignore(sizeof(uint256) * ReadCompactSize(s)); // vMerkleBranch
+        s.ignore(4);                            // nIndex
+    }
+}
+
+/** The transactions a wallet transaction depends on. They are only needed to relay it
+ *  or to tell whether it can be trusted, so after loading the wallet they are kept
+ *  serialized until first used.
+ */
+class CWalletTxPrev
+{
+private:
+    mutable std::vector<CMerkleTx> vtx;
+    mutable std::vector<char> vchData; // vtx serialized, until decoded
+    mutable bool fDecoded;
+    int nType;
+    int nVersion;
+
+    void Decode() const
+    {
+        if (fDecoded)
+            return;
+        vtx.clear();
+        if (!vchData.empty())
+        {
+            try {
+                CBufferReader reader(&vchData[0], &vchData[0] + vchData.size(), nType, nVersion);
+                reader >> vtx;
+            }
+            catch (std::exception &e) {
+                vtx.clear();
+            }
+        }
+        std::vector<char>().swap(vchData);
+        fDecoded = true;
+    }
+
+public:
+    CWalletTxPrev() : fDecoded(true), nType(SER_DISK), nVersion(CLIENT_VERSION) {}
+
+    std::vector<CMerkleTx>& Get() { Decode(); return vtx; }
+    const std::vector<CMerkleTx>& Get() const { Decode(); return vtx; }
+
+    void SetNull()
+    {
+        vtx.clear();
+        vchData.clear();
+        fDecoded = true;
+    }
+
+    unsigned int GetSerializeSize(int nTypeIn, int nVersionIn) const
+    {
+        if (!fDecoded)
+            return vchData.size();
+        return ::GetSerializeSize(vtx, nTypeIn, nVersionIn);
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nTypeIn, int nVersionIn) const
+    {
+        if (!fDecoded)
+        {
+            if (!vchData.empty())
+                s.write(&vchData[0], vchData.size());
+        }
+        else
+            ::Serialize(s, vtx, nTypeIn, nVersionIn);
+    }
+
+    // Only finds where the transactions end; wallet transactions are read from a CDataStream
+    template<typename Stream>
+    void Unserialize(Stream& s, int nTypeIn, int nVersionIn)
+    {
+        vtx.clear();
+        nType = nTypeIn;
+        nVersion = nVersionIn;
+        const char* pbegin = s.empty() ? NULL : &s.begin()[0];
+        CBufferReader reader(pbegin, pbegin + s.size(), nType, nVersion);
+        SkipMerkleTxs(reader);
+        if (!reader.good())
+            throw std::ios_base::failure("CWalletTxPrev::Unserialize : end of data");
+        vchData.assign(pbegin, pbegin + reader.GetPos());
+        s.ignore(reader.GetPos());
+        fDecoded = false;
+    }
+};
+
 /** A transaction with a bunch of additional info that only the owner cares about.
  * It includes any unrecorded transactions needed to link it back to the block chain.
  */
@@ -370,7 +532,7 @@ private:
     const CWallet* pwallet;
 
 public:
-    std::vector<CMerkleTx> vtxPrev;
+    CWalletTxPrev vtxPrev;
     mapValue_t mapValue;
     std::vector<std::pair<std::string, std::string> > vOrderForm;
     unsigned int fTimeReceivedIsTxTime;
@@ -416,7 +578,7 @@ public:
     void Init(const CWallet* pwalletIn)
     {
         pwallet = pwalletIn;
-        vtxPrev.clear();
+        vtxPrev.SetNull();
         mapValue.clear();
         vOrderForm.clear();
         fTimeReceivedIsTxTime = false;
@@ -651,7 +813,7 @@ public:
         // consider it confirmed if all dependencies are confirmed
         std::map<uint256, const CMerkleTx*> mapPrev;
         std::vector<const CMerkleTx*> vWorkQueue;
-        vWorkQueue.reserve(vtxPrev.size()+1);
+        vWorkQueue.reserve(vtxPrev.Get().size()+1);
         vWorkQueue.push_back(this);
         for (unsigned int i = 0; i < vWorkQueue.size(); i++)
         {
@@ -666,7 +828,7 @@ public:
 
             if (mapPrev.empty())
             {
-                BOOST_FOREACH(const CMerkleTx& tx, vtxPrev)
+                BOOST_FOREACH(const CMerkleTx& tx, vtxPrev.Get())
                     mapPrev[tx.GetHash()] = &tx;
             }
 
@@ -860,4 +1022,6 @@ private:
 
 bool GetWalletFile(CWallet* pwallet, std::string &strWalletFileOut);
 
+void ThreadConsolidateWallet(CWallet* pwallet, unsigned int nMinOutputs, int64 nMaxInputValue, int64 nMaxFee);
+
 #endif
@@ -70,7 +70,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
 {
     bool fAllAccounts = (strAccount == "*");
 
-    Dbc* pcursor = GetCursor();
+    CDBCursor* pcursor = GetCursor();
     if (!pcursor)
         throw runtime_error("CWalletDB::ListAccountCreditDebit() : cannot create DB cursor");
     unsigned int fFlags = DB_SET_RANGE;
@@ -87,7 +87,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
             break;
         else if (ret != 0)
         {
-            pcursor->close();
+            delete pcursor;
             throw runtime_error("CWalletDB::ListAccountCreditDebit() : error scanning DB");
         }
 
@@ -106,7 +106,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
         entries.push_back(acentry);
     }
 
-    pcursor->close();
+    delete pcursor;
 }
 
 
@@ -183,6 +183,78 @@ CWalletDB::ReorderTransactions(CWallet* pwallet)
 }
 
 
+// Decoding a transaction or a key record takes no wallet state, so LoadWallet
+// does it on several threads; ReadKeyValue uses the same functions.
+static bool DecodeWalletTx(CDataStream& ssKey, CDataStream& ssValue, uint256& hash, CWalletTx& wtx)
+{
+    ssKey >> hash;
+    ssValue >> wtx;
+    CValidationState state;
+    return wtx.CheckTransaction(state) && (wtx.GetHash() == hash) && state.IsValid();
+}
+
+static void LoadWalletTx(CWallet* pwallet, const uint256& hash, const CWalletTx& wtxIn, CDataStream& ssValue,
+                         vector<uint256>& vWalletUpgrade, bool& fAnyUnordered, string& strErr)
+{
+    CWalletTx& wtx = pwallet->mapWallet[hash];
+    wtx = wtxIn;
+    wtx.BindWallet(pwallet);
+
+    // Undo serialize changes in 31600
+    if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
+    {
+        if (!ssValue.empty())
+        {
+            char fTmp;
+            char fUnused;
+            ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+            strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
+                               wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), hash.ToString().c_str());
+            wtx.fTimeReceivedIsTxTime = fTmp;
+        }
+        else
+        {
+            strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString().c_str());
+            wtx.fTimeReceivedIsTxTime = 0;
+        }
+        vWalletUpgrade.push_back(hash);
+    }
+
+    if (wtx.nOrderPos == -1)
+        fAnyUnordered = true;
+}
+
+// Checking that the private key matches the public key is the slow part of loading keys
+static bool DecodeWalletKey(const string& strType, CDataStream& ssKey, CDataStream& ssValue,
+                            CPubKey& vchPubKey, CKey& key, string& strErr)
+{
+    ssKey >> vchPubKey;
+    if (!vchPubKey.IsValid())
+    {
+        strErr = "Error reading wallet database: CPubKey corrupt";
+        return false;
+    }
+    CPrivKey pkey;
+    if (strType == "key")
+        ssValue >> pkey;
+    else {
+        CWalletKey wkey;
+        ssValue >> wkey;
+        pkey = wkey.vchPrivKey;
+    }
+    if (!key.SetPrivKey(pkey, vchPubKey.IsCompressed()))
+    {
+        strErr = "Error reading wallet database: CPrivKey corrupt";
+        return false;
+    }
+    if (key.GetPubKey() != vchPubKey)
+    {
+        strErr = "Error reading wallet database: CPrivKey pubkey inconsistency";
+        return false;
+    }
+    return true;
+}
+
 bool
 ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
              int& nFileVersion, vector<uint256>& vWalletUpgrade,
@@ -202,48 +274,10 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         else if (strType == "tx")
         {
             uint256 hash;
-            ssKey >> hash;
-            CWalletTx& wtx = pwallet->mapWallet[hash];
-            ssValue >> wtx;
-            CValidationState state;
-            if (wtx.CheckTransaction(state) && (wtx.GetHash() == hash) && state.IsValid())
-                wtx.BindWallet(pwallet);
-            else
-            {
-                pwallet->mapWallet.erase(hash);
+            CWalletTx wtx;
+            if (!DecodeWalletTx(ssKey, ssValue, hash, wtx))
                 return false;
-            }
-
-            // Undo serialize changes in 31600
-            if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
-            {
-                if (!ssValue.empty())
-                {
-                    char fTmp;
-                    char fUnused;
-                    ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                    strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
-                                       wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), hash.ToString().c_str());
-                    wtx.fTimeReceivedIsTxTime = fTmp;
-                }
-                else
-                {
-                    strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString().c_str());
-                    wtx.fTimeReceivedIsTxTime = 0;
-                }
-                vWalletUpgrade.push_back(hash);
-            }
-
-            if (wtx.nOrderPos == -1)
-                fAnyUnordered = true;
-
-            //// debug print
-            //printf("LoadWallet  %s\n", wtx.GetHash().ToString().c_str());
-            //printf(" %12"PRI64d"  %s  %s  %s\n",
-            //    wtx.vout[0].nValue,
-            //    DateTimeStrFormat("%Y-%m-%d %H:%M:%S", wtx.GetBlockTime()).c_str(),
-            //    wtx.hashBlock.ToString().c_str(),
-            //    wtx.mapValue["message"].c_str());
+            LoadWalletTx(pwallet, hash, wtx, ssValue, vWalletUpgrade, fAnyUnordered, strErr);
         }
         else if (strType == "acentry")
         {
@@ -265,31 +299,9 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         else if (strType == "key" || strType == "wkey")
         {
             CPubKey vchPubKey;
-            ssKey >> vchPubKey;
-            if (!vchPubKey.IsValid())
-            {
-                strErr = "Error reading wallet database: CPubKey corrupt";
-                return false;
-            }
             CKey key;
-            CPrivKey pkey;
-            if (strType == "key")
-                ssValue >> pkey;
-            else {
-                CWalletKey wkey;
-                ssValue >> wkey;
-                pkey = wkey.vchPrivKey;
-            }
-            if (!key.SetPrivKey(pkey, vchPubKey.IsCompressed()))
-            {
-                strErr = "Error reading wallet database: CPrivKey corrupt";
+            if (!DecodeWalletKey(strType, ssKey, ssValue, vchPubKey, key, strErr))
                 return false;
-            }
-            if (key.GetPubKey() != vchPubKey)
-            {
-                strErr = "Error reading wallet database: CPrivKey pubkey inconsistency";
-                return false;
-            }
             if (!pwallet->LoadKey(key, vchPubKey))
             {
                 strErr = "Error reading wallet database: LoadKey failed";
@@ -369,6 +381,47 @@ static bool IsKeyType(string strType)
             strType == "mkey" || strType == "ckey");
 }
 
+// A wallet record read by LoadWallet; transactions and keys are decoded by one of its workers
+struct CWalletRecord
+{
+    CDataStream ssKey;
+    CDataStream ssValue;
+    std::string strType;
+    bool fDecoded;
+    bool fOk;
+    std::string strErr;
+    uint256 hash;
+    CWalletTx wtx;
+    CPubKey vchPubKey;
+    CKey key;
+
+    CWalletRecord() : ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION), fDecoded(false), fOk(false) {}
+};
+
+void static DecodeWalletRecords(std::vector<CWalletRecord>* pvRecords, unsigned int nBegin, unsigned int nEnd)
+{
+    for (unsigned int i = nBegin; i < nEnd; i++) {
+        CWalletRecord& record = (*pvRecords)[i];
+        try {
+            // other records are read by ReadKeyValue, from the start of the key
+            CDataStream ssKey(record.ssKey);
+            ssKey >> record.strType;
+            if (record.strType == "tx") {
+                record.fDecoded = true;
+                record.fOk = DecodeWalletTx(ssKey, record.ssValue, record.hash, record.wtx);
+            } else if (record.strType == "key" || record.strType == "wkey") {
+                record.fDecoded = true;
+                record.fOk = DecodeWalletKey(record.strType, ssKey, record.ssValue, record.vchPubKey, record.key, record.strErr);
+            }
+        } catch (std::exception &e) {
+            record.fOk = false;
+        }
+    }
+}
+
+// records read from the wallet database before they are decoded
+static const unsigned int WALLET_LOAD_BATCH = 4096;
+
 DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
 {
     pwallet->vchDefaultKey = CPubKey();
@@ -378,6 +431,8 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
     bool fAnyUnordered = false;
     bool fNoncriticalErrors = false;
     DBErrors result = DB_LOAD_OK;
+    unsigned int nRecords = 0, nTx = 0, nKeys = 0;
+    int64 nTimeRead = 0, nTimeDecode = 0, nTimeLoad = 0;
 
     try {
         LOCK(pwallet->cs_wallet);
@@ -390,49 +445,105 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor)
         {
             printf("Error getting wallet database cursor\n");
             return DB_CORRUPT;
         }
 
-        loop
+        // Read the records in batches; the transactions and keys of a batch are decoded
+        // by nThreads workers, then all records are loaded in order by this thread
+        int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS));
+        std::vector<CWalletRecord> vRecords;
+        vRecords.reserve(WALLET_LOAD_BATCH);
+        bool fMore = true;
+        while (fMore)
         {
-            // Read next record
-            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-            int ret = ReadAtCursor(pcursor, ssKey, ssValue);
-            if (ret == DB_NOTFOUND)
-                break;
-            else if (ret != 0)
+            int64 nTime = GetTimeMicros();
+            vRecords.clear();
+            while (vRecords.size() < WALLET_LOAD_BATCH)
             {
-                printf("Error reading next record from wallet database\n");
-                return DB_CORRUPT;
+                // Read next record
+                vRecords.push_back(CWalletRecord());
+                int ret = ReadAtCursor(pcursor, vRecords.back().ssKey, vRecords.back().ssValue);
+                if (ret == DB_NOTFOUND)
+                {
+                    vRecords.pop_back();
+                    fMore = false;
+                    break;
+                }
+                else if (ret != 0)
+                {
+                    printf("Error reading next record from wallet database\n");
+                    delete pcursor;
+                    return DB_CORRUPT;
+                }
+            }
+            nTimeRead += GetTimeMicros() - nTime;
+
+            nTime = GetTimeMicros();
+            unsigned int nPerThread = (vRecords.size() + nThreads - 1) / nThreads;
+            if (nThreads > 1 && vRecords.size() > 256) {
+                boost::thread_group threadGroup;
+                for (unsigned int nBegin = nPerThread; nBegin < vRecords.size(); nBegin += nPerThread)
+                    threadGroup.create_thread(boost::bind(&DecodeWalletRecords, &vRecords, nBegin, std::min(nBegin + nPerThread, (unsigned int)vRecords.size())));
+                DecodeWalletRecords(&vRecords, 0, nPerThread);
+                threadGroup.join_all();
+            } else {
+                DecodeWalletRecords(&vRecords, 0, vRecords.size());
             }
+            nTimeDecode += GetTimeMicros() - nTime;
 
-            // Try to be tolerant of single corrupt records:
-            string strType, strErr;
-            if (!ReadKeyValue(pwallet, ssKey, ssValue, nFileVersion,
-                              vWalletUpgrade, fIsEncrypted, fAnyUnordered, strType, strErr))
+            nTime = GetTimeMicros();
+            BOOST_FOREACH(CWalletRecord& record, vRecords)
             {
-                // losing keys is considered a catastrophic error, anything else
-                // we assume the user can live with:
-                if (IsKeyType(strType))
-                    result = DB_CORRUPT;
+                // Try to be tolerant of single corrupt records:
+                string strType, strErr;
+                bool fOk;
+                if (record.fDecoded)
+                {
+                    strType = record.strType;
+                    strErr = record.strErr;
+                    fOk = record.fOk;
+                    if (fOk && strType == "tx")
+                    {
+                        LoadWalletTx(pwallet, record.hash, record.wtx, record.ssValue, vWalletUpgrade, fAnyUnordered, strErr);
+                        nTx++;
+                    }
+                    else if (fOk && !pwallet->LoadKey(record.key, record.vchPubKey))
+                    {
+                        strErr = "Error reading wallet database: LoadKey failed";
+                        fOk = false;
+                    }
+                    else if (fOk)
+                        nKeys++;
+                }
                 else
+                    fOk = ReadKeyValue(pwallet, record.ssKey, record.ssValue, nFileVersion,
+                                       vWalletUpgrade, fIsEncrypted, fAnyUnordered, strType, strErr);
+                if (!fOk)
                 {
-                    // Leave other errors alone, if we try to fix them we might make things worse.
-                    fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
-                    if (strType == "tx")
-                        // Rescan if there is a bad transaction record:
-                        SoftSetBoolArg("-rescan", true);
+                    // losing keys is considered a catastrophic error, anything else
+                    // we assume the user can live with:
+                    if (IsKeyType(strType))
+                        result = DB_CORRUPT;
+                    else
+                    {
+                        // Leave other errors alone, if we try to fix them we might make things worse.
+                        fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
+                        if (strType == "tx")
+                            // Rescan if there is a bad transaction record:
+                            SoftSetBoolArg("-rescan", true);
+                    }
                 }
+                if (!strErr.empty())
+                    printf("%s\n", strErr.c_str());
+                nRecords++;
             }
-            if (!strErr.empty())
-                printf("%s\n", strErr.c_str());
+            nTimeLoad += GetTimeMicros() - nTime;
         }
-        pcursor->close();
+        delete pcursor;
     }
     catch (boost::thread_interrupted) {
         throw;
@@ -441,6 +552,9 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
         result = DB_CORRUPT;
     }
 
+    printf("LoadWallet : %u records (%u transactions, %u keys): read %"PRI64d"ms, decode %"PRI64d"ms, load %"PRI64d"ms\n",
+           nRecords, nTx, nKeys, nTimeRead / 1000, nTimeDecode / 1000, nTimeLoad / 1000);
+
     if (fNoncriticalErrors && result == DB_LOAD_OK)
         result = DB_NONCRITICAL_ERROR;
 
@@ -529,6 +643,34 @@ void ThreadFlushWalletDB(const string& strFile)
     }
 }
 
+// Copy the files of a closed LevelDB database to a directory of the same name in strDest
+static bool BackupLevelDb(const filesystem::path& pathSrc, const string& strDest)
+{
+    filesystem::path pathDest(strDest);
+    if (filesystem::is_directory(pathDest))
+        pathDest /= pathSrc.filename();
+
+    try {
+        filesystem::create_directories(pathDest);
+        for (filesystem::directory_iterator it(pathSrc); it != filesystem::directory_iterator(); ++it)
+        {
+            // the lock file belongs to the open database
+            if (!filesystem::is_regular_file(it->status()) || it->path().filename() == "LOCK")
+                continue;
+#if BOOST_VERSION >= 104000
+            filesystem::copy_file(it->path(), pathDest / it->path().filename(), filesystem::copy_option::overwrite_if_exists);
+#else
+            filesystem::copy_file(it->path(), pathDest / it->path().filename());
+#endif
+        }
+        printf("copied %s to %s\n", pathSrc.string().c_str(), pathDest.string().c_str());
+        return true;
+    } catch(const filesystem::filesystem_error &e) {
+        printf("error copying %s to %s - %s\n", pathSrc.string().c_str(), pathDest.string().c_str(), e.what());
+        return false;
+    }
+}
+
 bool BackupWallet(const CWallet& wallet, const string& strDest)
 {
     if (!wallet.fFileBacked)
@@ -544,6 +686,9 @@ bool BackupWallet(const CWallet& wallet, const string& strDest)
                 bitdb.CheckpointLSN(wallet.strWalletFile);
                 bitdb.mapFileUseCount.erase(wallet.strWalletFile);
 
+                if (bitdb.fUseLevelDb)
+                    return BackupLevelDb(bitdb.GetLevelDbPath(wallet.strWalletFile), strDest);
+
                 // Copy wallet.dat
                 filesystem::path pathSrc = GetDataDir() / wallet.strWalletFile;
                 filesystem::path pathDest(strDest);
@@ -659,3 +804,19 @@ bool CWalletDB::Recover(CDBEnv& dbenv, std::string filename)
 {
     return CWalletDB::Recover(dbenv, filename, false);
 }
+
+//
+// LevelDB checksums its records; repairing keeps every record that still reads back.
+//
+bool CWalletDB::RecoverLevelDb(std::string filename)
+{
+    filesystem::path path = bitdb.GetLevelDbPath(filename);
+    leveldb::Status status = leveldb::RepairDB(path.string(), leveldb::Options());
+    if (!status.ok())
+    {
+        printf("Repairing %s failed: %s\n", path.string().c_str(), status.ToString().c_str());
+        return false;
+    }
+    printf("Repaired %s\n", path.string().c_str());
+    return true;
+}
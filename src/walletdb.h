@@ -158,6 +158,7 @@ public:
     DBErrors LoadWallet(CWallet* pwallet);
     static bool Recover(CDBEnv& dbenv, std::string filename, bool fOnlyKeys);
     static bool Recover(CDBEnv& dbenv, std::string filename);
+    static bool RecoverLevelDb(std::string filename);
 };
 
 #endif // BITCOIN_WALLETDB_H